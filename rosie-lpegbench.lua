@@ -0,0 +1,140 @@
+-- -*- Mode: Lua; -*-
+--
+-- rosie-lpegbench.lua   Throughput benchmark for rosie-lpeg
+--
+-- Usage:  lua rosie-lpegbench.lua [syslogfile [repetitions [maxthreads]]]
+--
+-- Matches every line of a syslog file (or, when no file is given, a
+-- generated corpus of syslog-like lines) against a syslog pattern built
+-- from rcap captures, and reports the throughput for each output
+-- encoding.  Then matches the whole corpus with rmatch_parallel, using
+-- from 1 to maxthreads (default 8) threads, and reports how the
+-- throughput scales.  To compare two builds of lpeg.so (e.g. the default one,
+-- which dispatches instructions with computed gotos, and one built with
+-- 'make linux LPEG_SWITCH=1'), run this script once against each.
+
+local lpeg = require "lpeg"
+
+local P, R, S, rcap = lpeg.P, lpeg.R, lpeg.S, lpeg.rcap
+
+---------------------------------------------------------------------------------------------------
+-- Pattern
+---------------------------------------------------------------------------------------------------
+
+local digit = R"09"
+local alpha = R("az", "AZ")
+local ws = S" \t"^1
+
+local months = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec"}
+local month = P(false)
+for _, m in ipairs(months) do month = month + P(m); end
+
+local octet = digit * digit^-2
+local ipv4 = rcap(octet * "." * octet * "." * octet * "." * octet, "ipv4")
+local int = rcap(digit^1, "int")
+local word = rcap(alpha * (alpha + digit + S"-_")^0, "word")
+local other = rcap((1 - S" \t")^1, "other")
+local token = (ipv4 * #(S" \t" + -P(1))) + (int * #(S" \t" + -P(1))) + word + other
+
+local syslog =
+   rcap(rcap(month, "month") * ws *
+	rcap(digit * digit^-1, "day") * ws *
+	rcap(digit * digit * ":" * digit * digit * ":" * digit * digit, "time") * ws *
+	rcap((alpha + digit + S"-._")^1, "host") * ws *
+	rcap((1 - S"[: ")^1, "process") *
+	(P"[" * rcap(digit^1, "pid") * P"]")^-1 * P":" * ws^-1 *
+	rcap((token * ws^-1)^0, "message"),
+     "syslog")
+
+---------------------------------------------------------------------------------------------------
+-- Corpus
+---------------------------------------------------------------------------------------------------
+
+local function generate(n)
+   local hosts = {"web-01", "db.example.com", "mail", "10.1.2.3", "cache_7"}
+   local procs = {"sshd", "kernel", "CRON", "systemd-logind", "postfix/smtpd"}
+   local msgs = {
+      "Accepted password for root from 192.168.10.%d port %d ssh2",
+      "pam_unix(cron:session): session opened for user backup by (uid=%d) %d",
+      "eth0: link up, %d Mbps, full duplex, flow control %d",
+      "connect from unknown[203.0.113.%d] after %d attempts",
+      "Removed session %d of user admin with exit code 0x%x",
+   }
+   local lines = {}
+   local seed = 12345
+   local function rand(k)
+      seed = (seed * 1103515245 + 12345) % 2147483648
+      return seed % k
+   end
+   for i = 1, n do
+      local msg = string.format(msgs[rand(#msgs)+1], rand(256), rand(65536))
+      lines[i] = string.format("%s %2d %02d:%02d:%02d %s %s[%d]: %s",
+			       months[rand(12)+1], rand(28)+1,
+			       rand(24), rand(60), rand(60),
+			       hosts[rand(#hosts)+1], procs[rand(#procs)+1],
+			       rand(32768), msg)
+   end
+   return lines
+end
+
+local function load(filename)
+   local lines = {}
+   for line in io.lines(filename) do lines[#lines+1] = line; end
+   return lines
+end
+
+---------------------------------------------------------------------------------------------------
+-- Benchmark
+---------------------------------------------------------------------------------------------------
+
+local filename, reps = arg and arg[1], tonumber(arg and arg[2]) or 5
+local maxthreads = tonumber(arg and arg[3]) or 8
+local lines = filename and load(filename) or generate(100000)
+local bytes = 0
+for _, line in ipairs(lines) do bytes = bytes + #line; end
+
+print(string.format("%d lines, %.1f MB, %d repetitions%s",
+		    #lines, bytes / 2^20, reps,
+		    filename and (" (" .. filename .. ")") or " (generated)"))
+
+local encodings = {{"byte", 3}, {"json", 1}, {"line", 2}, {"msgpack", 4}, {"cbor", 5}, {"offsets", 7}}
+
+for _, enc in ipairs(encodings) do
+   local name, code = enc[1], enc[2]
+   local matched = 0
+   local t0 = os.clock()
+   for _ = 1, reps do
+      for _, line in ipairs(lines) do
+	 if syslog:rmatch(line, 1, code) then matched = matched + 1; end
+      end
+   end
+   local t = os.clock() - t0
+   print(string.format("%-7s %8.3f s  %10.0f lines/s  %8.2f MB/s  (%d matched)",
+		       name, t, (#lines * reps) / t, (bytes * reps) / t / 2^20, matched))
+end
+
+---------------------------------------------------------------------------------------------------
+-- Thread scaling
+---------------------------------------------------------------------------------------------------
+
+local input = filename and lpeg.mmap(filename)
+if not input then
+   input = lpeg.newbuffer()
+   lpeg.add(input, table.concat(lines, "\n") .. "\n")
+end
+local shared = lpeg.export(syslog)
+
+print()
+print(string.format("rmatch_parallel, byte encoding, 1 to %d threads", maxthreads))
+local base
+for nthreads = 1, maxthreads do
+   local t, n = 0
+   for _ = 1, reps do
+      local _, k, secs = lpeg.rmatch_parallel(shared, input, 3, nthreads)
+      t, n = t + secs, k
+   end
+   base = base or t
+   print(string.format("%3d    %8.3f s  %10.0f lines/s  %8.2f MB/s  (%.2fx)",
+		       nthreads, t, (n * reps) / t, (#input * reps) / t / 2^20, base / t))
+end
@@ -301,6 +301,1075 @@ check_table(t, "S", 1, 5, 1)
 check_table(t.subs[1], "A", 2, 5, 1)
 
 
+heading("Halt")
+
+subheading("Captures cut off by a halt are closed one level at a time")
+
+inner = lpeg.rcap(lpeg.R"az"^1 * lpeg.P":" * lpeg.Halt(), "inner")
+middle = lpeg.rcap(lpeg.P"<" * inner, "middle")
+outer = lpeg.rcap(lpeg.P"[" * middle, "outer")
+
+s, last, abend = outer:rmatch("[<xy:zz", 1, 1)	    -- "json"
+check(type(s)=="userdata")
+check(abend)
+check(last==2)
+t = json.decode(lpeg.getdata(s))
+check_table(t, "outer", 1, 6)
+check(t.data=="[<xy:")
+check_table(t.subs[1], "middle", 2, 6)
+check(t.subs[1].data=="<xy:")
+check_table(t.subs[1].subs[1], "inner", 3, 6)
+check(t.subs[1].subs[1].data=="xy:")
+
+s, last, abend = outer:rmatch("[<xy:zz", 1, 3)	    -- "byte"
+check(type(s)=="userdata")
+check(abend)
+t = lpeg.decode(s)
+check_table(t, "outer", 1, 6, 1)
+check_table(t.subs[1], "middle", 2, 6, 1)
+check_table(t.subs[1].subs[1], "inner", 3, 6)
+
+heading("Range instructions")
+
+subheading("Charsets of one or two ranges match like the characters they hold")
+
+function check_charset(set, pred, msg)
+   local ok = true
+   local star = set^0 * lpeg.Cp()
+   for i = 0, 255 do
+      local c = string.char(i)
+      local n = pred(c) and 1 or 0
+      ok = ok and (set:match(c) == (pred(c) and 2 or nil))
+      ok = ok and ((set * "y" + lpeg.P(1)):match(c .. "y") == 2 + n)
+      ok = ok and (star:match(c .. c) == 1 + 2*n)
+   end
+   check(ok, msg, 1)
+end
+
+check_charset(lpeg.R"09", function(c) return c:find("^%d") end, "one range")
+check_charset(lpeg.R("az", "AZ"), function(c) return c:find("^%a") end, "two ranges")
+check_charset(lpeg.R("09", "az", "AZ"), function(c) return c:find("^%w") end, "three ranges (a set)")
+check_charset(lpeg.S"xy", function(c) return c=="x" or c=="y" end, "range of two characters")
+check_charset(lpeg.S"ac", function(c) return c=="a" or c=="c" end, "two single characters")
+check_charset(lpeg.R("\0\1", "\254\255"), function(c) local b = c:byte(); return b < 2 or b > 253 end,
+	      "ranges at both ends")
+check_charset(lpeg.P(1) - lpeg.R"az", function(c) return not c:find("^[a-z]") end, "complement of a range")
+check((lpeg.R"09"^1):match("2024-10-18") == 5)
+check((lpeg.S" \t"^0 * lpeg.Cp()):match(" \t \tx") == 5)
+
+subheading("Long spans stop at the first character not in the set")
+
+-- the position after the run of characters satisfying 'pred' at the
+-- start of 'subject', found a byte at a time
+function spanend(subject, pred)
+   local i = 1
+   while i <= #subject and pred(subject:sub(i, i)) do i = i + 1; end
+   return i
+end
+
+-- 'set'^0 over runs of its members (longer than the vector width)
+-- that end with a non-member 'stop' at every offset from 0 to 70, or
+-- at the end of the subject
+function check_span(set, pred, stop, msg)
+   local members = {}
+   for i = 0, 255 do
+      if pred(string.char(i)) then table.insert(members, string.char(i)); end
+   end
+   local run = {}
+   for i = 1, 150 do run[i] = members[(i * 7) % #members + 1]; end
+   run = table.concat(run)
+   local star = set^0 * lpeg.Cp()
+   local ok = true
+   for k = 0, 70 do
+      for _, subject in ipairs{run:sub(1, k) .. stop .. run, run:sub(1, k), run:sub(1, 64 + k)} do
+	 ok = ok and (star:match(subject) == spanend(subject, pred))
+      end
+   end
+   check(ok, msg, 1)
+end
+
+check_span(lpeg.R"09", function(c) return c:find("^%d") end, "x", "one range")
+check_span(lpeg.R"\128\255", function(c) return c:byte() >= 128 end, "\127", "one range of high bytes")
+check_span(lpeg.R("az", "\200\255"), function(c) return c:find("^[a-z]") or c:byte() >= 200 end,
+	   "\199", "two ranges, one of high bytes")
+check_span(lpeg.R("\0\1", "\254\255"), function(c) local b = c:byte(); return b < 2 or b > 253 end,
+	   "\253", "two ranges at both ends")
+check_span(lpeg.R("09", "az", "\128\255"), function(c) return c:find("^[0-9a-z]") or c:byte() >= 128 end,
+	   "A", "a set with high bytes")
+check_span(lpeg.S"a\0\255", function(c) return c == "a" or c == "\0" or c == "\255" end, "\254",
+	   "a set of single characters")
+check_span(lpeg.P(1) - lpeg.S"\n", function(c) return c ~= "\n" end, "\n", "all but one character")
+
+heading("String instructions")
+
+subheading("Literal strings match like a sequence of characters")
+
+-- the end of the first literal of 'list' that prefixes 'input', as the
+-- ordered choice of those literals would match it
+function firstprefix(list, input)
+   for _, lit in ipairs(list) do
+      if input:sub(1, #lit) == lit then return #lit + 1; end
+   end
+   return nil
+end
+
+function check_literals(list, inputs, msg)
+   local p = lpeg.P(list[1])
+   for i = 2, #list do p = p + lpeg.P(list[i]); end
+   local ok = true
+   for _, input in ipairs(inputs) do
+      ok = ok and (p:match(input) == firstprefix(list, input))
+   end
+   check(ok, msg, 1)
+end
+
+words = {"GET /", "GET", "POST", "PUT", "P", "PUTS", "DELETE"}
+inputs = {"", "G", "GE", "GET", "GET ", "GET /", "GET /x", "POST", "POS", "PUT", "PUTS",
+	  "PU", "P", "DELETE", "DELET", "XGET"}
+check_literals(words, inputs, "ordered choice of literals")
+check_literals({"ab", "abc"}, {"a", "ab", "abc", "abd", "b"}, "shorter literal first")
+check_literals({"abc", "ab"}, {"a", "ab", "abc", "abd", "b"}, "longer literal first")
+check_literals({"aaaa", "aaab", "aab"}, {"aaaa", "aaab", "aab", "aaa", "aac"},
+	       "literals sharing a prefix")
+
+long = string.rep("0123456789", 4000)
+check(lpeg.P(long):match(long .. "x") == #long + 1, "literal longer than one instruction")
+check(not lpeg.P(long):match(long:sub(1, -2)), "subject shorter than a long literal")
+check(((lpeg.P"ab" + "cd") * lpeg.P"ef"):match("cdef") == 5)
+check(((lpeg.P"ab" * "xy" + "ab") * lpeg.P"ef"):match("abef") == 5)
+check(not (lpeg.P"ab" * "xy" + "ab" * lpeg.P"cd"):match("abx"))
+check(((lpeg.P"a" * "bc" + "ad") * lpeg.P(-1)):match("abc") == 4)
+
+heading("Dispatch")
+
+subheading("Choices with many alternatives match like the alternatives in order")
+
+-- the match of the first alternative in 'alts' that matches 'input'
+function firstmatch(alts, input)
+   for _, alt in ipairs(alts) do
+      local e = alt:match(input)
+      if e then return e; end
+   end
+   return nil
+end
+
+function check_choice(alts, inputs, msg)
+   local p = alts[1]
+   for i = 2, #alts do p = p + alts[i]; end
+   local ok = true
+   for _, input in ipairs(inputs) do
+      ok = ok and (p:match(input) == firstmatch(alts, input))
+   end
+   check(ok, msg, 1)
+end
+
+months = {}
+for _, m in ipairs{"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct",
+		   "Nov", "Dec"} do table.insert(months, lpeg.P(m)); end
+inputs = {"", "J", "Jan", "Jun", "Jul", "Ju", "May", "Mar", "Ma", "Dec 1", "jan", "Xyz"}
+check_choice(months, inputs, "months")
+
+alts = {lpeg.R"09"^1 * "." * lpeg.R"09"^1, lpeg.R"09"^1, lpeg.P"-" * lpeg.R"09"^1,
+	lpeg.R"az"^1, lpeg.P"\"" * (1 - lpeg.P"\"")^0 * "\"", lpeg.S" \t"^1}
+inputs = {"", "12", "12.5", "12.", "-3", "-", "abc", "\"q\"", "\"q", "  x", "!", "A"}
+check_choice(alts, inputs, "alternatives starting with sets")
+
+table.insert(alts, 3, lpeg.P"x"^0)
+check_choice(alts, inputs, "an alternative that matches the empty string")
+alts[3] = lpeg.P"1" * "x"
+check_choice(alts, inputs, "alternatives whose first chars overlap")
+table.insert(alts, lpeg.P(true))
+check_choice(alts, inputs, "an empty last alternative")
+table.insert(alts, 1, lpeg.P"a" * lpeg.Halt())
+s, last, abend = (alts[1] + alts[2] + alts[3] + alts[4] + alts[5]):rmatch("abc")
+check(abend)
+check(last==2)
+
+heading("Trie")
+
+subheading("Choices of many literals match like the literals in order")
+
+prefixes = {}
+for i = 1, 20 do table.insert(prefixes, string.rep("a", i)); end
+inputs = {"", "a", "aaa", string.rep("a", 20), string.rep("a", 30), "b", "ab"}
+check_literals(prefixes, inputs, "each literal a prefix of the next")
+reversed = {}
+for i = 20, 1, -1 do table.insert(reversed, string.rep("a", i)); end
+check_literals(reversed, inputs, "each literal a prefix of the one before")
+
+words = {"a", "ab", "abc", "b", "ba", "abd", "c", "cab", "abcd", "bad", "d", "da",
+	 "dab", "e", "ea", "eab", "f", "fa", "ab", "fab"}
+inputs = {"", "a", "ab", "abc", "abcd", "abcde", "abd", "ba", "bad", "cab", "ca", "dab",
+	  "fab", "fa", "g", "\0", "\255"}
+check_literals(words, inputs, "literals sharing prefixes")
+table.insert(words, 10, "")
+check_literals(words, inputs, "an empty literal")
+
+hosts = {}
+for i = 1, 1000 do table.insert(hosts, "host" .. i .. ".example.com"); end
+inputs = {"host1.example.com", "host10.example.com", "host1000.example.com",
+	  "host1001.example.com", "host.example.com", "host99.example.co"}
+check_literals(hosts, inputs, "many literals")
+
+alts = {}
+for _, w in ipairs(words) do table.insert(alts, lpeg.P(w)); end
+table.insert(alts, 5, lpeg.S"xyz")
+check_choice(alts, inputs, "a set among the literals")
+table.insert(alts, lpeg.R"09"^1)
+table.insert(alts, lpeg.P"g" * lpeg.R"09")
+inputs = {"", "a", "abc", "bad", "x", "12", "g1", "g", "gx", "\255"}
+check_choice(alts, inputs, "literals followed by other alternatives")
+table.insert(alts, 1, lpeg.R"09"^1)
+check_choice(alts, inputs, "literals after another alternative")
+
+heading("rfind")
+
+subheading("rfind finds the first position where rmatch would match")
+
+-- the first position from 'start' where rmatch matches, and its output
+function firstfound(pat, input, start)
+   for k = math.min(start, #input + 1), #input + 1 do
+      local r = pat:rmatch(input, k, 1)
+      if r then return k, lpeg.getdata(r); end
+   end
+   return nil
+end
+
+function check_find(pat, inputs, msg)
+   local ok = true
+   pat = lpeg.rcap(pat, "top")
+   for _, input in ipairs(inputs) do
+      for start = 1, 3 do
+	 local r, last, abend, t0, t1, pos = pat:rfind(input, start, 1)
+	 local k, data = firstfound(pat, input, start)
+	 ok = ok and ((r and pos) == (k or false))
+	 ok = ok and ((r and lpeg.getdata(r)) == (data or false))
+      end
+   end
+   check(ok, msg, 1)
+end
+
+filler = string.rep("y", 100)
+inputs = {"", "ab", "xab", "xyzabc", filler .. "ab" .. filler, filler .. "a",
+	  filler .. "bca" .. filler .. "abc", "c", "cc", filler .. "xcc", "yx"}
+check_find(lpeg.P"ab", inputs, "a literal")
+check_find(lpeg.P"abc" + lpeg.P"bca", inputs, "a choice of literals")
+check_find(lpeg.S"xa" * lpeg.P"b"^0, inputs, "a set")
+check_find(lpeg.P"x" * lpeg.rcap(lpeg.P"c"^1, "cs"), inputs, "a capture")
+check_find(lpeg.P"z"^0, inputs, "a pattern that matches the empty string")
+check_find(lpeg.P(false), inputs, "a pattern that never matches")
+check_find(#lpeg.P"b" * 1, inputs, "a predicate")
+check_find(-lpeg.P"y" * lpeg.P(1), inputs, "a negated predicate")
+check_find(lpeg.B"a" * "b", inputs, "a look-behind")
+
+r, last, abend, t0, t1, pos = lpeg.P"ab":rfind("xxabx", 1, 1)
+check(pos==3)
+check(last==1)
+r, last, abend, t0, t1, pos = lpeg.P"ab":rfind("xxax", 1, 1)
+check(r==false)
+check(pos==false)
+
+heading("rmatch_batch")
+
+subheading("The index of a batch matches rmatch on each record")
+
+-- offset, length (-1 when no match), leftover and abend of record k
+function batchentry(index, k)
+   return string.unpack("<i4i4i4i4", lpeg.getdata(index), (k-1)*16 + 1)
+end
+
+function check_batch(pat, records, out, index, n, encoding, msg)
+   local ok = (n == #records)
+   local data = lpeg.getdata(out)
+   for k = 1, #records do
+      local off, len, left, abend = batchentry(index, k)
+      local r, l, ab = pat:rmatch(records[k], 1, encoding)
+      if r then ok = ok and len >= 0 and data:sub(off + 1, off + len) == lpeg.getdata(r)
+      else ok = ok and len == -1; end
+      ok = ok and left == l and (abend == 1) == ab
+   end
+   check(ok, msg, 1)
+end
+
+word = lpeg.rcap(lpeg.R"az"^1, "word")
+num = lpeg.rcap(lpeg.R"09"^1, "num")
+line = lpeg.rcap((word * lpeg.P" "^0)^0 * num, "line")
+records = {"abc 12", "12", "", "abc", "x y z 345xx", "99", "stop"}
+for _, encoding in ipairs{1, 2, 3} do
+   out, index, n = lpeg.rmatch_batch(line, records, encoding)
+   check_batch(line, records, out, index, n, encoding, "list, encoding " .. encoding)
+   buf = lpeg.newbuffer()
+   lpeg.add(buf, table.concat(records, "\n"))
+   out, index, n = lpeg.rmatch_batch(line, buf, encoding)
+   check_batch(line, records, out, index, n, encoding, "buffer, encoding " .. encoding)
+end
+
+subheading("Records in a buffer")
+
+buf = lpeg.newbuffer()
+lpeg.add(buf, "12,ab 3,,x,")
+out, index, n = lpeg.rmatch_batch(line, buf, 1, ",")
+check_batch(line, {"12", "ab 3", "", "x"}, out, index, n, 1, "delimiter and no last record")
+buf = lpeg.newbuffer()
+out, index, n = lpeg.rmatch_batch(line, buf, 1)
+check(n==0 and #lpeg.getdata(index)==0, "empty buffer")
+
+halting = lpeg.rcap(lpeg.P"a" * lpeg.Halt(), "h") + line
+records = {"ab", "1", "ac"}
+out, index, n = lpeg.rmatch_batch(halting, records, 1)
+check_batch(halting, records, out, index, n, 1, "records that halt")
+
+ok, msg = pcall(lpeg.rmatch_batch, line, {"a", 3}, 1)
+check(not ok and msg:find("batch record 2 is not a string"))
+ok, msg = pcall(lpeg.rmatch_batch, line, buf, 1, ",,")
+check(not ok and msg:find("not a single char"))
+ok, msg = pcall(lpeg.rmatch_batch, line, 7, 1)
+check(not ok and msg:find("not a list"))
+
+heading("Streams")
+
+subheading("Records that straddle chunks match like whole lines")
+
+-- what a stream with the json encoding writes for 'records'
+function streamed(pat, records)
+   local t = {}
+   for _, rec in ipairs(records) do
+      local r = pat:rmatch(rec, 1, 1)
+      table.insert(t, (r and lpeg.getdata(r) or "") .. "\n")
+   end
+   return table.concat(t)
+end
+
+records = {"abc 12", "12", "", "abc", "x y z 345xx", "99"}
+text = table.concat(records, "\n")
+expected = streamed(line, records)
+for size = 1, 8 do
+   local st = lpeg.newstream(line, 1)
+   local out = lpeg.newbuffer()
+   local total = 0
+   for i = 1, #text, size do
+      local n, eof = lpeg.rmatch_stream(st, text:sub(i, i + size - 1), out)
+      total = total + n
+      check(not eof)
+   end
+   local n, eof = lpeg.rmatch_stream(st, nil, out)
+   check(eof)
+   check(total + n == #records, "records in chunks of " .. size)
+   check(lpeg.getdata(out) == expected, "output in chunks of " .. size)
+end
+
+subheading("The last record need not end in a newline")
+
+st = lpeg.newstream(line, 1)
+out = lpeg.newbuffer()
+n, eof = lpeg.rmatch_stream(st, "12\nab 3", out)
+check(n==1 and not eof)
+n, eof = lpeg.rmatch_stream(st, nil, out)
+check(n==1 and eof)
+check(lpeg.getdata(out) == streamed(line, {"12", "ab 3"}))
+n, eof = lpeg.rmatch_stream(st, "4\n", out)
+check(n==1, "stream starts over after its end")
+
+subheading("Files")
+
+f = io.tmpfile()
+f:write(text)
+f:seek("set")
+st = lpeg.newstream(line, 1)
+out = lpeg.newbuffer()
+total = 0
+repeat
+   n, eof = lpeg.rmatch_stream(st, f, out)
+   total = total + n
+until eof
+check(total == #records)
+check(lpeg.getdata(out) == expected)
+f:close()
+ok, msg = pcall(lpeg.rmatch_stream, st, f, out)
+check(not ok and msg:find("attempt to use a closed file"))
+
+heading("mmap")
+
+subheading("A mapped file matches like the string it holds")
+
+records = {}
+for i = 1, 2000 do table.insert(records, string.rep("ab ", i % 7) .. i); end
+text = table.concat(records, "\n")
+name = os.tmpname()
+f = io.open(name, "w")
+f:write(text)
+f:close()
+
+m = lpeg.mmap(name)
+check(#m == #text)
+check(m:sub(1, 50) == text:sub(1, 50))
+check(m:sub(-20) == text:sub(-20))
+m:window(0, #records[1])
+check(lpeg.getdata(line:rmatch(m, 1, 1)) == lpeg.getdata(line:rmatch(records[1], 1, 1)))
+m:window(#records[1] + 1, #records[2])
+check(lpeg.getdata(line:rmatch(m, 1, 1)) == lpeg.getdata(line:rmatch(records[2], 1, 1)))
+m:window(0)
+check(#m == #text)
+out, index, n = lpeg.rmatch_batch(line, m, 1)
+check_batch(line, records, out, index, n, 1, "batch over a mapped file")
+
+subheading("Offsets, windows and errors")
+
+off = 5000		       -- not at a page boundary
+m2 = lpeg.mmap(name, off, 300)
+check(#m2 == 300 and m2:sub(1) == text:sub(off + 1, off + 300))
+m2:window(10, 20)
+check(m2:sub(1) == text:sub(off + 11, off + 30))
+ok, msg = pcall(m2.window, m2, 301)
+check(not ok and msg:find("out of range"))
+check(#lpeg.mmap(name, #text + 10) == 0, "offset past the end")
+m2:close()
+check(#m2 == 0, "closed")
+m, msg = lpeg.mmap(name .. ".none")
+check(m == nil and msg:find("No such file"))
+os.remove(name)
+
+heading("export")
+
+subheading("An exported pattern matches like the pattern")
+
+deep = lpeg.P{"S", S = lpeg.rcap(lpeg.P"(" * lpeg.V"S" * lpeg.P")", "paren") + lpeg.P""}
+pats = {line, halting, lpeg.rcap(deep, "g"), lpeg.rcap(lpeg.rcap(lpeg.P(1), "c")^0, "all"),
+	lpeg.rcap(lpeg.rconstcap("const", "k") * word, "kw")}
+subjects = {"abc de 123", "ab", "ac", string.rep("(", 3000) .. string.rep(")", 3000),
+	    string.rep("xy\"\\\n", 500), "", "zz 9"}
+for i, pat in ipairs(pats) do
+   local sp = lpeg.export(pat)
+   local ok = true
+   for _, subject in ipairs(subjects) do
+      for _, encoding in ipairs{1, 2, 3} do
+	 for _, start in ipairs{1, 3} do
+	    local data, last, abend = sp:match(subject, start, encoding)
+	    local r, l, ab = pat:rmatch(subject, start, encoding)
+	    ok = ok and data == (r and lpeg.getdata(r)) and last == l and abend == ab
+	 end
+      end
+   end
+   check(ok, "pattern " .. i)
+   buf = lpeg.newbuffer()
+   lpeg.add(buf, "abc 42")
+   check(sp:match(buf, 1, 1) == sp:match("abc 42", 1, 1), "buffer subject " .. i)
+end
+
+subheading("References and errors")
+
+sp = lpeg.export(line)
+check(sp:refs() == 1)
+sp:release()
+check(sp:refs() == 0)
+ok, msg = pcall(sp.match, sp, "abc 1")
+check(not ok)
+for _, pat in ipairs{lpeg.rcap(lpeg.Cmt(lpeg.P"a", function() return true end), "x"),
+		     lpeg.C(lpeg.P"a"), lpeg.Ct(lpeg.rcap(lpeg.P"a", "x"))} do
+   ok, msg = pcall(lpeg.export, pat)
+   check(not ok and msg:find("cannot export a pattern with a capture that produces a Lua value"))
+end
+
+heading("rmatch_parallel")
+
+subheading("A parallel match writes what a stream would, in input order")
+
+-- what a stream writes for 'text', and the number of records
+function streamout(pat, text, encoding)
+   local st = lpeg.newstream(pat, encoding)
+   local out = lpeg.newbuffer()
+   local n = lpeg.rmatch_stream(st, text, out)
+   local k = lpeg.rmatch_stream(st, nil, out)
+   return lpeg.getdata(out), n + k
+end
+
+sp = lpeg.export(line)
+records = {}
+for i = 1, 3000 do table.insert(records, string.rep("ab ", i % 5) .. (i % 7 == 0 and "" or i)); end
+text = table.concat(records, "\n")
+for _, input in ipairs{text, text .. "\n", "", "\n\n\n", "x"} do
+   for _, encoding in ipairs{1, 2, 3} do
+      local expected, count = streamout(line, input, encoding)
+      local ok = true
+      for _, threads in ipairs{1, 2, 3, 8} do
+	 for _, chunksize in ipairs{0, 1, 100, 5000} do
+	    local out, n, t = lpeg.rmatch_parallel(sp, input, encoding, threads, chunksize)
+	    ok = ok and n == count and lpeg.getdata(out) == expected and type(t) == "number"
+	 end
+      end
+      check(ok, "input of " .. #input .. " bytes, encoding " .. encoding)
+   end
+end
+buf = lpeg.newbuffer()
+lpeg.add(buf, text)
+check(lpeg.getdata(lpeg.rmatch_parallel(sp, buf, 1, 4)) == streamout(line, text, 1), "buffer")
+
+subheading("Errors")
+
+ok, msg = pcall(lpeg.rmatch_parallel, sp, text, -1)
+check(not ok and msg:find("invalid encoding"))
+ok, msg = pcall(lpeg.rmatch_parallel, sp, text, 1, 0)
+check(not ok and msg:find("out of range"))
+ok, msg = pcall(lpeg.rmatch_parallel, line, text, 1)
+check(not ok and msg:find("ROSIE_SHARED expected"))
+sdeep = lpeg.export(lpeg.rcap(lpeg.P{"S", S = lpeg.P"(" * lpeg.V"S" * lpeg.P")" + lpeg.P""}, "g"))
+ok, msg = pcall(lpeg.rmatch_parallel, sdeep, "()\n" .. string.rep("(", 20000) .. "\n", 1, 4, 1)
+check(not ok and msg:find("backtrack stack overflow"))
+
+heading("Contexts")
+
+subheading("Nested matches share the default context")
+
+inner = lpeg.C(lpeg.R"az"^1)
+seen = {}
+outer = lpeg.C((lpeg.Cmt(lpeg.R"az"^1,
+			 function(s, i) seen[#seen+1] = inner:match(s, i - 3); return i end)
+		* lpeg.P" "^0)^1)
+check(outer:match("abc def ghi") == "abc def ghi")
+check(#seen == 3 and seen[1] == "abc" and seen[2] == "def" and seen[3] == "ghi")
+
+boom = lpeg.Cmt(lpeg.P"a", function() error("boom") end)
+for i = 1, 3 do check(not pcall(lpeg.match, boom, "a")); end
+check(lpeg.match(lpeg.C(lpeg.P"a"^1), "aaa") == "aaa", "the context recovers from an error")
+
+subheading("An explicit context grows once and shrinks lazily")
+
+parens = lpeg.rcap(lpeg.P{"S", S = lpeg.rcap(lpeg.P"(" * lpeg.V"S" * lpeg.P")", "p") + lpeg.P""}, "g")
+nested = string.rep("(", 2000) .. string.rep(")", 2000)
+ctx = lpeg.newcontext()
+r = lpeg.rmatch(parens, nested, 1, 1, 0, 0, ctx)
+stacksize, capsize = ctx:sizes()
+check(stacksize >= 2000 and capsize >= 4000)
+check(lpeg.getdata(r) == lpeg.getdata(lpeg.rmatch(parens, nested, 1, 1)))
+for i = 1, 2100 do lpeg.rmatch(parens, "()", 1, 3, 0, 0, ctx); end
+stacksize2, capsize2 = ctx:sizes()
+check(stacksize2 < stacksize and capsize2 < capsize)
+
+subheading("Every entry point takes a context")
+
+check(lpeg.rfind(parens, "xx()", 1, 1, 0, 0, ctx))
+out, index, n = lpeg.rmatch_batch(parens, {"()", "(())", "x"}, 1, "\n", ctx)
+check(n == 3)
+check(lpeg.rmatch_stream(lpeg.newstream(parens, 2), "()\n(\n", lpeg.newbuffer(), ctx) == 2)
+check(not pcall(lpeg.rmatch, parens, "()", 1, 1, 0, 0, {}))
+
+subheading("The stack limit applies to a context that already grew")
+
+lpeg.setmaxstack(500)
+check(not pcall(lpeg.rmatch, parens, nested, 1, 3, 0, 0, ctx))
+lpeg.setmaxstack(9000)
+check(lpeg.rmatch(parens, nested, 1, 1, 0, 0, ctx))
+
+heading("Limits")
+
+subheading("Subjects of 4GB or more are refused")
+
+-- a sparse file: mapping it reads none of its pages
+name = os.tmpname()
+f = io.open(name, "w")
+f:seek("set", 1 << 32)
+f:write("x")
+f:close()
+m = lpeg.mmap(name)
+a = lpeg.rcap(lpeg.P"a", "a")
+sa = lpeg.export(a)
+check(#m == (1 << 32) + 1)
+ok, msg = pcall(lpeg.rmatch, a, m, 1, 1)
+check(not ok and msg:find("input string too long"))
+ok, msg = pcall(sa.match, sa, m)
+check(not ok and msg:find("subject too long for a match"))
+m:window(0, (1 << 32) - 1)
+ok, msg = pcall(sa.match, sa, m)
+check(not ok and msg:find("subject too long for a match"), "one byte too long")
+m:window(0, (1 << 32) - 2)
+check(sa:match(m) == false, "the longest subject")
+m:window(0, (1 << 31) - 1)
+check(lpeg.rmatch(a, m, 1, 1) == false, "the longest subject for rmatch")
+m:window(0, 1 << 31)
+ok, msg = pcall(lpeg.rmatch, a, m, 1, 1)
+check(not ok and msg:find("input string too long"))
+m:window((1 << 32) - 1)
+sx = lpeg.export(lpeg.rcap(lpeg.P"\0x", "a"))
+check(sx:match(m) == sx:match("\0x"))
+m:close()
+sa:release(); sx:release()
+os.remove(name)
+
+subheading("A pattern holds at most MAXCAPIDX capture names")
+
+-- a pattern with n capture names in its ktable, that matches only "b"s
+function withnames(n)
+   if n == 0 then return lpeg.P"b"; end
+   if n % 2 == 1 then return lpeg.rcap(withnames(n - 1), "x"); end
+   local p = withnames(n / 2 - 1)
+   return lpeg.rcap(p, "x") * lpeg.rcap(p, "y")
+end
+
+maxcapidx = 1000000
+for _, n in ipairs{32766, 32767, 65535, 65536, maxcapidx - 1} do
+   local p = withnames(n) + lpeg.rcap(lpeg.P"a", "last")   -- "last" has key n + 1
+   check(lpeg.getdata(lpeg.rmatch(p, "a", 1, 1)) == '{"type":"last","s":1,"e":2,"data":"a"}',
+	 "capture key " .. (n + 1))
+end
+ok, msg = pcall(lpeg.rcap, withnames(maxcapidx), "over")
+check(not ok and msg:find("too many Lua values in pattern"))
+big = withnames(maxcapidx / 2)
+ok, msg = pcall(function() return big * lpeg.rcap(big, "over") end)
+check(not ok and msg:find("too many Lua values in pattern"))
+
+heading("Cursors")
+
+subheading("A cursor reads what decode reads")
+
+-- a table as a string, with its keys sorted, to compare tables
+function serialize(t)
+   if type(t) ~= "table" then return tostring(t); end
+   local keys, out = {}, {}
+   for k in pairs(t) do table.insert(keys, k); end
+   table.sort(keys, function(a, b) return tostring(a) < tostring(b) end)
+   for _, k in ipairs(keys) do table.insert(out, tostring(k) .. "=" .. serialize(t[k])); end
+   return "{" .. table.concat(out, ",") .. "}"
+end
+
+-- the match at cursor 'c' as a table, read in the order decode writes it
+function cursortable(c)
+   local t = {s = c:s(), e = c:e(), type = c:type(), data = c:data()}
+   local subs = {}
+   for sub in c:subs() do table.insert(subs, cursortable(sub)); end
+   if #subs > 0 then t.subs = subs; end
+   return t
+end
+
+-- the same, reading the end first and the subs after their siblings
+function cursortable2(c)
+   local t = {type = c:type()}
+   local subs = {}
+   for sub in c:subs() do table.insert(subs, sub); end
+   for i, sub in ipairs(subs) do subs[i] = cursortable2(sub); end
+   t.e = c:e(); t.s = c:s(); t.data = c:data()
+   if #subs > 0 then t.subs = subs; end
+   return t
+end
+
+w = lpeg.rcap(lpeg.R"az"^1, "w")
+pats = {
+   lpeg.rcap(w * (lpeg.P" " * w)^0, "ws"),
+   lpeg.rcap((w + num + (lpeg.P"-" * lpeg.rconstcap("DASH", "dash")))^0, "mix"),
+   parens,
+   lpeg.rcap(lpeg.rcap(w * lpeg.rcap(lpeg.P":" * lpeg.Halt(), "inner"), "mid"), "h2"),
+   lpeg.rconstcap("VAL", "k"),
+}
+for _, p in ipairs(pats) do
+   for _, input in ipairs{"", "abc", "abc def ghi", "ab-12-cd", "((((()))))", "abc:", "x-"} do
+      local r = lpeg.rmatch(p, input, 1, 3)
+      if r then
+	 local expected = serialize(lpeg.decode(r))
+	 check(serialize(cursortable(lpeg.cursor(r))) == expected, input)
+	 check(serialize(cursortable2(lpeg.cursor(r))) == expected, input)
+	 check(serialize(lpeg.cursor(r):decode()) == expected, input)
+      end
+   end
+end
+
+subheading("Cursors into batch output, and errors")
+
+out, index, n = lpeg.rmatch_batch(pats[1], {"abc de", "12", "x y z"}, 3)
+for k = 1, n do
+   local offset, len = batchentry(index, k)
+   if len >= 0 then
+      local c = lpeg.cursor(out, offset)
+      check(c:type() == "ws" and c:s() == 1)
+   end
+end
+check(select(2, batchentry(index, 2)) == -1)
+check(lpeg.cursor(out, (batchentry(index, 3))):e() == 6)
+check(lpeg.cursor(lpeg.newbuffer()) == nil)
+bad = lpeg.newbuffer()
+lpeg.add(bad, "\255\255\255\255\3\0ab")
+ok, msg = pcall(function() return lpeg.cursor(bad):e() end)
+check(not ok and msg:find("corrupt match data"))
+ok, msg = pcall(lpeg.cursor, bad, 99)
+check(not ok and msg:find("out of range"))
+
+heading("MessagePack and CBOR")
+
+subheading("Both decode to what the byte encoding decodes to")
+
+-- the MessagePack value at 'pos' in 'data', and the position after it
+-- (only the types the encoder writes; a map also records its keys, in order)
+function unmsgpack(data, pos)
+   local b = data:byte(pos)
+   local function sized(fmt) return string.unpack(fmt, data, pos + 1) end
+   local n
+   if b < 0x80 then return b, pos + 1
+   elseif b == 0xcc then return sized(">I1")
+   elseif b == 0xcd then return sized(">I2")
+   elseif b == 0xce then return sized(">I4")
+   elseif b >= 0xa0 and b <= 0xbf then return data:sub(pos + 1, pos + b - 0xa0), pos + 1 + b - 0xa0
+   elseif b == 0xd9 or b == 0xc4 then return sized(">s1")
+   elseif b == 0xda or b == 0xc5 then return sized(">s2")
+   elseif b == 0xdb or b == 0xc6 then return sized(">s4")
+   elseif b >= 0x80 and b <= 0x8f then n, pos = b - 0x80, pos + 1
+      local t, keys = {}, {}
+      for i = 1, n do
+	 local k; k, pos = unmsgpack(data, pos)
+	 t[k], pos = unmsgpack(data, pos)
+	 table.insert(keys, k)
+      end
+      t.keys = table.concat(keys, " ")
+      return t, pos
+   elseif b == 0xdd then n, pos = sized(">I4")
+      local t = {}
+      for i = 1, n do t[i], pos = unmsgpack(data, pos); end
+      return t, pos
+   end
+   error("unexpected MessagePack byte " .. b)
+end
+
+-- the same for CBOR
+function uncbor(data, pos)
+   local b = data:byte(pos)
+   local major, info = b >> 5, b & 0x1f
+   local n
+   if info < 24 then n, pos = info, pos + 1
+   else n, pos = string.unpack(({">I1", ">I2", ">I4"})[info - 23], data, pos + 1); end
+   if major == 0 then return n, pos
+   elseif major == 2 or major == 3 then return data:sub(pos, pos + n - 1), pos + n
+   elseif major == 4 then
+      local t = {}
+      for i = 1, n do t[i], pos = uncbor(data, pos); end
+      return t, pos
+   elseif major == 5 then
+      local t, keys = {}, {}
+      for i = 1, n do
+	 local k; k, pos = uncbor(data, pos)
+	 t[k], pos = uncbor(data, pos)
+	 table.insert(keys, k)
+      end
+      t.keys = table.concat(keys, " ")
+      return t, pos
+   end
+   error("unexpected CBOR byte " .. b)
+end
+
+-- 'm' with the key order of every map checked and then removed
+function checkkeys(m)
+   check(m.keys == (m.subs and "type s subs e data" or "type s e data"), m.keys)
+   m.keys = nil
+   for _, sub in ipairs(m.subs or {}) do checkkeys(sub); end
+   return m
+end
+
+-- a decoded byte encoding, with the matched text of each capture as its data
+function withdata(t, input)
+   if not t.data then t.data = input:sub(t.s, t.e - 1); end
+   for _, sub in ipairs(t.subs or {}) do withdata(sub, input); end
+   return t
+end
+
+bigword = lpeg.rcap(lpeg.R"az"^1, string.rep("w", 300))
+manysubs = lpeg.rcap((w + lpeg.P" ")^0, "many")
+for _, p in ipairs{pats[1], pats[2], pats[3], pats[4], pats[5], bigword, manysubs} do
+   for _, input in ipairs{"", "abc", "abc def ghi", "ab-12-cd", "((((()))))", "abc:", "x-",
+			  string.rep("y", 70000), string.rep("a ", 40),
+			  string.rep("(", 300) .. string.rep(")", 300)} do
+      local r = lpeg.rmatch(p, input, 1, 3)
+      if r then
+	 local expected = serialize(withdata(lpeg.decode(r), input))
+	 local mp = lpeg.getdata(lpeg.rmatch(p, input, 1, 4))
+	 local m, pos = unmsgpack(mp, 1)
+	 check(pos == #mp + 1 and serialize(checkkeys(m)) == expected, "msgpack: " .. input:sub(1, 20))
+	 local cb = lpeg.getdata(lpeg.rmatch(p, input, 1, 5))
+	 m, pos = uncbor(cb, 1)
+	 check(pos == #cb + 1 and serialize(checkkeys(m)) == expected, "cbor: " .. input:sub(1, 20))
+      end
+   end
+end
+
+heading("Columns")
+
+subheading("Each column holds the first capture with its name, in each record")
+
+-- the start and end of the first capture of each name in decoded match
+-- 't', in preorder, added to 'seen'
+function firstcaps(t, seen)
+   if not seen[t.type] then seen[t.type] = {t.s, t.e}; end
+   for _, sub in ipairs(t.subs or {}) do firstcaps(sub, seen); end
+   return seen
+end
+
+-- the column names and the columns of a columns block, by name
+function readcolumns(data)
+   local ncols, nrecs, pos = string.unpack("<i4i4", data)
+   local names, columns = {}, {}
+   for c = 1, ncols do names[c], pos = string.unpack("<s2", data, pos); end
+   for c = 1, ncols do
+      local s, e = {}, {}
+      for r = 1, nrecs do s[r], pos = string.unpack("<i4", data, pos); end
+      for r = 1, nrecs do e[r], pos = string.unpack("<i4", data, pos); end
+      columns[names[c]] = {s, e}
+   end
+   check(pos == #data + 1)
+   return names, columns, nrecs
+end
+
+W = lpeg.rcap(lpeg.R"AZ"^1, "w")	-- a second capture named "w"
+rec = lpeg.rcap((w * lpeg.P" "^0)^0 * (W + lpeg.P"") * (lpeg.P":" * lpeg.Halt() + lpeg.P"")
+		* (lpeg.P"!" * lpeg.rconstcap("K", "kay") + lpeg.P"")
+		* lpeg.rcap(num * (lpeg.P"." * num)^-1, "number"), "top")
+records = {"", "abc 12", "ab cd ABC!7.5", "x:3", "ABC", "a b c d e f 1.2xx", "!3", ":", "q 9 9"}
+for i = 1, 300 do
+   table.insert(records, string.rep("ab ", i % 4) .. (i % 3 == 0 and "XY" or "")
+		   .. (i % 5 == 0 and ":" or "") .. (i % 7 == 0 and "!" or "") .. (i % 4 > 0 and i or ""))
+end
+out, index, n = lpeg.rmatch_batch(rec, records, 6)
+check(n == #records)
+names, columns, nrecs = readcolumns(lpeg.getdata(out))
+check(table.concat(names, " ") == "w kay num number top")
+check(nrecs == #records)
+for r = 1, nrecs do
+   local offset, len, leftover, abend = batchentry(index, r)
+   local m, leftover2, abend2 = lpeg.rmatch(rec, records[r], 1, 3)
+   local seen = m and firstcaps(lpeg.decode(m), {}) or {}
+   check(len == (m and 0 or -1) and leftover == leftover2 and (abend == 1) == abend2, records[r])
+   for name, c in pairs(columns) do
+      local expected = seen[name] or {0, 0}
+      check(c[1][r] == expected[1] and c[2][r] == expected[2], records[r] .. ": " .. name)
+   end
+end
+
+subheading("Columns are for batches only")
+
+ok, msg = pcall(lpeg.rmatch, rec, "ab 1", 1, 6)
+check(not ok and msg:find("invalid encoding"))
+
+heading("Offsets")
+
+subheading("Each capture is an id, its start and end, and its depth, in preorder")
+
+-- the captures of decoded match 't', in preorder, added to 'out'
+function preorder(t, depth, out)
+   table.insert(out, {t.type, t.s, t.e, depth})
+   for _, sub in ipairs(t.subs or {}) do preorder(sub, depth + 1, out); end
+   return out
+end
+
+nest = lpeg.P{lpeg.rcap(w * (lpeg.P"(" * lpeg.V(1)^0 * lpeg.P")")^-1 * lpeg.P" "^0, "nest")}
+top = lpeg.rcap(nest^0 * (lpeg.P":" * lpeg.Halt() + lpeg.P"") * (lpeg.P"!" * lpeg.rconstcap("K", "kay") + lpeg.P"")
+		* lpeg.rcap(num * (lpeg.P"." * num)^-1, "number"), "top")
+names = lpeg.capnames(top)
+count = 0
+for id, name in pairs(names) do
+   check(math.type(id) == "integer" and type(name) == "string")
+   count = count + 1
+end
+check(count == 6, "w, nest, kay, num, number and top")
+records = {"", "12", "ab 12", "ab(cd ef) 12", "a(b(c(d(e)))) f(g) 1.5", "zz", "q:3", "x!7", "a(b:", "a(b c)!:2"}
+for i = 1, 50 do table.insert(records, string.rep("a(", i % 6) .. "b" .. string.rep(")", i % 6) .. " " .. i); end
+for _, input in ipairs(records) do
+   local m, leftover, abend = lpeg.rmatch(top, input, 1, 3)
+   local expected = m and preorder(lpeg.decode(m), 0, {})
+   local o, leftover2, abend2 = lpeg.rmatch(top, input, 1, 7)
+   check((m and true) == (o and true) and leftover == leftover2 and abend == abend2, input)
+   if o then
+      local data = lpeg.getdata(o)
+      check(#data == 16 * #expected, input)
+      for j, x in ipairs(expected) do
+	 local id, s, e, depth = string.unpack("<i4i4i4i4", data, (j-1)*16 + 1)
+	 check(names[id] == x[1] and s == x[2] and e == x[3] and depth == x[4], input)
+      end
+   end
+end
+
+subheading("Batches of offsets")
+
+out, index, n = lpeg.rmatch_batch(top, records, 7)
+data = lpeg.getdata(out)
+for r = 1, n do
+   local offset, len = batchentry(index, r)
+   local o = lpeg.rmatch(top, records[r], 1, 7)
+   check(o and data:sub(offset + 1, offset + len) == lpeg.getdata(o) or len == -1, records[r])
+end
+
+heading("Capture filters")
+
+subheading("A filtered match is the full match with the other captures taken out")
+
+-- decoded match 't' with the subs that 'keep' (a set of names, or nil
+-- for all of them) does not keep flattened into their parents, and the
+-- subs deeper than 'maxdepth' removed
+function filtersubs(t, keep, maxdepth, depth, out)
+   for _, sub in ipairs(t.subs or {}) do
+      if maxdepth and depth + 1 > maxdepth then
+	 -- removed, with its subs
+      elseif keep == nil or keep[sub.type] then
+	 table.insert(out, filtered(sub, keep, maxdepth, depth + 1))
+      else
+	 filtersubs(sub, keep, maxdepth, depth, out)
+      end
+   end
+   return out
+end
+
+function filtered(t, keep, maxdepth, depth)
+   local subs = filtersubs(t, keep, maxdepth, depth or 0, {})
+   return {type = t.type, s = t.s, e = t.e, data = t.data, subs = (#subs > 0) and subs or nil}
+end
+
+-- the JSON encoding of decoded match 't' of 'input'
+function tojson(t, input)
+   local json = '{"type":"' .. t.type .. '","s":' .. t.s
+   if t.subs then
+      local subs = {}
+      for i, sub in ipairs(t.subs) do subs[i] = tojson(sub, input); end
+      json = json .. ',"subs":[' .. table.concat(subs, ",") .. ']'
+   end
+   return json .. ',"e":' .. t.e .. ',"data":"' .. (t.data or input:sub(t.s, t.e - 1)) .. '"}'
+end
+
+filtertop = lpeg.rcap(nest^0 * (lpeg.P":" * lpeg.Halt() + lpeg.P"")
+		      * (lpeg.P"!" * lpeg.rconstcap("K", "kay") + lpeg.P"")
+		      * lpeg.rcap(num * (lpeg.P"." * num)^-1, "number"), "top")
+specs = {{}, {{"w"}}, {{"nest"}, 2}, {{"num", "kay"}}, {nil, 0}, {nil, 1}, {{"w", "number"}, 1},
+	 {{}, nil}, {{"zzz", "num"}, 3}}
+filters = {}
+for i, spec in ipairs(specs) do
+   filters[i] = lpeg.capfilter(filtertop, spec[1], spec[2])
+   if spec[1] then
+      spec.keep = {}
+      for _, name in ipairs(spec[1]) do spec.keep[name] = true; end
+   end
+end
+records = {"", "12", "ab 12", "ab(cd ef) 12", "a(b(c(d(e)))) f(g) 1.5", "zz", "q:3", "x!7", "a(b:", "a(b c)!:2",
+	   "hhh z():763.5", "a(b(c d(e) f) g)!2.5"}
+for i = 1, 30 do table.insert(records, string.rep("a(", i % 6) .. "b" .. string.rep(" c)", i % 6) .. (i % 4 == 0 and ":" or "") .. i); end
+for _, input in ipairs(records) do
+   local m, leftover, abend = lpeg.rmatch(filtertop, input, 1, 3)
+   local full = m and withdata(lpeg.decode(m), input)
+   for i, spec in ipairs(specs) do
+      local b, leftover2, abend2 = lpeg.rmatch(filtertop, input, 1, 3, nil, nil, nil, filters[i])
+      check((m and true) == (b and true) and leftover == leftover2 and abend == abend2, input)
+      if b then
+	 local expected = filtered(full, spec.keep, spec[2])
+	 check(serialize(withdata(lpeg.decode(b), input)) == serialize(expected), input)
+	 local j = lpeg.rmatch(filtertop, input, 1, 1, nil, nil, nil, filters[i])
+	 check(lpeg.getdata(j) == tojson(expected, input), input)
+	 local found, _, _, _, _, start = lpeg.rfind(filtertop, "##" .. input, 1, 3, nil, nil, nil, filters[i])
+	 check(found and start == 3, input)
+      end
+   end
+end
+
+subheading("Filters in batches, and errors")
+
+for i, f in ipairs(filters) do
+   out, index, n = lpeg.rmatch_batch(filtertop, records, 1, nil, nil, f)
+   data = lpeg.getdata(out)
+   for r = 1, n do
+      local offset, len = batchentry(index, r)
+      local j = lpeg.rmatch(filtertop, records[r], 1, 1, nil, nil, nil, f)
+      check(j and data:sub(offset + 1, offset + len) == lpeg.getdata(j) or len == -1, records[r])
+   end
+end
+ok, msg = pcall(lpeg.rmatch, lpeg.rcap(w, "other"), "abc", 1, 3, nil, nil, nil, filters[2])
+check(not ok and msg:find("filter is for another pattern"))
+ok, msg = pcall(lpeg.capfilter, filtertop, {"w", 3})
+check(not ok and msg:find("capture name 2 is not a string"))
+
+heading("Prune")
+
+subheading("A pruned pattern matches like its pattern with a filter")
+
+prunetop = lpeg.rcap(nest^0 * (lpeg.P":" * lpeg.Halt() + lpeg.P"")
+		     * (lpeg.P"!" * lpeg.rconstcap("K", "kay") + lpeg.P"")
+		     * (lpeg.rcap(num * (lpeg.P"." * num)^-1, "number") + lpeg.rcap(lpeg.S"xyz"^1, "tail"))
+		     * lpeg.rcap(lpeg.P"", "empty"), "top")
+table.insert(records, "ab(c) xyz")
+table.insert(records, "a!zz")
+for _, names in ipairs{{"w"}, {"nest"}, {"num", "kay"}, {}, {"zzz", "num"}, {"number", "tail", "empty"},
+		       {"top", "w", "nest", "num", "number", "kay", "tail", "empty"}} do
+   local pruned = lpeg.prune(prunetop, names)
+   local f = lpeg.capfilter(prunetop, names)
+   local names1, names2 = lpeg.capnames(prunetop), lpeg.capnames(pruned)
+   for _, input in ipairs(records) do
+      for _, encoding in ipairs{1, 3, 7} do
+	 local a, leftover, abend = lpeg.rmatch(prunetop, input, 1, encoding, nil, nil, nil, f)
+	 local adata = a and lpeg.getdata(a)
+	 local b, leftover2, abend2 = lpeg.rmatch(pruned, input, 1, encoding)
+	 local bdata = b and lpeg.getdata(b)
+	 check((a and true) == (b and true) and leftover == leftover2 and abend == abend2, input)
+	 if a and encoding == 7 then	-- the same names, maybe with other ids
+	    check(#adata == #bdata, input)
+	    for j = 1, #adata, 16 do
+	       local id, s, e, depth = string.unpack("<i4i4i4i4", adata, j)
+	       local id2, s2, e2, depth2 = string.unpack("<i4i4i4i4", bdata, j)
+	       check(names1[id] == names2[id2] and s == s2 and e == e2 and depth == depth2, input)
+	    end
+	 elseif a then
+	    check(adata == bdata, input)
+	 end
+      end
+   end
+end
+
+subheading("Pruned patterns compose, and errors")
+
+pruned = lpeg.prune(prunetop, {"num"})
+r = lpeg.rmatch(lpeg.rcap(lpeg.P"<" * pruned * lpeg.P">", "big"), "<ab 12.5>", 1, 1)
+check(lpeg.getdata(r) == '{"type":"big","s":1,"subs":[{"type":"top","s":2,"subs":['
+      .. '{"type":"num","s":5,"e":7,"data":"12"},{"type":"num","s":8,"e":9,"data":"5"}],'
+      .. '"e":9,"data":"ab 12.5"}],"e":10,"data":"<ab 12.5>"}')
+check(#lpeg.getdata(lpeg.rmatch(pruned, "ab(cd ef(g)) 12.5", 1, 1))
+      < #lpeg.getdata(lpeg.rmatch(prunetop, "ab(cd ef(g)) 12.5", 1, 1)))
+ok, msg = pcall(lpeg.prune, prunetop, {1})
+check(not ok and msg:find("capture name 1 is not a string"))
+ok, msg = pcall(lpeg.prune, prunetop)
+check(not ok and msg:find("table expected"))
+
+heading("JSON strings")
+
+subheading("Escapes in long runs decode to the captured text")
+
+anything = lpeg.rcap(lpeg.P(1)^0, "all")
+-- a clean run: chars that need no escape, with NUL and bytes >= 128
+clean = {}
+for i = 1, 80 do
+   local c = ({"a", "\0", "\128", "\255", "z", " ", "\200", "0"})[i % 8 + 1]
+   table.insert(clean, c)
+end
+clean = table.concat(clean)
+escaped = {'"', "/", "\\", "\127"}
+for i = 1, 31 do table.insert(escaped, string.char(i)); end
+ok = true
+for _, c in ipairs(escaped) do
+   for _, offset in ipairs{0, 15, 16, 31, 32, 33} do
+      local subject = clean:sub(1, offset) .. c .. clean:sub(offset + 1)
+      local data = lpeg.getdata(anything:rmatch(subject, 1, 1))
+      local decoded, t = pcall(json.decode, data)
+      ok = ok and decoded and t.data == subject
+      -- the clean run is copied as it is, around the escape
+      ok = ok and data:find(clean:sub(1, offset), 1, true) and data:find(clean:sub(offset + 1), 1, true)
+      ok = ok and not data:find("\\u0000") and not data:find("\\u00[89a-f]")
+   end
+end
+check(ok)
+check(json.decode(lpeg.getdata(anything:rmatch(clean, 1, 1))).data == clean, "nothing to escape")
+check(lpeg.getdata(anything:rmatch("", 1, 1)) == '{"type":"all","s":1,"e":1,"data":""}')
+
+subheading("Capture names and constants are escaped like the data")
+
+oddname = 'a"b\\c\td\1e/f\127'
+oddvalue = '\\x"y\n\31z'
+t = json.decode(lpeg.getdata(lpeg.rmatch(lpeg.rcap(lpeg.rconstcap(oddvalue, oddname), oddname), "", 1, 1)))
+check(t.type == oddname)
+check(t.subs and t.subs[1].type == oddname and t.subs[1].data == oddvalue)
+-- a name, and the text it captures, are written the same way, NUL and high bytes included
+for _, name in ipairs{oddname, oddvalue, "\0nul\0", "\128\255\200", 'q"\0"\1'} do
+   local data = lpeg.getdata(lpeg.rmatch(lpeg.rcap(lpeg.P(name), name), name, 1, 1))
+   local typestr = data:match('^{"type":(".-"),"s":')
+   check(typestr and data:sub(-(#typestr + 1)) == typestr .. "}", name)
+end
+
 test.finish()
 
 
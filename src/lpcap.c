@@ -15,7 +15,7 @@
 #include "rcap.h"
 #include "rpeg.h"
 
-#define closeaddr(c)	((c)->s + (c)->siz - 1)
+#define closeaddr(cs,c)	(capstart(cs, c) + (c)->siz - 1)
 
 #define getfromktable(cs,v)	lua_rawgeti((cs)->L, ktableidx((cs)->ptop), v)
 
@@ -84,7 +84,7 @@ static void nextcap (CapState *cs) {
 static int pushnestedvalues (CapState *cs, int addextra) {
   Capture *co = cs->cap;
   if (isfullcap(cs->cap++)) {  /* no nested captures? */
-    lua_pushlstring(cs->L, co->s, co->siz - 1);  /* push whole match */
+    lua_pushlstring(cs->L, capstart(cs, co), co->siz - 1);  /* push whole match */
     return 1;  /* that is it */
   }
   else {
@@ -92,7 +92,7 @@ static int pushnestedvalues (CapState *cs, int addextra) {
     while (!isclosecap(cs->cap))  /* repeat for all nested patterns */
       n += pushcapture(cs);
     if (addextra || n == 0) {  /* need extra? */
-      lua_pushlstring(cs->L, co->s, cs->cap->s - co->s);  /* push whole match */
+      lua_pushlstring(cs->L, capstart(cs, co), cs->cap->s - co->s);  /* push whole match */
       n++;
     }
     cs->cap++;  /* skip close entry */
@@ -345,7 +345,7 @@ int runtimecap (CapState *cs, Capture *close, const char *s, int *rem) {
   assert(captype(open) == Cgroup);
   id = finddyncap(open, close);  /* get first dynamic capture argument */
   close->kind = Cclose;  /* closes the group */
-  close->s = s;
+  close->s = capoffset(cs->s, s);
   cs->cap = open; cs->valuecached = 0;  /* prepare capture state */
   luaL_checkstack(L, 4, "too many runtime captures");
   pushluaval(cs);  /* push function to be called */
@@ -399,7 +399,7 @@ Returns number of elements in the array that were filled.
 static int getstrcaps (CapState *cs, StrAux *cps, int n) { 
   int k = n++; 
   cps[k].isstring = 1;  /* get string value */ 
-  cps[k].u.s.s = cs->cap->s;  /* starts here */ 
+  cps[k].u.s.s = capstart(cs, cs->cap);  /* starts here */ 
   if (!isfullcap(cs->cap++)) {  /* nested captures? */ 
     while (!isclosecap(cs->cap)) {  /* traverse them */ 
       if (n >= MAXSTRCAPS)  /* too many captures? */ 
@@ -415,7 +415,7 @@ static int getstrcaps (CapState *cs, StrAux *cps, int n) {
     } 
     cs->cap++;  /* skip close */ 
   } 
-  cps[k].u.s.e = closeaddr(cs->cap - 1);  /* ends here */ 
+  cps[k].u.s.e = closeaddr(cs, cs->cap - 1);  /* ends here */ 
   return n; 
 } 
 
@@ -521,7 +521,7 @@ static int pushcapture (CapState *cs) {
   luaL_checkstack(L, 4, "too many captures");
   switch (captype(cs->cap)) {
     case Cposition: {
-      lua_pushinteger(L, cs->cap->s - cs->s + 1);
+      lua_pushinteger(L, (lua_Integer) cs->cap->s + 1);
       cs->cap++;
       return 1;
     }
@@ -594,7 +594,7 @@ int getcaptures (lua_State *L, const char *s, const char *r, int ptop) {
   Capture *capture = (Capture *)lua_touserdata(L, caplistidx(ptop));
   if (!isclosecap(capture)) {  /* is there any capture? */
     CapState cs;
-    cs.ocap = cs.cap = capture; cs.L = L;
+    cs.ocap = cs.cap = capture; cs.L = L; cs.names = NULL;
     cs.s = s; cs.valuecached = 0; cs.ptop = ptop;
     do {  /* collect their values */
       i = pushcapture(&cs);
@@ -613,7 +613,6 @@ int getcaptures (lua_State *L, const char *s, const char *r, int ptop) {
 
 /* Rosie extensions */
 /* See byte encoder in rcap.c */
-void r_pushmatch(lua_State *L, const char **s, const char **e, int depth);
 void r_pushmatch(lua_State *L, const char **s, const char **e, int depth) {
   int top;
   short shortlen;
@@ -692,41 +691,53 @@ int r_lua_decode (lua_State *L) {
 encoder_functions debug_encoder = { debug_Open, debug_Fullcapture, debug_Close };
 encoder_functions byte_encoder = { byte_Open, byte_Fullcapture, byte_Close };
 encoder_functions json_encoder = { json_Open, json_Fullcapture, json_Close };
+encoder_functions msgpack_encoder = { msgpack_Open, msgpack_Fullcapture, msgpack_Close };
+encoder_functions cbor_encoder = { cbor_Open, cbor_Fullcapture, cbor_Close };
+encoder_functions offsets_encoder = { offsets_Open, offsets_Fullcapture, offsets_Close };
 
 #define push(start, count) \
   { top++; \
-    if (top>=R_MAXDEPTH) luaL_error(L, "max pattern nesting depth exceeded"); \
+    if (top>=R_MAXDEPTH) return ROSIE_DEPTH_ERROR; \
     starts[top]=(start); counts[top]=(count); \
 }
 
 #define pop \
   { top--; \
-    if (top<0) luaL_error(L, "internal error re nesting depth"); }
+    if (top<0) return ROSIE_NESTING_ERROR; }
+
+/* Call an encoder function, and stop on an error.  Without Lua, the
+ * encoders go on when buf cannot grow (see rbuf.h), so stop then too,
+ * before they use the positions of things that were not added. */
+#define encodecall(call) \
+  { err = (call); \
+    if (!err && buf->failed) err = ROSIE_MEMORY_ERROR; \
+    if (err) return err; }
 
 static int caploop(CapState *cs, encoder_functions *encode, rBuffer *buf) {
   int err;
-  lua_State *L = cs->L;
+  int nsubs;
   const char *start;
   const char *starts[R_MAXDEPTH+1];
   int counts[R_MAXDEPTH+1];
   int top = 0;
   int count = 0;
-  push(cs->cap->s, 0);
-  err = encode->Open(cs, buf, 0); if (err) return err;
+  push(capstart(cs, cs->cap), 0);
+  encodecall(encode->Open(cs, buf, 0));
   cs->cap++;
   while (top > 0) {
     while (!isclosecap(cs->cap) && !isfinalcap(cs->cap)) {
       if (cs->cap->siz == 0) {
-	push(cs->cap->s, count);
-	err = encode->Open(cs, buf, count); if (err) return err;
+	push(capstart(cs, cs->cap), count);
+	encodecall(encode->Open(cs, buf, count));
 	count = 0;
       }
       else {
-	err = encode->Fullcapture(cs, buf, count); if (err) return err;
+	encodecall(encode->Fullcapture(cs, buf, count));
 	count++;
       }
       cs->cap++;
     }
+    nsubs = count;
     count = counts[top];
     start = starts[top];
     pop;
@@ -746,15 +757,16 @@ static int caploop(CapState *cs, encoder_functions *encode, rBuffer *buf) {
       synthetic.siz = 1;	/* 1 means closed */
       cs->cap = &synthetic;
       while (1) {
-	err = encode->Close(cs, buf, count, start); if (err) return err;
+	encodecall(encode->Close(cs, buf, nsubs, start));
 	if (top==0) break;
-	pop;
+	nsubs = count + 1;	/* the capture just closed is the last sub */
 	count = counts[top];
 	start = starts[top];
+	pop;
       }
       return ROSIE_HALT;
     }
-    err = encode->Close(cs, buf, count, start); if (err) return err;
+    encodecall(encode->Close(cs, buf, nsubs, start));
     cs->cap++;
     count++;
   }
@@ -765,7 +777,11 @@ static const char *r_status_messages[] = {
   "ok",
   "open capture error in rosie match",
   "close capture error in rosie match",
-  "full capture error in rosie match"
+  "full capture error in rosie match",
+  "max pattern nesting depth exceeded",
+  "internal error re nesting depth",
+  "invalid encoding value: %d",
+  "not enough memory for buffer allocation"
 };
 
 #define n_messages ((int) ((sizeof r_status_messages) / sizeof (const char *)))
@@ -773,7 +789,8 @@ static const char *r_status_messages[] = {
 static int dummy[1];
 static void *output_buffer_key = (void *)&dummy[0];
 
-static rBuffer *getbuffer(lua_State *L) {
+/* Push the (reset) output buffer of rmatch, and return it */
+rBuffer *r_getbuffer(lua_State *L) {
   rBuffer *buf;
   int t;
   /* TODO: IF we are reusing the buffer, AND there is one already, then */
@@ -795,27 +812,29 @@ static rBuffer *getbuffer(lua_State *L) {
 }
      
 
-int r_getcaptures(lua_State *L, const char *s, const char *r, int ptop, int etype, size_t len) {
-  int err;
+/* Append the encoding of the captures in cs->ocap, from a match of
+ * subject cs->s (of length len), to buf.  Uses no Lua when cs->L is
+ * NULL (and the names come from cs->names).  Returns ROSIE_OK,
+ * ROSIE_HALT if the match ended with a halt, or an error status
+ * (ROSIE_MEMORY_ERROR when, without Lua, buf could not grow).
+ */
+int r_encode(CapState *cs, int etype, size_t len, rBuffer *buf) {
+  int err = ROSIE_OK;
   encoder_functions encode;
-  Capture *capture = (Capture *)lua_touserdata(L, caplistidx(ptop));
-  rBuffer *buf = getbuffer(L);
-  int abend = 0;		/* 0 => normal completion; 1 => halt */
+  Capture *capture = cs->ocap;
   switch (etype) {
   case ENCODE_DEBUG: { encode = debug_encoder; break; } /* Debug output */
   case ENCODE_BYTE: { encode = byte_encoder; break; }   /* Byte array (compact) */
   case ENCODE_JSON: { encode = json_encoder; break; }   /* JSON string */
-  case ENCODE_LINE: { r_addlstring(L, buf, s, len); goto done; } /* Put the entire input into buf, and we are done */
-  default: { return luaL_error(L, "invalid encoding value: %d", etype); }
-  }
-  if (isfinalcap(capture)) {
-    abend = 1;
-    goto done;
+  case ENCODE_MSGPACK: { encode = msgpack_encoder; break; } /* MessagePack */
+  case ENCODE_CBOR: { encode = cbor_encoder; break; }   /* CBOR */
+  case ENCODE_OFFSETS: { encode = offsets_encoder; break; } /* Positions only */
+  case ENCODE_LINE: { r_addlstring(cs->L, buf, cs->s, len); goto done; } /* Put the entire input into buf, and we are done */
+  default: { return ROSIE_ETYPE_ERROR; }
   }
+  if (isfinalcap(capture)) return ROSIE_HALT;
   if (!isclosecap(capture)) {  /* is there a capture? */
-    CapState cs;
-    cs.ocap = cs.cap = capture; cs.L = L;
-    cs.s = s; cs.valuecached = 0; cs.ptop = ptop;
+    cs->cap = capture; cs->valuecached = 0; cs->mark = 0;
     /* Rosie's rcap ensures that the pattern has an outer capture.  So
      * if we see a full capture, it is because the outermost
      * open/close was converted to a full capture.  And it must be the
@@ -823,29 +842,108 @@ int r_getcaptures(lua_State *L, const char *s, const char *r, int ptop, int etyp
      * Cclose put there by the IEnd instruction.
      */
     if (isfullcap(capture)) {
-      err = encode.Fullcapture(&cs, buf, 0);
+      err = encode.Fullcapture(cs, buf, 0);
       if (!err)
 	{
-	  cs.cap++;
-	  if (!isclosecap(cs.cap) && !isfinalcap(cs.cap)) err = ROSIE_OPEN_ERROR;
+	  cs->cap++;
+	  if (!isclosecap(cs->cap) && !isfinalcap(cs->cap)) err = ROSIE_OPEN_ERROR;
 	}
     }
     else			/* not a full capture */
       {
-	err = caploop(&cs, &encode, buf);
+	err = caploop(cs, &encode, buf);
       }
-    if (err == ROSIE_HALT)
-      {
-	abend = 1;
-	goto done;
+  }
+ done:
+  if (buf->failed && (err == ROSIE_OK || err == ROSIE_HALT)) err = ROSIE_MEMORY_ERROR;
+  return err;
+}
+
+/* Raise the error for status err of encoding etype, if it is one.
+ * Returns 1 for ROSIE_HALT, and 0 for ROSIE_OK.
+ */
+static int encodestatus(lua_State *L, int err, int etype) {
+  if (err == ROSIE_HALT) return 1;
+  else if (err == ROSIE_ETYPE_ERROR) return luaL_error(L, r_status_messages[err], etype);
+  else if (err) {
+    if ((err < 0) || (err >= n_messages)) return luaL_error(L, "in rosie match, unspecified error");
+    else return luaL_error(L, r_status_messages[err]);
+  }
+  return 0;
+}
+
+/* Append the encoding of the captures of a match of subject s to buf.
+ * Returns 1 if the match ended with a halt, and 0 otherwise.
+ */
+int r_encodecaptures(lua_State *L, const char *s, int ptop, const rName *names,
+		     int etype, size_t len, rBuffer *buf) {
+  CapState cs;
+  int err;
+  cs.ocap = cs.cap = (Capture *)lua_touserdata(L, caplistidx(ptop));
+  cs.L = L; cs.names = names;
+  cs.s = s; cs.valuecached = 0; cs.ptop = ptop;
+  err = r_encode(&cs, etype, len, buf);
+  return encodestatus(L, err, etype);
+}
+
+/* Remove from the capture list of a match (at ptop) the captures that
+ * the filter f does not keep, in place, so that any encoder sees only
+ * the others.  A capture whose name is not kept is flattened: its subs
+ * that are kept become subs of its parent.  A capture deeper than the
+ * depth limit (counting the kept captures only) is removed with all of
+ * its subs.  The outer capture is always kept, and so are captures
+ * that are not rosie captures.
+ */
+void r_filtercaptures(lua_State *L, int ptop, const rCapFilter *f) {
+  unsigned char kept[R_MAXDEPTH];
+  Capture *capture = (Capture *)lua_touserdata(L, caplistidx(ptop));
+  Capture *in, *out = capture;
+  int top = 0, depth = 0, nest;
+  for (in = capture; !isfinalcap(in); in++) {
+    if (isclosecap(in)) {
+      if (top == 0) break;	/* the sentinel put there by IEnd */
+      if (kept[--top]) { depth--; *out++ = *in; }
+    }
+    else if (f->maxdepth >= 0 && depth > f->maxdepth) {
+      if (isfullcap(in)) continue;
+      for (nest = 1; nest > 0; ) {	/* skip the subs */
+	in++;
+	if (isfinalcap(in)) { in--; break; }
+	if (isclosecap(in)) nest--;
+	else if (!isfullcap(in)) nest++;
       }
-    else
-      if (err) {
-	if ((err < 0) || (err > n_messages)) return luaL_error(L, "in rosie match, unspecified error");
-	else return luaL_error(L, r_status_messages[err]);
+    }
+    else {
+      int keep = (in == capture) ||
+	         (in->kind != Crosiecap && in->kind != Crosieconst) ||
+	         (in->idx <= f->n && f->keep[in->idx]);
+      if (!isfullcap(in)) {
+	if (top >= R_MAXDEPTH) {
+	  encodestatus(L, ROSIE_DEPTH_ERROR, 0);
+	  return;
+	}
+	kept[top++] = (unsigned char) keep;
+	depth += keep;
       }
+      if (keep) *out++ = *in;
+    }
   }
-done:
+  *out = *in;			/* the sentinel, or the final capture */
+}
+
+/* Add the row of a record of a batch to the columns cols (see rcap.c),
+ * from the captures of its match, or an empty one if matched is 0.
+ * Returns 1 if the match ended with a halt, and 0 otherwise.
+ */
+int r_encodecolumns(lua_State *L, int ptop, rColumns *cols, int matched) {
+  Capture *capture = matched ? (Capture *)lua_touserdata(L, caplistidx(ptop)) : NULL;
+  return encodestatus(L, r_addcolumns(L, cols, capture), ENCODE_COLUMNS);
+}
+
+int r_getcaptures(lua_State *L, const char *s, const char *r, int ptop, const rName *names,
+		  int etype, size_t len) {
+  rBuffer *buf = r_getbuffer(L);
+  int abend = r_encodecaptures(L, s, ptop, names, etype, len, buf);
   lua_pushinteger(L, (int) len - (r - s)); /* leftover chars */
   lua_pushboolean(L, abend);
   return 3;			 /* N.B. an rBuffer is on the stack */
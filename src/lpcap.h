@@ -15,22 +15,42 @@ typedef enum CapKind {
 } CapKind;
 
 
+/*
+** rosie: a capture is 12 bytes.  Its position is an offset from the
+** start of the subject (so subjects are shorter than CAPMAXSUBJECT),
+** and its size has as many bits, so that any capture with no nested
+** captures is a full one.  'idx' has room for MAXCAPIDX.
+*/
 typedef struct Capture {
-  const char *s;  /* subject position */
-/*   unsigned short idx;  /\* extra info (group name, arg index, etc.) *\/ */
-  capidx_t idx;  /* extra info (group name, arg index, etc.) */
-  byte kind;  /* kind of capture */
-  byte siz;  /* size of full capture + 1 (0 = not a full capture) */
+  uint32_t s;  /* subject position (offset from the start of the subject) */
+  uint32_t siz;  /* size of full capture + 1 (0 = not a full capture) */
+  unsigned int idx : 24;  /* extra info (group name, arg index, etc.) */
+  unsigned int kind : 8;  /* kind of capture */
 } Capture;
 
+#define CAPMAXSUBJECT	UINT32_MAX
+
+
+/* rosie: a capture name (or constant capture value) */
+typedef struct rName {
+  const char *name;
+  size_t len;
+  const char *json;  /* name escaped for a JSON string (without quotes) */
+  size_t jsonlen;
+  const char *byte;  /* byte encoding of the name: its length (a short), then the name */
+  size_t bytelen;
+} rName;
+
 
 typedef struct CapState {
   Capture *cap;  /* current capture */
   Capture *ocap;  /* (original) capture list */
-  lua_State *L;
+  lua_State *L;  /* rosie: NULL when encoding without Lua */
   int ptop;  /* index of last argument to 'match' */
   const char *s;  /* original string */
   int valuecached;  /* value stored in cache slot */
+  const rName *names;  /* rosie: names by ktable index (or NULL for ktable) */
+  size_t mark;  /* rosie: innermost unfinished subs array (msgpack, cbor), or 0 */
 } CapState;
 
 
@@ -46,11 +66,36 @@ capidx_t finddyncap (Capture *cap, Capture *last);
 /* Rosie additions */
 
 #define isopencap(cap)	((captype(cap) != Cclose) && ((cap)->siz == 0))
+#define capstart(cs,cap)	((cs)->s + (cap)->s)  /* subject position */
+#define capoffset(o,p)	((uint32_t) ((p) - (o)))  /* capture position */
 
 #include "rbuf.h"
 
 #define R_MAXDEPTH USHRT_MAX	/* max nesting depth for patterns (was 200) */
 
+/* rosie: the columns of a columnar encoding of a batch (see rcap.c) */
+typedef struct rColumns {
+  int ncols;  /* number of columns */
+  int *colof;  /* column of each ktable index, or -1 */
+  int *nameof;  /* ktable index of the name of each column */
+  int *row;  /* (start, end) for each column, of the record being added */
+  int nrecs;  /* number of records added */
+  rBuffer *rows;  /* the rows of the records added */
+  rBuffer *open;  /* columns of the open captures of the record being added */
+} rColumns;
+
+/* rosie: which captures of a pattern to encode (see r_filtercaptures) */
+#define ROSIE_CAPFILTER "ROSIE_CAPFILTER"
+typedef struct rCapFilter {
+  int maxdepth;  /* deepest capture to keep (the outer one is at 0), or -1 for any */
+  int n;  /* number of ktable entries */
+  unsigned char keep[];  /* whether to keep captures with each name, by ktable index */
+} rCapFilter;
+
+/* For Open and Fullcapture, count is the number of captures before
+ * this one at its level.  For Close, it is the number of subs of the
+ * capture being closed, and start is where that capture starts.
+ */
 typedef struct {  
   int (*Open)(CapState *cs, rBuffer *buf, int count);
   int (*Fullcapture)(CapState *cs, rBuffer *buf, int count);
@@ -59,11 +104,22 @@ typedef struct {
  
 typedef enum r_status { 
      /* OK must be first so that its value is 0 */ 
-     ROSIE_HALT = -1, ROSIE_OK, ROSIE_OPEN_ERROR, ROSIE_CLOSE_ERROR, ROSIE_FULLCAP_ERROR
+     ROSIE_HALT = -1, ROSIE_OK, ROSIE_OPEN_ERROR, ROSIE_CLOSE_ERROR, ROSIE_FULLCAP_ERROR,
+     ROSIE_DEPTH_ERROR, ROSIE_NESTING_ERROR, ROSIE_ETYPE_ERROR, ROSIE_MEMORY_ERROR
 } r_status;
 
 int r_match (lua_State *L);
-int r_getcaptures(lua_State *L, const char *s, const char *r, int ptop, int etype, size_t len);
+rBuffer *r_getbuffer(lua_State *L);
+int r_getcaptures(lua_State *L, const char *s, const char *r, int ptop, const rName *names,
+		  int etype, size_t len);
+int r_encodecaptures(lua_State *L, const char *s, int ptop, const rName *names,
+		     int etype, size_t len, rBuffer *buf);
+int r_encode(CapState *cs, int etype, size_t len, rBuffer *buf);
+int r_encodecolumns(lua_State *L, int ptop, rColumns *cols, int matched);
+void r_filtercaptures(lua_State *L, int ptop, const rCapFilter *f);
+const char *r_capname(CapState *cs, int idx, size_t *len);
+rName *r_newnames(lua_State *L, int ktable, int *n);
+void r_pushmatch(lua_State *L, const char **s, const char **e, int depth);
 int r_lua_decode (lua_State *L);
 
 #endif
@@ -4,6 +4,8 @@
 */
 
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 
 
 #include "lua.h"
@@ -11,11 +13,21 @@
 
 #include "lptypes.h"
 #include "lpcode.h"
+#include "rsimd.h"
 
 
 /* signals a "no-instruction */
 #define NOINST		-1
 
+/* minimum number of alternatives that an IDispatch must tell apart */
+#define MINDISPATCH	4
+
+/* maximum number of offsets in an IDispatch (its map has a byte per char) */
+#define MAXDISPATCH	UCHAR_MAX
+
+/* minimum number of literal alternatives to code a choice as an ITrie */
+#define MINTRIE		16
+
 
 
 static const Charset fullset_ =
@@ -32,11 +44,36 @@ static const Charset *fullset = &fullset_;
 ** =======================================================
 */
 
+/*
+** Check whether a charset is formed by at most two ranges of
+** characters. If so, return IRange with the ranges (see 'joinrange')
+** in 'c[0]' and 'c[1]' (a single range goes in both); otherwise
+** return ISet.
+*/
+static Opcode rangetype (const byte *cs, int *c) {
+  int n = 0;  /* number of ranges found */
+  int i;
+  for (i = 0; i <= UCHAR_MAX; i++) {
+    if (testchar(cs, i)) {  /* start of a range? */
+      int first = i;
+      if (n == 2)  /* already found two ranges? */
+        return ISet;
+      while (i < UCHAR_MAX && testchar(cs, i + 1)) i++;
+      c[n++] = joinrange(first, i);
+    }
+  }
+  assert(n > 0);
+  if (n == 1) c[1] = c[0];
+  return IRange;
+}
+
+
 /*
 ** Check whether a charset is empty (returns IFail), singleton (IChar),
-** full (IAny), or none of those (ISet). When singleton, '*c' returns
-** which character it is. (When generic set, the set was the input,
-** so there is no need to return it.)
+** full (IAny), one or two ranges (IRange) or none of those (ISet).
+** When singleton, 'c[0]' returns which character it is; when ranges,
+** 'c' returns them (see 'rangetype'). (When generic set, the set was
+** the input, so there is no need to return it.)
 */
 static Opcode charsettype (const byte *cs, int *c) {
   int count = 0;  /* number of characters in the set */
@@ -46,23 +83,23 @@ static Opcode charsettype (const byte *cs, int *c) {
     int b = cs[i];
     if (b == 0) {  /* is byte empty? */
       if (count > 1)  /* was set neither empty nor singleton? */
-        return ISet;  /* neither full nor empty nor singleton */
+        return rangetype(cs, c);  /* neither full nor empty nor singleton */
       /* else set is still empty or singleton */
     }
     else if (b == 0xFF) {  /* is byte full? */
       if (count < (i * BITSPERCHAR))  /* was set not full? */
-        return ISet;  /* neither full nor empty nor singleton */
+        return rangetype(cs, c);  /* neither full nor empty nor singleton */
       else count += BITSPERCHAR;  /* set is still full */
     }
     else if ((b & (b - 1)) == 0) {  /* has byte only one bit? */
       if (count > 0)  /* was set not empty? */
-        return ISet;  /* neither full nor empty nor singleton */
+        return rangetype(cs, c);  /* neither full nor empty nor singleton */
       else {  /* set has only one char till now; track it */
         count++;
         candidate = i;
       }
     }
-    else return ISet;  /* byte is neither empty, full, nor singleton */
+    else return rangetype(cs, c);  /* byte is neither empty, full, nor singleton */
   }
   switch (count) {
     case 0: return IFail;  /* empty set */
@@ -414,9 +451,15 @@ static int needfollow (TTree *tree) {
 */
 int sizei (const Instruction *i) {
   switch((Opcode)i->i.code) {
-    case ISet: case ISpan: return CHARSETINSTSIZE;
+    case ISet: return CHARSETINSTSIZE;
+    case ISpan: return SPANINSTSIZE;
+    case IString: return instsize(i->i.aux);
+    case ITestString: return instsize(i->i.aux) + 1;
+    case IDispatch: return i->i.aux + instsize(UCHAR_MAX + 1);
+    case ITrie: return (i + 1)->offset;
     case ITestSet: return CHARSETINSTSIZE + 1;
-    case ITestChar: case ITestAny: case IChoice: case IJmp: case ICall:
+    case ITestChar: case ITestRange:
+    case ITestAny: case IChoice: case IJmp: case ICall:
     case IOpenCall: case ICommit: case IPartialCommit: case IBackCommit:
       return 2;
     default: return 1;
@@ -544,6 +587,19 @@ static void codechar (CompileState *compst, int c, int tt) {
 }
 
 
+/*
+** Add a range instruction ('op' is IRange, ITestRange or ISpanRange)
+** for the ranges in 'c'
+*/
+static int addrangeinst (CompileState *compst, Opcode op, const int *c) {
+  int i = (op == ITestRange) ? addoffsetinst(compst, op)
+                             : addinstruction(compst, op, 0);
+  getinstr(compst, i).i.aux = c[0];
+  getinstr(compst, i).i.key = c[1];
+  return i;
+}
+
+
 /*
 ** Add a charset posfix to an instruction
 */
@@ -557,16 +613,139 @@ static void addcharset (CompileState *compst, const byte *cs) {
 }
 
 
+/*
+** Number of chars in the run of TChar's that starts sequence 'tree'
+** (at most MAXSTRLEN); a TChar alone is a run of one char. '*rest'
+** returns what follows the run in the sequence (or NULL).
+*/
+static int charrun (TTree *tree, TTree **rest) {
+  int n = 0;
+  while (tree->tag == TSeq && sib1(tree)->tag == TChar && n < MAXSTRLEN) {
+    n++;
+    tree = sib2(tree);
+  }
+  if (tree->tag == TChar && n < MAXSTRLEN) {
+    n++;
+    tree = NULL;
+  }
+  *rest = tree;
+  return n;
+}
+
+
+/*
+** Add the first 'n' chars of sequence 'tree' as the (inline) operand
+** of an IString or ITestString instruction
+*/
+static void addstring (CompileState *compst, TTree *tree, int n) {
+  int p = gethere(compst);
+  int i;
+  for (i = 0; i < (int)instsize(n) - 1; i++)
+    nextinstruction(compst);  /* space for string */
+  for (i = 0; i < n; i++) {
+    TTree *c = (tree->tag == TSeq) ? sib1(tree) : tree;
+    assert(c->tag == TChar);
+    getinstr(compst, p).buff[i] = (byte)c->u.n;
+    tree = sib2(tree);
+  }
+}
+
+
+/*
+** Check whether the string tested by ITestString 'tt' is a prefix of
+** the first 'n' chars of sequence 'tree'
+*/
+static int testsprefix (CompileState *compst, int tt, TTree *tree, int n) {
+  int k = getinstr(compst, tt).i.aux;
+  const byte *str = getinstr(compst, tt + 2).buff;
+  int i;
+  if (k > n) return 0;
+  for (i = 0; i < k; i++) {
+    if ((tree->tag == TSeq ? sib1(tree) : tree)->u.n != str[i])
+      return 0;
+    tree = sib2(tree);
+  }
+  return 1;
+}
+
+
+/*
+** Code the first 'n' (> 1) chars of sequence 'tree' as an IString;
+** if a test for the first char dominates it, that char only needs
+** an IAny; if an ITestString dominates it, the chars it tested were
+** already consumed by the test
+*/
+static void codestring (CompileState *compst, TTree *tree, int n, int tt) {
+  if (tt >= 0 && getinstr(compst, tt).i.code == ITestChar &&
+                 getinstr(compst, tt).i.aux == sib1(tree)->u.n) {
+    addinstruction(compst, IAny, 0);
+    tree = sib2(tree); n--;
+  }
+  else if (tt >= 0 && getinstr(compst, tt).i.code == ITestString &&
+                      testsprefix(compst, tt, tree, n)) {
+    int k = getinstr(compst, tt).i.aux;
+    if (k == n) return;  /* whole string already consumed */
+    for (n -= k; k > 0; k--)
+      tree = sib2(tree);
+  }
+  if (n == 1) {  /* only one char left? */
+    codechar(compst, (tree->tag == TSeq ? sib1(tree) : tree)->u.n, NOINST);
+    return;
+  }
+  addinstruction(compst, IString, n);
+  addstring(compst, tree, n);
+}
+
+
+/*
+** Code a test for literal string 'tree' with 'n' chars
+*/
+static int codeteststring (CompileState *compst, TTree *tree, int n) {
+  int i = addoffsetinst(compst, ITestString);
+  getinstr(compst, i).i.aux = n;
+  addstring(compst, tree, n);
+  return i;
+}
+
+
+/*
+** Add the operand of an ISpan instruction: its charset, followed
+** by the tables for 'r_span' (if any)
+*/
+static void addspanset (CompileState *compst, const byte *cs) {
+  int p = gethere(compst);
+  int i;
+  addcharset(compst, cs);
+  for (i = CHARSETINSTSIZE; i < (int)SPANINSTSIZE; i++)
+    nextinstruction(compst);  /* space for tables */
+#if defined(ROSIE_SIMD)
+  r_spantables(cs, getinstr(compst, p).buff + CHARSETSIZE);
+#else
+  (void)p;
+#endif
+}
+
+
 /*
 ** code a char set, optimizing unit sets for IChar, "complete"
-** sets for IAny, and empty sets for IFail; also use an IAny
-** when instruction is dominated by an equivalent test.
+** sets for IAny, empty sets for IFail, and sets formed by one or
+** two ranges for IRange; also use an IAny when instruction is
+** dominated by an equivalent test.
 */
 static void codecharset (CompileState *compst, const byte *cs, int tt) {
-  int c = 0;  /* (=) to avoid warnings */
-  Opcode op = charsettype(cs, &c);
+  int c[2] = {0, 0};  /* (=) to avoid warnings */
+  Opcode op = charsettype(cs, c);
   switch (op) {
-    case IChar: codechar(compst, c, tt); break;
+    case IChar: codechar(compst, c[0], tt); break;
+    case IRange: {
+      if (tt >= 0 && getinstr(compst, tt).i.code == ITestRange &&
+          getrange1(&getinstr(compst, tt)) == c[0] &&
+          getrange2(&getinstr(compst, tt)) == c[1])
+        addinstruction(compst, IAny, 0);
+      else
+        addrangeinst(compst, IRange, c);
+      break;
+    }
     case ISet: {  /* non-trivial set? */
       if (tt >= 0 && getinstr(compst, tt).i.code == ITestSet &&
           cs_equal(cs, getinstr(compst, tt + 2).buff))
@@ -577,30 +756,32 @@ static void codecharset (CompileState *compst, const byte *cs, int tt) {
       }
       break;
     }
-    default: addinstruction(compst, op, c); break;
+    default: addinstruction(compst, op, c[0]); break;
   }
 }
 
 
 /*
 ** code a test set, optimizing unit sets for ITestChar, "complete"
-** sets for ITestAny, and empty sets for IJmp (always fails).
+** sets for ITestAny, ranges for ITestRange, and empty sets for IJmp
+** (always fails).
 ** 'e' is true iff test should accept the empty string. (Test
 ** instructions in the current VM never accept the empty string.)
 */
 static int codetestset (CompileState *compst, Charset *cs, int e) {
   if (e) return NOINST;  /* no test */
   else {
-    int c = 0;
-    Opcode op = charsettype(cs->cs, &c);
+    int c[2] = {0, 0};
+    Opcode op = charsettype(cs->cs, c);
     switch (op) {
       case IFail: return addoffsetinst(compst, IJmp);  /* always jump */
       case IAny: return addoffsetinst(compst, ITestAny);
       case IChar: {
         int i = addoffsetinst(compst, ITestChar);
-        getinstr(compst, i).i.aux = c;
+        getinstr(compst, i).i.aux = c[0];
         return i;
       }
+      case IRange: return addrangeinst(compst, ITestRange, c);
       case ISet: {
         int i = addoffsetinst(compst, ITestSet);
         addcharset(compst, cs->cs);
@@ -648,25 +829,54 @@ static void codebehind (CompileState *compst, TTree *tree) {
 ** in first(p1) cannot go to p2 (at it is not in first(p2)).
 ** (The optimization is not valid if p1 accepts the empty string,
 ** as then there is no character at all...)
+** - when p1 is a literal string, a test for the whole string tells
+** whether p1 will match, so there is no need for a choice either.
 ** - when p2 is empty and opt is true; a IPartialCommit can reuse
 ** the Choice already active in the stack.
+** When coding for an IDispatch (see 'codedispatch'), 'entry' receives
+** the positions where the code for the next 'nentry' alternatives
+** starts.
 */
-static void codechoice (CompileState *compst, TTree *p1, TTree *p2, int opt,
-                        const Charset *fl) {
+static void codealternatives (CompileState *compst, TTree *p1, TTree *p2,
+                              int opt, const Charset *fl,
+                              int *entry, int nentry);
+
+static void codenextalt (CompileState *compst, TTree *p2, int opt,
+                         const Charset *fl, int *entry, int nentry) {
+  if (nentry > 0) {
+    entry[0] = gethere(compst);
+    if (p2->tag == TChoice) {
+      codealternatives(compst, sib1(p2), sib2(p2), opt, fl,
+                       entry + 1, nentry - 1);
+      return;
+    }
+  }
+  codegen(compst, p2, opt, NOINST, fl);
+}
+
+
+static void codealternatives (CompileState *compst, TTree *p1, TTree *p2,
+                              int opt, const Charset *fl,
+                              int *entry, int nentry) {
   int haltp2 = (p2->tag == THalt);
   int emptyp2 = (p2->tag == TTrue);
   Charset cs1, cs2;
+  TTree *rest;
   int e1 = getfirst(p1, fullset, &cs1);
-  if (!haltp2 && (headfail(p1) ||
-		  (!e1 && (getfirst(p2, fl, &cs2), cs_disjoint(&cs1, &cs2))))) {
+  int len1 = charrun(p1, &rest);  /* length of p1, if a literal string */
+  int disjoint = headfail(p1) ||
+		 (!e1 && (getfirst(p2, fl, &cs2), cs_disjoint(&cs1, &cs2)));
+  if (rest != NULL) len1 = 0;
+  if (!haltp2 && (disjoint || len1 > 1)) {
     /* <p1 / p2> == test (fail(p1)) -> L1 ; p1 ; jmp L2; L1: p2; L2: */
-    int test = codetestset(compst, &cs1, 0);
+    int test = disjoint ? codetestset(compst, &cs1, 0)
+                        : codeteststring(compst, p1, len1);
     int jmp = NOINST;
     codegen(compst, p1, 0, test, fl);
     if (!emptyp2)
       jmp = addoffsetinst(compst, IJmp); 
     jumptohere(compst, test);
-    codegen(compst, p2, opt, NOINST, fl);
+    codenextalt(compst, p2, opt, fl, entry, nentry);
     jumptohere(compst, jmp);
   }
   else if (!haltp2 && opt && emptyp2) {
@@ -684,12 +894,319 @@ static void codechoice (CompileState *compst, TTree *p1, TTree *p2, int opt,
     pcommit = addoffsetinst(compst, ICommit);
     jumptohere(compst, pchoice);
     jumptohere(compst, test);
-    codegen(compst, p2, opt, NOINST, fl);
+    codenextalt(compst, p2, opt, fl, entry, nentry);
     jumptohere(compst, pcommit);
   }
 }
 
 
+/*
+** Set entry 'k' of the IDispatch at 'instruction' to jump to 'target'
+*/
+static void setdispatch (Instruction *code, int instruction, int k,
+                         int target) {
+  code[instruction + 1 + k].offset = target - instruction;
+}
+
+
+/*
+** Choice with many alternatives <p1 / p2 / ... / pn>: when the first
+** chars of at least MINDISPATCH of them tell them apart, start with
+** an IDispatch that, for each char, jumps straight to the first
+** alternative that can start with it. Only the first k alternatives
+** that cannot match the empty string are in its map; chars not in
+** the map (and the end of the subject) go to alternative k+1, or to
+** a fail, if there is none. The alternatives are coded as usual after
+** it, so that each one can still go on to the next ones if it fails:
+**   dispatch [L, E1, ..., Ek]; L: fail; E1: <p1 / p2 / ...>
+** Return false (coding nothing) when the choice does not qualify.
+*/
+static int codedispatch (CompileState *compst, TTree *p1, TTree *p2,
+                         int opt, const Charset *fl) {
+  byte map[UCHAR_MAX + 1];
+  int entry[MAXDISPATCH];
+  TTree *alt = p1;
+  TTree *next = p2;
+  int k = 0;  /* number of alternatives in the map */
+  int owners = 0;  /* number of them that are first for some char */
+  int all = 0;  /* true if all alternatives are in the map */
+  int d, i;
+  memset(map, 0, sizeof(map));
+  while (k < MAXDISPATCH - 1) {
+    Charset cs;
+    int owns = 0;
+    if (getfirst(alt, fullset, &cs) != 0)  /* can 'alt' match ""? */
+      break;
+    k++;
+    for (i = 0; i <= UCHAR_MAX; i++) {
+      if (testchar(cs.cs, i) && map[i] == 0) {
+        map[i] = (byte)k;
+        owns = 1;
+      }
+    }
+    owners += owns;
+    if (next == NULL) { all = 1; break; }  /* no more alternatives? */
+    else if (next->tag == TChoice) { alt = sib1(next); next = sib2(next); }
+    else { alt = next; next = NULL; }
+  }
+  if (owners < MINDISPATCH)
+    return 0;
+  for (alt = p2; alt->tag == TChoice; alt = sib2(alt)) ;
+  if (alt->tag == TTrue)  /* last alternative is empty? */
+    opt = 0;  /* code it in place, to have an entry for it */
+  d = addinstruction(compst, IDispatch, k + 1);
+  for (i = 0; i <= k; i++)
+    nextinstruction(compst);  /* space for offsets */
+  for (i = 0; i < (int)instsize(UCHAR_MAX + 1) - 1; i++)
+    nextinstruction(compst);  /* space for map */
+  memcpy(getinstr(compst, d + k + 2).buff, map, sizeof(map));
+  if (all) {  /* no alternative for chars not in the map? */
+    entry[k] = gethere(compst);
+    addinstruction(compst, IFail, 0);
+  }
+  entry[0] = gethere(compst);
+  codealternatives(compst, p1, p2, opt, fl, entry + 1, all ? k - 1 : k);
+  setdispatch(compst->p->code, d, 0, entry[k]);
+  for (i = 1; i <= k; i++)
+    setdispatch(compst->p->code, d, i, entry[i - 1]);
+  return 1;
+}
+
+
+/*
+** {======================================================
+** Tries for choices of literal strings
+** =======================================================
+*/
+
+/* a string in a choice, and the position of its alternative */
+typedef struct TrieEntry {
+  const byte *s;
+  int len;
+  int pos;
+} TrieEntry;
+
+
+typedef struct TrieState {
+  CompileState *compst;
+  TrieEntry *entry;  /* strings, sorted */
+  int base;  /* position of the trie in the code */
+  int size;  /* ints used by the trie */
+} TrieState;
+
+
+#define trieslot(ts,k)	(((int *)&getinstr((ts)->compst, (ts)->base))[k])
+
+
+/*
+** If alternative 'alt' is a literal (a string, a set of one-char
+** strings, or the empty string), return how many strings it has and
+** add their total length to '*len'; otherwise, return 0.
+*/
+static int literalstrings (TTree *alt, int *len) {
+  switch (alt->tag) {
+    case TTrue: return 1;
+    case TSet: {
+      int c, n = 0;
+      for (c = 0; c <= UCHAR_MAX; c++)
+        if (testchar(treebuffer(alt), c)) n++;
+      *len += n;
+      return n;
+    }
+    case TChar: case TSeq: {
+      TTree *rest;
+      int l = charrun(alt, &rest);
+      if (l == 0 || rest != NULL) return 0;
+      *len += l;
+      return 1;
+    }
+    default: return 0;
+  }
+}
+
+
+/* order strings alphabetically (a prefix first), then by position */
+static int cmpentry (const void *a, const void *b) {
+  const TrieEntry *e1 = (const TrieEntry *)a;
+  const TrieEntry *e2 = (const TrieEntry *)b;
+  int l = (e1->len < e2->len) ? e1->len : e2->len;
+  int c = memcmp(e1->s, e2->s, l);
+  if (c != 0) return c;
+  else if (e1->len != e2->len) return e1->len - e2->len;
+  else return e1->pos - e2->pos;
+}
+
+
+/*
+** Reserve 'n' more ints for the trie; return the index of the first one
+*/
+static int trieints (TrieState *ts, int n) {
+  int first = ts->size;
+  ts->size += n;
+  while ((gethere(ts->compst) - ts->base) * (int)sizeof(Instruction) <
+         ts->size * (int)sizeof(int))
+    nextinstruction(ts->compst);
+  return first;
+}
+
+
+/*
+** Build the node for the (sorted) strings 'lo' to 'hi' - 1, which have
+** their first 'depth' chars in common. Return its index in the trie.
+*/
+static int trienode (TrieState *ts, int lo, int hi, int depth) {
+  TrieEntry *e = ts->entry;
+  int term = INT_MAX;
+  int min = INT_MAX;
+  int n = 0;  /* number of children */
+  int node, labels, i, k;
+  for (i = lo; i < hi; i++)
+    if (e[i].pos < min) min = e[i].pos;
+  if (lo < hi && e[lo].len == depth)  /* some strings end here? */
+    term = e[lo].pos;  /* sorted by position, so first one wins */
+  while (lo < hi && e[lo].len == depth) lo++;
+  for (i = lo; i < hi; i++)
+    if (i == lo || e[i].s[depth] != e[i - 1].s[depth]) n++;
+  node = trieints(ts, TRIEHEADER + (n + 3) / 4 + n);
+  labels = node + TRIEHEADER;
+  trieslot(ts, node) = term;
+  trieslot(ts, node + 1) = min;
+  trieslot(ts, node + 2) = n;
+  for (k = 0; k < (n + 3) / 4; k++)
+    trieslot(ts, labels + k) = 0;
+  for (k = 0; lo < hi; k++) {  /* for each child */
+    int c = e[lo].s[depth];
+    int child;
+    for (i = lo + 1; i < hi && e[i].s[depth] == c; i++) ;
+    ((byte *)&trieslot(ts, labels))[k] = (byte)c;
+    child = trienode(ts, lo, i, depth + 1);
+    trieslot(ts, labels + (n + 3) / 4 + k) = child;
+    lo = i;
+  }
+  return node;
+}
+
+
+/*
+** Find the alternatives at the start of choice <p1 / p2> that are
+** literals, stopping at the first one that is not. (Choices are
+** right-nested, see 'correctassociativity', so that is a single walk
+** down the chain.) Return how many there are, add their number of
+** strings to '*nstr' and of chars to '*len', and return in '*rest'
+** the choice of the alternatives after them (NULL if none).
+*/
+static int literalprefix (TTree *p1, TTree *p2, int *nstr, int *len,
+                          TTree **rest) {
+  int nalt = 0;
+  TTree *alt = p1;
+  TTree *next = p2;
+  *rest = NULL;  /* choice starting at 'alt' (not needed for 'p1') */
+  while (alt != NULL) {
+    int n = literalstrings(alt, len);
+    if (n == 0)  /* not a literal? */
+      return nalt;
+    *nstr += n; nalt++;
+    *rest = next;
+    if (next != NULL && next->tag == TChoice) {
+      alt = sib1(next); next = sib2(next);
+    }
+    else { alt = next; next = NULL; }
+  }
+  return nalt;
+}
+
+
+/*
+** Add the strings of the first 'nalt' alternatives of choice
+** <p1 / p2> to the entries, copying their chars to '*pool'; the
+** position of each string is the index of its alternative.
+*/
+static void collectliterals (TrieState *ts, TTree *p1, TTree *p2, int nalt,
+                             byte **pool) {
+  TrieEntry *e = ts->entry;
+  TTree *tree = p1;
+  int nstr = 0;
+  int pos;
+  for (pos = 0; pos < nalt; pos++) {
+    if (tree->tag == TSet) {
+      int c;
+      for (c = 0; c <= UCHAR_MAX; c++) {
+        if (testchar(treebuffer(tree), c)) {
+          **pool = (byte)c;
+          e[nstr].s = (*pool)++; e[nstr].len = 1; e[nstr++].pos = pos;
+        }
+      }
+    }
+    else {
+      TTree *t;
+      int l = 0;
+      for (t = tree; t->tag == TSeq; t = sib2(t))
+        (*pool)[l++] = (byte)sib1(t)->u.n;
+      if (t->tag == TChar) (*pool)[l++] = (byte)t->u.n;
+      e[nstr].s = *pool; e[nstr].len = l; e[nstr++].pos = pos;
+      *pool += l;
+    }
+    if (p2 != NULL && p2->tag == TChoice) {
+      tree = sib1(p2); p2 = sib2(p2);
+    }
+    else { tree = p2; p2 = NULL; }
+  }
+}
+
+
+/*
+** Choice whose first (at least MINTRIE) alternatives are literals:
+** code them as a single ITrie instruction, whose operand is a trie
+** with all their strings. A match follows the subject down the trie
+** and keeps, among the strings found on the way, the one whose
+** alternative comes first, as the ordered choice would do. Any other
+** alternatives follow as a plain choice <trie / rest>.
+** Return false (coding nothing) when the choice does not qualify.
+*/
+static int codetrie (CompileState *compst, TTree *p1, TTree *p2, int opt,
+                     const Charset *fl) {
+  TrieState ts;
+  TTree *rest;
+  byte *pool;
+  int nstr = 0, len = 0;
+  int nalt = literalprefix(p1, p2, &nstr, &len, &rest);
+  int i, pchoice = NOINST;
+  if (nalt < MINTRIE) return 0;
+  ts.compst = compst;
+  ts.entry = (TrieEntry *)lua_newuserdata(compst->L,
+                            nstr * sizeof(TrieEntry) + len);
+  pool = (byte *)(ts.entry + nstr);
+  collectliterals(&ts, p1, p2, nalt, &pool);
+  qsort(ts.entry, nstr, sizeof(TrieEntry), cmpentry);
+  if (rest != NULL)
+    pchoice = addoffsetinst(compst, IChoice);
+  i = addinstruction(compst, ITrie, 0);
+  addinstruction(compst, (Opcode)0, 0);  /* space for size */
+  ts.base = gethere(compst);
+  ts.size = 0;
+  trienode(&ts, 0, nstr, 0);
+  setoffset(compst, i, gethere(compst) - i);  /* size of the instruction */
+  lua_pop(compst->L, 1);  /* remove entries */
+  if (rest != NULL) {  /* <trie / rest> */
+    int pcommit = addoffsetinst(compst, ICommit);
+    jumptohere(compst, pchoice);
+    codegen(compst, rest, opt, NOINST, fl);
+    jumptohere(compst, pcommit);
+  }
+  return 1;
+}
+
+/* }====================================================== */
+
+
+static void codechoice (CompileState *compst, TTree *p1, TTree *p2, int opt,
+                        const Charset *fl) {
+  if (!codetrie(compst, p1, p2, opt, fl) &&
+      !codedispatch(compst, p1, p2, opt, fl))
+    codealternatives(compst, p1, p2, opt, fl, NULL, 0);
+}
+
+
 /*
 ** And predicate
 ** optimization: fixedlen(p) = n ==> <&p> == <p>; behind n
@@ -743,7 +1260,8 @@ static void coderuntime (CompileState *compst, TTree *tree, int tt) {
 
 /*
 ** Repetion; optimizations:
-** When pattern is a charset, can use special instruction ISpan.
+** When pattern is a charset, can use special instruction ISpan (or
+** ISpanRange, when the charset is a single char or one or two ranges).
 ** When pattern is head fail, or if it starts with characters that
 ** are disjoint from what follows the repetions, a simple test
 ** is enough (a fail inside the repetition would backtrack to fail
@@ -755,8 +1273,16 @@ static void coderep (CompileState *compst, TTree *tree, int opt,
                      const Charset *fl) {
   Charset st;
   if (tocharset(tree, &st)) {
-    addinstruction(compst, ISpan, 0);
-    addcharset(compst, st.cs);
+    int c[2] = {0, 0};
+    Opcode op = charsettype(st.cs, c);
+    if (op == IChar)  /* a single char is a one-char range */
+      c[0] = c[1] = joinrange(c[0], c[0]);
+    if (op == IChar || op == IRange)
+      addrangeinst(compst, ISpanRange, c);
+    else {
+      addinstruction(compst, ISpan, 0);
+      addspanset(compst, st.cs);
+    }
   }
   else {
     int e1 = getfirst(tree, fullset, &st);
@@ -913,6 +1439,14 @@ static void codegen (CompileState *compst, TTree *tree, int opt, int tt,
     case TGrammar: codegrammar(compst, tree); break;
     case TCall: codecall(compst, tree); break;
     case TSeq: {
+      TTree *rest;
+      int n = charrun(tree, &rest);
+      if (n > 1) {  /* sequence starts with a literal string? */
+        codestring(compst, tree, n, tt);
+        if (rest == NULL) break;  /* sequence was only the string */
+        tt = NOINST;
+        tree = rest; goto tailcall;
+      }
       tt = codeseq1(compst, sib1(tree), sib2(tree), tt, fl);  /* code 'p1' */
       /* codegen(compst, p2, opt, tt, fl); */
       tree = sib2(tree); goto tailcall;
@@ -939,10 +1473,18 @@ static void peephole (CompileState *compst) {
     switch (code[i].i.code) {
       case IChoice: case ICall: case ICommit: case IPartialCommit:
       case IBackCommit: case ITestChar: case ITestSet:
+      case ITestRange: case ITestString:
       case ITestAny: {  /* instructions with labels */
         jumptothere(compst, i, finallabel(code, i));  /* optimize label */
         break;
       }
+      case IDispatch: {  /* optimize each of its labels */
+        int k;
+        for (k = 0; k < code[i].i.aux; k++)
+          setdispatch(code, i, k,
+                      finaltarget(code, i + code[i + 1 + k].offset));
+        break;
+      }
       case IJmp: {
         int ft = finaltarget(code, i);
         switch (code[ft].i.code) {  /* jumping to what? */
@@ -974,6 +1516,102 @@ static void peephole (CompileState *compst) {
 }
 
 
+/*
+** rosie: set the search information of pattern 'p' from the chars
+** that can start a match: 'rfind' skips the positions holding any
+** other char (with a memchr when there is only one such char)
+*/
+static void setsearch (Pattern *p) {
+  Search *sr = &p->search;
+  Charset cs;
+  int c, n = 0;
+  sr->kind = SEARCHALL;
+  if (getfirst(p->tree, fullset, &cs) != 0)  /* can match ""? */
+    return;
+  for (c = 0; c <= UCHAR_MAX; c++)
+    if (testchar(cs.cs, c)) { n++; sr->c = c; }
+  if (n == 1)
+    sr->kind = SEARCHCHAR;
+  else if (n <= UCHAR_MAX) {
+    sr->kind = SEARCHSET;
+    loopset(i, sr->skip[i] = ~cs.cs[i]);
+#if defined(ROSIE_SIMD)
+    r_spantables(sr->skip, sr->skip + CHARSETSIZE);
+#endif
+  }
+}
+
+
+/*
+** rosie: whether the vm can write the byte encoding of the captures of
+** pattern 'p' as it matches (see 'MatchState'): it must have an outer
+** rosie capture, as 'r_encode' expects, and its captures must all be
+** rosie captures, so that none of them needs Lua
+*/
+static void setdirect (Pattern *p) {
+  Instruction *code = p->code;
+  int i;
+  p->direct = 0;
+  if (p->tree->tag != TCapture ||
+      (p->tree->cap != Crosiecap && p->tree->cap != Crosieconst))
+    return;
+  for (i = 0; i < p->codesize; i += sizei(&code[i])) {
+    switch ((Opcode)code[i].i.code) {
+      case IOpenCapture:
+        if (getkind(&code[i]) != Crosiecap) return;
+        break;
+      case IFullCapture:
+        if (getkind(&code[i]) != Crosiecap && getkind(&code[i]) != Crosieconst)
+          return;
+        break;
+      case ICloseRunTime: return;
+      default: break;
+    }
+  }
+  p->direct = 1;
+}
+
+
+/*
+** rosie: the columns of a columnar encoding for pattern 'p' (see
+** rcap.c), one for each distinct name of its rosie captures, in the
+** order of their first ktable index.  Sets 'colof' and 'nameof' of
+** 'c' from the 'n' names of its ktable, and returns the number of
+** columns.  (Not the values of constant captures, which are in the
+** ktable too.)
+*/
+int r_capcolumns (Pattern *p, const rName *names, int n, rColumns *c) {
+  Instruction *code = p->code;
+  int i, k, col;
+  for (i = 0; i < p->codesize; i += sizei(&code[i])) {
+    switch ((Opcode)code[i].i.code) {
+      case IOpenCapture: case IFullCapture:
+        if (getkind(&code[i]) == Crosiecap || getkind(&code[i]) == Crosieconst) {
+          k = code[i].i.key;
+          if (0 < k && k <= n) c->colof[k] = 0;  /* used as a name */
+        }
+        break;
+      default: break;
+    }
+  }
+  c->ncols = 0;
+  for (k = 1; k <= n; k++) {
+    if (c->colof[k] < 0 || names[k].name == NULL) {
+      c->colof[k] = -1;
+      continue;
+    }
+    for (col = 0; col < c->ncols; col++) {
+      const rName *nm = &names[c->nameof[col]];
+      if (nm->len == names[k].len && memcmp(nm->name, names[k].name, nm->len) == 0)
+        break;
+    }
+    if (col == c->ncols) c->nameof[c->ncols++] = k;
+    c->colof[k] = col;
+  }
+  return c->ncols;
+}
+
+
 /*
 ** Compile a pattern
 */
@@ -985,6 +1623,8 @@ Instruction *compile (lua_State *L, Pattern *p) {
   addinstruction(&compst, IEnd, 0);
   realloccode(L, p, compst.ncode);  /* set final size */
   peephole(&compst);  
+  setsearch(p);
+  setdirect(p);
   return p->code;
 }
 
@@ -19,6 +19,7 @@ int lp_gc (lua_State *L);
 Instruction *compile (lua_State *L, Pattern *p);
 void realloccode (lua_State *L, Pattern *p, int nsize);
 int sizei (const Instruction *i);
+int r_capcolumns (Pattern *p, const rName *names, int n, rColumns *c);
 
 
 #define PEnullable      0
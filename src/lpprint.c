@@ -37,6 +37,14 @@ void printcharset (const byte *st) {
 }
 
 
+static void printrange (int r1, int r2) {
+  printf("[(%02x-%02x)", rangefirst(r1), rangelast(r1));
+  if (r2 != r1)
+    printf("(%02x-%02x)", rangefirst(r2), rangelast(r2));
+  printf("]");
+}
+
+
 static void printcapkind (int kind) {
   const char *const modes[] = {
     "close", "position", "constant", "backref",
@@ -56,7 +64,8 @@ void printinst (const Instruction *op, const Instruction *p) {
   const char *const names[] = {
     "any", "char", "set",
     "testany", "testchar", "testset",
-    "span", "behind",
+    "span", "range", "testrange", "spanrange",
+    "string", "teststring", "dispatch", "trie", "behind",
     "ret", "end",
     "choice", "jmp", "call", "open_call",
     "commit", "partial_commit", "back_commit", "failtwice", "fail", "giveup",
@@ -94,6 +103,32 @@ void printinst (const Instruction *op, const Instruction *p) {
       printcharset((p+1)->buff);
       break;
     }
+    case IRange: case ISpanRange: {
+      printrange(getrange1(p), getrange2(p));
+      break;
+    }
+    case ITestRange: {
+      printrange(getrange1(p), getrange2(p)); printjmp(op, p);
+      break;
+    }
+    case IString: {
+      printf("'%.*s'", p->i.aux, (const char *)(p+1)->buff);
+      break;
+    }
+    case ITestString: {
+      printf("'%.*s'", p->i.aux, (const char *)(p+2)->buff); printjmp(op, p);
+      break;
+    }
+    case IDispatch: {
+      int k;
+      for (k = 0; k < p->i.aux; k++)
+        printf("%s%d", (k == 0) ? "-> " : ", ", (int)(p + (p + 1 + k)->offset - op));
+      break;
+    }
+    case ITrie: {
+      printf("(size = %d)", (p + 1)->offset);
+      break;
+    }
     case IOpenCall: {
       printf("-> %d", (p + 1)->offset);
       break;
@@ -126,13 +161,13 @@ void printpatt (Instruction *p, int n) {
 static void printcap (Capture *cap) {
   printcapkind(cap->kind);
   /* the cast below is to suppress warning */
-  printf(" (idx: %d - size: %d) -> %p\n", cap->idx, cap->siz, (const void *) cap->s);
+  printf(" (idx: %d - size: %u) -> %u\n", cap->idx, cap->siz, cap->s);
 }
 
 
 void printcaplist (Capture *cap, Capture *limit) {
   printf(">======\n");
-  for (; cap->s && (limit == NULL || cap < limit); cap++)
+  for (; !(isclosecap(cap) && cap->siz == 0) && (limit == NULL || cap < limit); cap++)
     printcap(cap);
   printf("=======\n");
 }
@@ -5,9 +5,12 @@
 
 #include <ctype.h>
 #include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <time.h>
+#include <errno.h>
+#include <unistd.h>
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -19,6 +22,13 @@
 #include "lptree.h"
 
 #include "rpeg.h"
+#include "rcap.h"
+#include "rctx.h"
+#include "rcur.h"
+#include "rmmap.h"
+#include "rpar.h"
+#include "rshare.h"
+#include "rsimd.h"
 
 /* number of siblings for each tree */
 const byte numsiblings[] = {
@@ -368,7 +378,7 @@ static TTree *newtree (lua_State *L, int len) {
   lua_pushvalue(L, -1);
   lua_setuservalue(L, -3);
   lua_setmetatable(L, -2);
-  p->code = NULL;  p->codesize = 0;
+  p->code = NULL;  p->codesize = 0;  p->direct = 0;  p->names = NULL;
   return p->tree;
 }
 
@@ -1147,8 +1157,13 @@ static TTree *newgrammar (lua_State *L, int arg) {
 
 
 static Instruction *prepcompile (lua_State *L, Pattern *p, int idx) {
+  int n;
   lua_getuservalue(L, idx);  /* push 'ktable' (may be used by 'finalfix') */
   finalfix(L, 0, NULL, p->tree);
+  if (p->names == NULL) {  /* rosie: names for the encoders */
+    p->names = r_newnames(L, lua_gettop(L), &n);
+    if (p->names == NULL) luaL_error(L, "not enough memory");
+  }
   lua_pop(L, 1);  /* remove 'ktable' */
   return compile(L, p);
 }
@@ -1201,89 +1216,127 @@ static size_t initposition (lua_State *L, size_t len, int idx) {
 ** Main match function
 */
 static int lp_match (lua_State *L) {
-  Capture capture[INITCAPSIZE];
   const char *r;
   size_t l;
+  int n;
+  rMatchCtx *mc;
   Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
   Instruction *code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
   const char *s = luaL_checklstring(L, SUBJIDX, &l);
   size_t i = initposition(L, l, SUBJIDX+1);
   int ptop = lua_gettop(L);
   lua_pushnil(L);  /* initialize subscache */
-  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_pushnil(L);  /* initialize caplistidx */
   lua_getuservalue(L, 1);  /* initialize penvidx */
-  r = match(L, s, s + i, s + l, code, capture, ptop);
-  if (r == NULL) {
-    lua_pushnil(L);
-    return 1;
-  }
-  return getcaptures(L, s, r, ptop);
+  mc = r_borrowcontext(L, 0, ptop);  /* rosie: stack and capture list */
+  r = r_ctxmatch(L, s, s + i, s + l, code, ptop, NULL, NULL, NULL);
+  n = (r == NULL) ? (lua_pushnil(L), 1) : getcaptures(L, s, r, ptop);
+  r_returncontext(L, 0, mc, ptop);
+  return n;
 }
 
 /* required args: peg, input
- * optional args: start position, encoding type, total time accumulator, lpeg time accumulator
- * encoding types: debug (-1), byte array (0), json (1), input (2)
+ * optional args: start position, encoding type, total time accumulator, lpeg time accumulator,
+ *   match context, capture filter
+ * encoding types: debug (-1), json (1), input (2), byte array (3), msgpack (4), cbor (5),
+ *   offsets (7) (and columns (6), for rmatch_batch only)
  * RESTRICTION: only a limited set of capture types are supported
 */
 
-/* inline? */
-static int do_r_match (lua_State *L, int from_lua) {
-  Capture capture[INITCAPSIZE];
-  int n, encoding, input_type;
-  lua_Integer t0, tmatch, tfinal, duration0, duration1;
-  const char *r;
-  size_t l;
-  Pattern *p;
-  Instruction *code;
+/*
+** Get the subject of a match: from lua code, accept Lua string,
+** ROSIE_BUFFER or ROSIE_MMAP for input.  Only C code, like librosie, can call here
+** with a rosie_string.  Return NULL when there is no input at all.
+*/
+static const char *getsubject (lua_State *L, int from_lua, size_t *l) {
   const char *s;
-  size_t i;
-  int ptop;
   void *buf;
-  
-  t0 = (lua_Integer) clock();
-  p = (getpatt(L, 1, NULL), getpattern(L, 1));
-  code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
-
-  /* From lua code, accept Lua string or ROSIE_BUFFER for input */
-  /* Only C code, like librosie, can call here with a rosie_string. */
-  input_type = lua_type(L, SUBJIDX);
-  switch (input_type) {
+  switch (lua_type(L, SUBJIDX)) {
   case LUA_TLIGHTUSERDATA: {
-    if (from_lua) return luaL_argerror(L, SUBJIDX, "lightuserdata prohibited");
+    if (from_lua) luaL_argerror(L, SUBJIDX, "lightuserdata prohibited");
     buf = lua_touserdata(L, SUBJIDX);
-    if (!buf) return 0;		/* TODO: how to signal a fatal error? */
+    if (!buf) return NULL;	/* TODO: how to signal a fatal error? */
     s = (char *) ((rstr *)buf)->ptr;
-    l = ((rstr *)buf)->len;
+    *l = ((rstr *)buf)->len;
     break;
   }
-  case LUA_TUSERDATA: {
-    buf = luaL_testudata(L, SUBJIDX, ROSIE_BUFFER);
-    if (!buf) return 0;		/* TODO: how to signal a fatal error? */
-    s = ((rBuffer *)buf)->data;
-    l = ((rBuffer *)buf)->n;
+  case LUA_TUSERDATA: {		/* ROSIE_BUFFER or ROSIE_MMAP */
+    s = r_bufferdata(L, SUBJIDX, l);
+    if (!s) return NULL;	/* TODO: how to signal a fatal error? */
     break;
   }
   case LUA_TSTRING: { 
-    s = luaL_checklstring(L, SUBJIDX, &l);
+    s = luaL_checklstring(L, SUBJIDX, l);
     break;
   }
   default: 
-    return luaL_argerror(L, SUBJIDX, from_lua ? "not rbuffer or lua string" : "not rbuffer, rstr, or lua string");
+    luaL_argerror(L, SUBJIDX, from_lua ? "not rbuffer or lua string" : "not rbuffer, rstr, or lua string");
+    return NULL;
   }
-      
-  if (l > INT_MAX) luaL_error(L, "input string too long");
+  if (*l > INT_MAX) luaL_error(L, "input string too long");
+  return s;
+}
+
+/* Push the values of r_getcaptures for a match whose captures the vm
+ * has already encoded into the output buffer (at ptop)
+ */
+static int pushencoded (lua_State *L, const char *s, const char *r, int ptop,
+			int abend, size_t len) {
+  lua_pushvalue(L, ptop);
+  lua_pushinteger(L, (int) len - (r - s)); /* leftover chars */
+  lua_pushboolean(L, abend);
+  return 3;
+}
+
+/* The optional capture filter at idx (see capfilter), or NULL */
+static const rCapFilter *optfilter (lua_State *L, int idx) {
+  const rCapFilter *f;
+  if (lua_isnoneornil(L, idx)) return NULL;
+  f = (const rCapFilter *)luaL_checkudata(L, idx, ROSIE_CAPFILTER);
+  lua_getuservalue(L, idx);
+  lua_getuservalue(L, 1);
+  luaL_argcheck(L, lua_rawequal(L, -1, -2), idx, "filter is for another pattern");
+  lua_pop(L, 2);
+  return f;
+}
+
+/* inline? */
+static int do_r_match (lua_State *L, int from_lua) {
+  int n, encoding, ctx, abend = 0;
+  rMatchCtx *mc;
+  rBuffer *out = NULL;
+  const rCapFilter *filter;
+  lua_Integer t0, tmatch, tfinal, duration0, duration1;
+  const char *r;
+  size_t l;
+  Pattern *p;
+  Instruction *code;
+  const char *s;
+  size_t i;
+  int ptop;
+  
+  t0 = (lua_Integer) clock();
+  p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
+  s = getsubject(L, from_lua, &l);
+  if (!s) return 0;
   i = initposition(L, l, SUBJIDX+1);
   encoding = luaL_optinteger(L, SUBJIDX+2, ENCODE_BYTE);
   duration0 = luaL_optinteger(L, SUBJIDX+3, 0);	/* total time accumulator */
   duration1 = luaL_optinteger(L, SUBJIDX+4, 0); /* total time without post-processing */
+  ctx = r_optcontext(L, SUBJIDX+5);
+  filter = optfilter(L, SUBJIDX+6);
+  if (encoding == ENCODE_BYTE && p->direct && !filter) out = r_getbuffer(L);  /* vm encodes */
   /* prepare for matching */
   ptop = lua_gettop(L);
   lua_pushnil(L);  /* initialize subscache */
-  lua_pushlightuserdata(L, capture);  /* initialize caplistidx */
+  lua_pushnil(L);  /* initialize caplistidx */
   lua_getuservalue(L, 1);  /* initialize penvidx */
-  r = match(L, s, s + i, s + l, code, capture, ptop);
+  mc = r_borrowcontext(L, ctx, ptop);
+  r = r_ctxmatch(L, s, s + i, s + l, code, ptop, out, p->names, &abend);
   tmatch = (lua_Integer) clock();
   if (r == NULL) {
+    r_returncontext(L, ctx, mc, ptop);
     lua_pushboolean(L, 0);	/* false, i.e. no match */
     lua_pushinteger(L, l);	/* leftover value is len */
     lua_pushboolean(L, 0);	/* dummy, so that there are always 5 return values */
@@ -1291,8 +1344,11 @@ static int do_r_match (lua_State *L, int from_lua) {
     lua_pushinteger(L, (tmatch-t0)+duration1); /* match time (includes lpeg overhead) */
     return 5;
   }
-  n = r_getcaptures(L, s, r, ptop, encoding, l);
+  if (filter) r_filtercaptures(L, ptop, filter);
+  if (out) n = pushencoded(L, s, r, ptop, abend, l);
+  else n = r_getcaptures(L, s, r, ptop, p->names, encoding, l);
   assert(n==3);
+  r_returncontext(L, ctx, mc, ptop);
   tfinal = (lua_Integer) clock();
   lua_pushinteger(L, (tfinal-t0)+duration0); /* total time (includes capture processing) */
   lua_pushinteger(L, (tmatch-t0)+duration1); /* match time (includes lpeg overhead) */
@@ -1308,6 +1364,593 @@ int r_match_C (lua_State *L) {
   return do_r_match(L, 0);
 }
 
+/*
+ * Next position in [s, e) where a match of the pattern can start,
+ * or NULL if there is none.  (A pattern that can match the empty
+ * string can also match at e.)
+ */
+static const char *nextcandidate (const Search *sr, const char *s, const char *e) {
+  switch (sr->kind) {
+  case SEARCHCHAR: return (const char *)memchr(s, sr->c, e - s);
+  case SEARCHSET: { s = r_span(sr->skip, s, e); return (s < e) ? s : NULL; }
+  default: return (s <= e) ? s : NULL;
+  }
+}
+
+/* Unanchored match: like rmatch, but the match can start at any
+ * position from the start position on.  The positions that cannot
+ * start a match (see 'setsearch') are skipped without running the
+ * matching vm.  Returns the rmatch values plus the (1-based) position
+ * where the match starts.
+ */
+static int do_r_find (lua_State *L, int from_lua) {
+  int n, encoding, ctx, abend = 0;
+  rMatchCtx *mc;
+  rBuffer *out = NULL;
+  const rCapFilter *filter;
+  lua_Integer t0, tmatch, tfinal, duration0, duration1;
+  const char *r = NULL;
+  const char *start;
+  size_t l;
+  Pattern *p;
+  Instruction *code;
+  const char *s;
+  size_t i;
+  int ptop;
+  
+  t0 = (lua_Integer) clock();
+  p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
+  s = getsubject(L, from_lua, &l);
+  if (!s) return 0;
+  i = initposition(L, l, SUBJIDX+1);
+  encoding = luaL_optinteger(L, SUBJIDX+2, ENCODE_BYTE);
+  duration0 = luaL_optinteger(L, SUBJIDX+3, 0);	/* total time accumulator */
+  duration1 = luaL_optinteger(L, SUBJIDX+4, 0); /* total time without post-processing */
+  ctx = r_optcontext(L, SUBJIDX+5);
+  filter = optfilter(L, SUBJIDX+6);
+  if (encoding == ENCODE_BYTE && p->direct && !filter) out = r_getbuffer(L);  /* vm encodes */
+  /* prepare for matching */
+  ptop = lua_gettop(L);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushnil(L);  /* initialize caplistidx */
+  lua_getuservalue(L, 1);  /* initialize penvidx */
+  mc = r_borrowcontext(L, ctx, ptop);
+  for (start = nextcandidate(&p->search, s + i, s + l);
+       start != NULL;
+       start = nextcandidate(&p->search, start + 1, s + l)) {
+    r = r_ctxmatch(L, s, start, s + l, code, ptop, out, p->names, &abend);
+    if (r != NULL) break;
+    lua_settop(L, stackidx(ptop));  /* drop what the match left */
+  }
+  tmatch = (lua_Integer) clock();
+  if (r == NULL) {
+    r_returncontext(L, ctx, mc, ptop);
+    lua_pushboolean(L, 0);	/* false, i.e. no match */
+    lua_pushinteger(L, l);	/* leftover value is len */
+    lua_pushboolean(L, 0);	/* dummy, so that there are always 6 return values */
+    lua_pushinteger(L, (tmatch-t0)+duration0); /* total time (no capture processing) */
+    lua_pushinteger(L, (tmatch-t0)+duration1); /* match time (includes lpeg overhead) */
+    lua_pushboolean(L, 0);	/* no start position */
+    return 6;
+  }
+  if (filter) r_filtercaptures(L, ptop, filter);
+  if (out) n = pushencoded(L, s, r, ptop, abend, l);
+  else n = r_getcaptures(L, s, r, ptop, p->names, encoding, l);
+  assert(n==3);
+  r_returncontext(L, ctx, mc, ptop);
+  tfinal = (lua_Integer) clock();
+  lua_pushinteger(L, (tfinal-t0)+duration0); /* total time (includes capture processing) */
+  lua_pushinteger(L, (tmatch-t0)+duration1); /* match time (includes lpeg overhead) */
+  lua_pushinteger(L, (start - s) + 1);	     /* where the match starts */
+  return n+3;
+}
+
+int r_find_lua (lua_State *L);
+int r_find_lua (lua_State *L) {
+  return do_r_find(L, 1);
+}
+
+int r_find_C (lua_State *L) {
+  return do_r_find(L, 0);
+}
+
+/* Number of entries of the ktable of the pattern at idx */
+static int numnames (lua_State *L, int idx) {
+  int n;
+  lua_getuservalue(L, idx);
+  n = ktablelen(L, -1);
+  lua_pop(L, 1);
+  return n;
+}
+
+/* capnames(peg): a table of the capture names of the pattern, by the
+ * ktable index that the offsets encoding gives for each one.  (Made
+ * once per pattern, so that the matches need not carry the names.)
+ */
+static int r_capnames (lua_State *L) {
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  rColumns *c;
+  int k, n;
+  if (p->code == NULL) prepcompile(L, p, 1);
+  n = numnames(L, 1);
+  c = r_newcolumns(L, n);
+  r_capcolumns(p, p->names, n, c);
+  lua_createtable(L, n, 0);
+  for (k = 1; k <= n; k++) {
+    if (c->colof[k] < 0) continue;
+    lua_pushlstring(L, p->names[k].name, p->names[k].len);
+    lua_rawseti(L, -2, k);
+  }
+  return 1;
+}
+
+/* Set keep[k] for each ktable index k (of the n of pattern p) whose
+ * name is in the list of names at idx
+ */
+static void keepnames (lua_State *L, Pattern *p, int idx, int n, unsigned char *keep) {
+  int i, k, m = (int) luaL_len(L, idx);
+  for (i = 1; i <= m; i++) {
+    size_t len;
+    const char *name;
+    if (lua_rawgeti(L, idx, i) != LUA_TSTRING)
+      luaL_error(L, "capture name %d is not a string", i);
+    name = lua_tolstring(L, -1, &len);
+    for (k = 1; k <= n; k++)
+      if (p->names[k].name && p->names[k].len == len && memcmp(p->names[k].name, name, len) == 0)
+	keep[k] = 1;
+    lua_pop(L, 1);
+  }
+}
+
+/* capfilter(peg, names [, maxdepth]): a filter for the captures of
+ * the pattern, to be given to rmatch, rfind or rmatch_batch.  Only the
+ * captures with the names in the list names (or all of them, when it
+ * is nil), and no deeper than maxdepth (the outer capture is at 0), are
+ * encoded (see r_filtercaptures).
+ */
+static int r_capfilter (lua_State *L) {
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  lua_Integer maxdepth = luaL_optinteger(L, 3, -1);
+  int all = lua_isnoneornil(L, 2);
+  rCapFilter *f;
+  int k, n;
+  if (!all) luaL_checktype(L, 2, LUA_TTABLE);
+  luaL_argcheck(L, -1 <= maxdepth && maxdepth <= INT_MAX, 3, "out of range");
+  if (p->code == NULL) prepcompile(L, p, 1);
+  n = numnames(L, 1);
+  f = (rCapFilter *)lua_newuserdata(L, sizeof(rCapFilter) + n + 1);
+  f->maxdepth = (int) maxdepth;
+  f->n = n;
+  for (k = 0; k <= n; k++) f->keep[k] = (unsigned char) all;
+  if (!all) keepnames(L, p, 2, n, f->keep);
+  luaL_newmetatable(L, ROSIE_CAPFILTER);
+  lua_setmetatable(L, -2);
+  lua_getuservalue(L, 1);	/* the filter is for the ktable of the pattern */
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+typedef struct PruneState {
+  TTree *root;			/* tree being copied */
+  TTree *out;			/* the copy */
+  int n;			/* nodes in the copy */
+  int *map;			/* position in the copy of each node of root */
+  const unsigned char *keep;	/* captures to keep, by name (ktable index) */
+} PruneState;
+
+/* Copy tree t, without the rosie captures whose names are not kept
+ * (each is replaced by its pattern), except for the outer capture.
+ * The copy of a call keeps the position of its rule in root, to be
+ * fixed when all the rules have been copied.
+ */
+static void prunetree (PruneState *ps, TTree *t) {
+  int pos;
+ tailcall:
+  if (t->tag == TCapture && (t->cap == Crosiecap || t->cap == Crosieconst) &&
+      t != ps->root && !ps->keep[t->key]) {
+    t = sib1(t); goto tailcall;
+  }
+  pos = ps->n++;
+  ps->out[pos] = *t;
+  ps->map[t - ps->root] = pos;
+  switch (t->tag) {
+    case TSet:			/* copy the charset too */
+      memcpy(treebuffer(&ps->out[pos]), treebuffer(t), CHARSETSIZE);
+      ps->n += bytes2slots(CHARSETSIZE);
+      break;
+    case TCall: ps->out[pos].u.ps = (int) (sib2(t) - ps->root); break;
+    default: break;
+  }
+  switch (numsiblings[t->tag]) {
+    case 1:
+      t = sib1(t); goto tailcall;
+    case 2:
+      prunetree(ps, sib1(t));
+      ps->out[pos].u.ps = ps->n - pos;
+      t = sib2(t); goto tailcall;
+    default: break;
+  }
+}
+
+/* correctassociativity for all of tree t, including its grammars */
+static void fixassociativity (TTree *t) {
+ tailcall:
+  if (t->tag == TSeq || t->tag == TChoice) correctassociativity(t);
+  switch (numsiblings[t->tag]) {
+    case 1: t = sib1(t); goto tailcall;
+    case 2: fixassociativity(sib1(t)); t = sib2(t); goto tailcall;
+    default: break;
+  }
+}
+
+/* prune(peg, names): a new pattern that is peg without its rosie
+ * captures whose names are not in the list names, so that neither the
+ * vm nor the encoders spend time on them, and the compiler can
+ * optimize the pattern they held.  A capture that is removed is
+ * replaced by its pattern, so its subs that are kept become subs of
+ * its parent.  The outer capture is always kept.  The new pattern
+ * shares the ktable of peg.
+ */
+static int r_prune (lua_State *L) {
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  int size = getsize(L, 1);
+  PruneState ps;
+  unsigned char *keep;
+  TTree *tree;
+  int i, n;
+  luaL_checktype(L, 2, LUA_TTABLE);
+  if (p->code == NULL) prepcompile(L, p, 1);  /* fixes the tree, and makes the names */
+  n = numnames(L, 1);
+  ps.out = (TTree *)lua_newuserdata(L, size * (sizeof(TTree) + sizeof(int)) + n + 1);
+  ps.map = (int *)(ps.out + size);
+  keep = (unsigned char *)(ps.map + size);
+  memset(keep, 0, n + 1);
+  keepnames(L, p, 2, n, keep);
+  ps.root = p->tree;
+  ps.n = 0;
+  ps.keep = keep;
+  prunetree(&ps, p->tree);
+  for (i = 0; i < ps.n; i++) {	/* the calls, now that every rule is copied */
+    if (ps.out[i].tag == TCall) ps.out[i].u.ps = ps.map[ps.out[i].u.ps] - i;
+    else if (ps.out[i].tag == TSet) i += bytes2slots(CHARSETSIZE);
+  }
+  fixassociativity(ps.out);
+  tree = newtree(L, ps.n);
+  memcpy(tree, ps.out, ps.n * sizeof(TTree));
+  lua_getuservalue(L, 1);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+typedef struct BatchState {
+  lua_State *L;
+  Pattern *p;
+  Instruction *code;
+  int ptop;
+  int encoding;
+  rBuffer *out;
+  rBuffer *index;
+  rColumns *cols;		/* for the columnar encoding, or NULL */
+  const rCapFilter *filter;	/* or NULL */
+} BatchState;
+
+/*
+ * Match one record of a batch, appending its encoding to out and its
+ * entry to index: the offset of the encoding in out, its length (-1
+ * for no match), the leftover chars, and 1 if the match halted (or 0).
+ * For the columnar encoding, the record is added to cols instead, and
+ * its encoding in out is empty.
+ */
+static void matchrecord (BatchState *bs, const char *s, size_t l) {
+  lua_State *L = bs->L;
+  rBuffer *out = bs->out;
+  int ptop = bs->ptop;
+  const char *r;
+  size_t start = out->n;
+  int abend = 0;
+  int direct = (bs->encoding == ENCODE_BYTE && bs->p->direct && !bs->filter);
+  if (l > INT_MAX) luaL_error(L, "input string too long");
+  if (start > INT_MAX) luaL_error(L, "batch output too long");
+  r = r_ctxmatch(L, s, s, s + l, bs->code, ptop, direct ? out : NULL, bs->p->names, &abend);
+  if (r != NULL && bs->filter) r_filtercaptures(L, ptop, bs->filter);
+  if (bs->cols) abend = r_encodecolumns(L, ptop, bs->cols, r != NULL);
+  else if (r != NULL && !direct)
+    abend = r_encodecaptures(L, s, ptop, bs->p->names, bs->encoding, l, out);
+  r_addint(L, bs->index, (int) start);
+  r_addint(L, bs->index, (r == NULL) ? -1 : (int) (out->n - start));
+  r_addint(L, bs->index, (int) l - ((r == NULL) ? 0 : (int) (r - s)));
+  r_addint(L, bs->index, abend);
+  lua_settop(L, stackidx(ptop));  /* drop what the match left */
+}
+
+/* required args: peg, input (a list of strings, or an rbuffer or mmap)
+ * optional args: encoding type, record delimiter (for an rbuffer; default newline),
+ *   match context, capture filter
+ * Matches each record in one call, and returns a new output buffer
+ * holding all their encodings, a new index buffer with 4 ints per
+ * record (see matchrecord), and the number of records.  With the
+ * columnar encoding, the output buffer holds one block for the whole
+ * batch (see rcap.c).
+ */
+static int r_match_batch (lua_State *L) {
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  Instruction *code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
+  int encoding = luaL_optinteger(L, SUBJIDX+1, ENCODE_BYTE);
+  const char *delim = luaL_optstring(L, SUBJIDX+2, "\n");
+  int c = (byte) delim[0];
+  const char *in = NULL;
+  size_t inlen = 0;
+  BatchState bs;
+  lua_Integer n = 0, k;
+  int ctx = r_optcontext(L, SUBJIDX+3);
+  rMatchCtx *mc;
+  luaL_argcheck(L, delim[0] != '\0' && delim[1] == '\0', SUBJIDX+2, "not a single char");
+  if (lua_type(L, SUBJIDX) == LUA_TTABLE) n = luaL_len(L, SUBJIDX);
+  else if ((in = r_bufferdata(L, SUBJIDX, &inlen)) == NULL)
+    return luaL_argerror(L, SUBJIDX, "not a list, rbuffer or mmap");
+  bs.filter = optfilter(L, SUBJIDX+4);
+  lua_settop(L, SUBJIDX+4);
+  bs.L = L;
+  bs.p = p;
+  bs.code = code;
+  bs.encoding = encoding;
+  bs.cols = NULL;
+  if (encoding == ENCODE_COLUMNS) {
+    int nnames = numnames(L, 1);
+    bs.cols = r_newcolumns(L, nnames);  /* (and its buffers) */
+    r_capcolumns(p, p->names, nnames, bs.cols);
+  }
+  bs.out = r_newbuffer(L);
+  bs.index = r_newbuffer(L);
+  /* prepare for matching */
+  bs.ptop = lua_gettop(L);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushnil(L);  /* initialize caplistidx */
+  lua_getuservalue(L, 1);  /* initialize penvidx */
+  mc = r_borrowcontext(L, ctx, bs.ptop);
+  if (in == NULL) {
+    for (k = 1; k <= n; k++) {
+      size_t l;
+      const char *s;
+      if (lua_rawgeti(L, SUBJIDX, k) != LUA_TSTRING)
+	return luaL_error(L, "batch record %d is not a string", (int) k);
+      s = lua_tolstring(L, -1, &l);
+      lua_pop(L, 1);		/* string is still in the list */
+      matchrecord(&bs, s, l);
+    }
+  }
+  else {
+    const char *s = in;
+    const char *e = s + inlen;
+    while (s < e) {
+      const char *eol = (const char *)memchr(s, c, e - s);
+      size_t l = (eol ? eol : e) - s;
+      matchrecord(&bs, s, l);
+      s += l + 1;
+      n++;
+    }
+  }
+  r_returncontext(L, ctx, mc, bs.ptop);
+  if (bs.cols) r_endcolumns(L, bs.cols, p->names, bs.out);
+  lua_settop(L, bs.ptop);
+  lua_pushinteger(L, n);
+  return 3;
+}
+
+/*
+ * Streaming matcher.  A stream holds a pattern, an encoding, and the
+ * start of a record that did not end in the last chunk of input
+ * (the carry).  Each chunk given to r_match_stream is split into
+ * newline-terminated records, and each record is matched on its own.
+ * The output gets one result per record: for the text encodings, the
+ * encoding followed by a newline (just the newline for no match);
+ * for the byte encoding, the length of the encoding (-1 for no match)
+ * as an int, followed by the encoding.
+ */
+
+typedef struct StreamState {
+  lua_State *L;
+  Instruction *code;
+  const rName *names;
+  int direct;			/* the vm encodes the captures */
+  int ptop;
+  int encoding;
+  rBuffer *out;
+  int n;			/* number of records matched */
+} StreamState;
+
+static void streamrecord (StreamState *ss, const char *s, size_t l) {
+  lua_State *L = ss->L;
+  rBuffer *out = ss->out;
+  size_t pos = out->n;
+  const char *r;
+  int abend;
+  if (l > INT_MAX) luaL_error(L, "input string too long");
+  if (ss->encoding == ENCODE_BYTE) r_addint(L, out, -1); /* length, set below */
+  r = r_ctxmatch(L, s, s, s + l, ss->code, ss->ptop, ss->direct ? out : NULL, ss->names, &abend);
+  if (r != NULL && !ss->direct) r_encodecaptures(L, s, ss->ptop, ss->names, ss->encoding, l, out);
+  if (ss->encoding != ENCODE_BYTE) {
+    char nl = '\n';
+    r_addchar(L, out, nl);
+  }
+  else if (r != NULL) r_setint(out, pos, (int) (out->n - pos - 4));
+  lua_settop(L, stackidx(ss->ptop));  /* drop what the match left */
+  ss->n++;
+}
+
+/* Match the complete records in [s, s+l), knowing that there is no
+ * newline before s+from.  Returns the length of the records matched.
+ */
+static size_t streamrecords (StreamState *ss, const char *s, size_t l, size_t from) {
+  const char *e = s + l;
+  const char *rec = s;
+  const char *next = s + from;
+  const char *eol;
+  while ((eol = (const char *)memchr(next, '\n', e - next)) != NULL) {
+    streamrecord(ss, rec, eol - rec);
+    rec = next = eol + 1;
+  }
+  return rec - s;
+}
+
+/* Chunk of input given as a string or buffer */
+static void streamchunk (StreamState *ss, rBuffer *carry, const char *s, size_t l) {
+  size_t used;
+  if (carry->n > 0) {		/* finish the pending record first */
+    const char *eol = (const char *)memchr(s, '\n', l);
+    if (!eol) {
+      r_addlstring(ss->L, carry, s, l);
+      return;
+    }
+    r_addlstring(ss->L, carry, s, eol - s);
+    streamrecord(ss, carry->data, carry->n);
+    carry->n = 0;
+    l -= (eol + 1) - s;
+    s = eol + 1;
+  }
+  used = streamrecords(ss, s, l, 0);
+  r_addlstring(ss->L, carry, s + used, l - used);
+}
+
+/* Chunk of input read from a file: read it at the end of the carry */
+static int streamread (StreamState *ss, rBuffer *carry, FILE *f, int fd) {
+  lua_State *L = ss->L;
+  size_t old = carry->n;
+  char *dst = r_prepbuffsize(L, carry, R_STREAMCHUNK);
+  size_t used;
+  if (f) {
+    size_t got = fread(dst, 1, R_STREAMCHUNK, f);
+    if (got == 0) {
+      if (ferror(f)) luaL_error(L, "read error: %s", strerror(errno));
+      return 0;
+    }
+    addsize(carry, got);
+  }
+  else {
+    ssize_t got;
+    do got = read(fd, dst, R_STREAMCHUNK); while (got < 0 && errno == EINTR);
+    if (got < 0) luaL_error(L, "read error: %s", strerror(errno));
+    if (got == 0) return 0;
+    addsize(carry, (size_t) got);
+  }
+  used = streamrecords(ss, carry->data, carry->n, old);
+  memmove(carry->data, carry->data + used, carry->n - used);
+  carry->n -= used;
+  return 1;
+}
+
+/* required args: peg
+ * optional args: encoding type
+ */
+static int r_newstream (lua_State *L) {
+  rStream *st;
+  int encoding = luaL_optinteger(L, 2, ENCODE_BYTE);
+  getpatt(L, 1, NULL);
+  luaL_argcheck(L, (encoding == ENCODE_BYTE) || (encoding == ENCODE_JSON) || (encoding == ENCODE_LINE),
+		2, "invalid encoding for a stream");
+  st = (rStream *)lua_newuserdata(L, sizeof(rStream));
+  st->encoding = encoding;
+  luaL_newmetatable(L, ROSIE_STREAM);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 2, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);	/* pattern */
+  r_newbuffer(L);
+  lua_rawseti(L, -2, 2);	/* carry */
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+/* required args: stream, source, output buffer
+ * optional args: match context
+ * The source is a chunk of input (string or rbuffer), a file handle
+ * or file descriptor (to read the next chunk from), or nil (to end
+ * the input).  Returns the number of records matched, and true if the
+ * input has ended (after matching its last record, even if it does not
+ * end in a newline).
+ */
+static int r_match_stream (lua_State *L) {
+  StreamState ss;
+  Pattern *p;
+  rBuffer *carry;
+  const char *s;
+  size_t l;
+  luaL_Stream *fs = (luaL_Stream *)luaL_testudata(L, 2, LUA_FILEHANDLE);
+  int eof = 0;
+  rStream *st = (rStream *)luaL_checkudata(L, 1, ROSIE_STREAM);
+  int ctx = r_optcontext(L, 4);
+  rMatchCtx *mc;
+  if (fs != NULL && fs->closef == NULL)  /* (as liolib's 'tofile') */
+    return luaL_argerror(L, 2, "attempt to use a closed file");
+  ss.out = (rBuffer *)luaL_checkudata(L, 3, ROSIE_BUFFER);
+  lua_settop(L, 4);
+  lua_getuservalue(L, 1);
+  lua_rawgeti(L, 5, 1);		/* pattern at 6 */
+  lua_rawgeti(L, 5, 2);		/* carry at 7 */
+  p = getpattern(L, 6);
+  carry = (rBuffer *)lua_touserdata(L, 7);
+  ss.L = L;
+  ss.code = (p->code != NULL) ? p->code : prepcompile(L, p, 6);
+  ss.encoding = st->encoding;
+  ss.names = p->names;
+  ss.direct = (ss.encoding == ENCODE_BYTE && p->direct);
+  ss.n = 0;
+  /* prepare for matching */
+  ss.ptop = lua_gettop(L);
+  lua_pushnil(L);  /* initialize subscache */
+  lua_pushnil(L);  /* initialize caplistidx */
+  lua_getuservalue(L, 6);  /* initialize penvidx */
+  mc = r_borrowcontext(L, ctx, ss.ptop);
+  switch (lua_type(L, 2)) {
+  case LUA_TNIL: { eof = 1; break; }
+  case LUA_TSTRING: {
+    s = lua_tolstring(L, 2, &l);
+    streamchunk(&ss, carry, s, l);
+    break;
+  }
+  case LUA_TNUMBER: {
+    eof = !streamread(&ss, carry, NULL, (int) luaL_checkinteger(L, 2));
+    break;
+  }
+  case LUA_TUSERDATA: {
+    if ((s = r_bufferdata(L, 2, &l)) != NULL)	/* rbuffer or mmap */
+      streamchunk(&ss, carry, s, l);
+    else if (fs != NULL)
+      eof = !streamread(&ss, carry, fs->f, -1);
+    else return luaL_argerror(L, 2, "not rbuffer or file");
+    break;
+  }
+  default:
+    return luaL_argerror(L, 2, "not rbuffer, lua string, file, or nil");
+  }
+  if (eof && carry->n > 0) {	/* last record has no newline? */
+    streamrecord(&ss, carry->data, carry->n);
+    carry->n = 0;
+  }
+  r_returncontext(L, ctx, mc, ss.ptop);
+  lua_settop(L, ss.ptop);
+  lua_pushinteger(L, ss.n);
+  lua_pushboolean(L, eof);
+  return 2;
+}
+
+
+/*
+** export(peg): a copy of the compiled pattern that holds no Lua
+** references (a ROSIE_SHARED), so that C code can match with it from
+** many threads (see rshare.c)
+*/
+static int r_export (lua_State *L) {
+  Pattern *p = (getpatt(L, 1, NULL), getpattern(L, 1));
+  Instruction *code = (p->code != NULL) ? p->code : prepcompile(L, p, 1);
+  rPattern *sp;
+  lua_getuservalue(L, 1);  /* ktable */
+  sp = r_newshared(L, code, p->codesize, lua_gettop(L), p->direct);
+  r_pushshared(L, sp);
+  return 1;
+}
+
 /*
 ** {======================================================
 ** Library creation and functions not related to matching
@@ -1344,6 +1987,8 @@ static int lp_type (lua_State *L) {
 int lp_gc (lua_State *L) {
   Pattern *p = getpattern(L, 1);
   realloccode(L, p, 0);  /* delete code block */
+  free(p->names);  /* rosie */
+  p->names = NULL;
   return 0;
 }
 
@@ -1411,11 +2056,23 @@ static struct luaL_Reg pattreg[] = {
   {"rcap", r_capture},
   {"rconstcap", r_constcapture},
   {"rmatch", r_match_lua},
+  {"rfind", r_find_lua},
+  {"rmatch_batch", r_match_batch},
+  {"newstream", r_newstream},
+  {"rmatch_stream", r_match_stream},
+  {"mmap", r_lua_mmap},
+  {"export", r_export},
+  {"newcontext", r_lua_newcontext},
+  {"rmatch_parallel", r_match_parallel},
   {"newbuffer", r_lua_newbuffer},
   {"getdata", r_lua_getdata},
   {"writedata", r_lua_writedata},
   {"add", r_lua_add},
   {"decode", r_lua_decode},
+  {"cursor", r_lua_cursor},
+  {"capnames", r_capnames},
+  {"capfilter", r_capfilter},
+  {"prune", r_prune},
   {NULL, NULL}
 };
 
@@ -55,9 +55,26 @@ typedef struct TTree {
 ** A complete pattern has its tree plus, if already compiled,
 ** its corresponding code
 */
+/*
+** rosie: how 'rfind' looks for the positions where a match can start
+*/
+#define SEARCHALL	0	/* every position */
+#define SEARCHCHAR	1	/* positions holding char 'c' */
+#define SEARCHSET	2	/* positions holding a char not in 'skip' */
+
+typedef struct Search {
+  int kind;
+  int c;
+  byte skip[CHARSETSIZE + SPANTABLESIZE];  /* charset and its span tables */
+} Search;
+
+
 typedef struct Pattern {
   union Instruction *code;
   int codesize;
+  Search search;  /* rosie; set by 'compile' */
+  int direct;  /* rosie; set by 'compile' (see 'setdirect') */
+  struct rName *names;  /* rosie; capture names, set with 'code' (see 'r_newnames') */
   TTree tree[1];
 } Pattern;
 
@@ -15,6 +15,7 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <stdint.h>
 
 #include "lua.h"
 
@@ -62,9 +63,13 @@
 
 /* #define MAXCAPIDX USHRT_MAX */
 /* typedef unsigned short capidx_t;  */
-#define MAXCAPIDX 1000000 /* at most can be 2147483647 for signed int32 */
+#define MAXCAPIDX 1000000 /* at most 2^24 - 1, the size of 'idx' in a Capture */
 typedef int32_t capidx_t; 
 
+#if MAXCAPIDX >= (1 << 24)
+#error "MAXCAPIDX does not fit in the 'idx' field of a Capture"
+#endif
+
 
 /* initial size for capture's list */
 #define INITCAPSIZE	32
@@ -130,6 +135,20 @@ typedef struct Charset {
 #define MAXBEHIND	0x7FFF	/* MAXAUX at most (stored in aux field of instruction) */
 
 
+/*
+** nodes in the trie of an ITrie instruction are arrays of ints: the
+** position in the choice of the string that ends at the node (INT_MAX
+** if none), the smallest such position below the node, the number n
+** of children, their labels (n bytes, padded to ints), and their
+** indices in the trie
+*/
+#define TRIEHEADER	3
+
+
+/* maximum length of a literal string in a single instruction */
+#define MAXSTRLEN	0x7FFF	/* (stored in aux field of instruction) */
+
+
 /* maximum size (in elements) for a pattern */
 #define MAXPATTSIZE	(SHRT_MAX - 10)
 
@@ -141,6 +160,23 @@ typedef struct Charset {
 /* size (in elements) for a ISet instruction */
 #define CHARSETINSTSIZE		instsize(CHARSETSIZE)
 
+
+/*
+** Rosie: on x86 (with GCC or Clang) spans are read with SSE/AVX2
+** (see rsimd.c), and an ISpan instruction carries, after its
+** charset, the nibble tables used by the vectorized code
+*/
+#if !defined(ROSIE_NOSIMD) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define ROSIE_SIMD
+#define SPANTABLESIZE	32
+#else
+#define SPANTABLESIZE	0
+#endif
+
+/* size (in elements) for a ISpan instruction */
+#define SPANINSTSIZE		instsize(CHARSETSIZE + SPANTABLESIZE)
+
 /* size (in elements) for a IFunc instruction */
 #define funcinstsize(p)		((p)->i.aux + 2)
 
@@ -149,5 +185,21 @@ typedef struct Charset {
 #define testchar(st,c)	(((int)(st)[((c) >> 3)] & (1 << ((c) & 7))))
 
 
+/*
+** in range instructions, fields 'aux' and 'key' hold one range of
+** characters each: its first character in the low byte and its last
+** character in the high byte (a single range is stored twice)
+*/
+#define joinrange(f,l)	((f) | ((l) << 8))
+#define rangefirst(r)	((r) & 0xFF)
+#define rangelast(r)	(((r) >> 8) & 0xFF)
+#define getrange1(op)	((unsigned short)(op)->i.aux)
+#define getrange2(op)	((unsigned short)(op)->i.key)
+
+#define inrange(r,c)  \
+	((unsigned)((c) - rangefirst(r)) <= (unsigned)(rangelast(r) - rangefirst(r)))
+#define testrange(op,c)	(inrange(getrange1(op), c) || inrange(getrange2(op), c))
+
+
 #endif
 
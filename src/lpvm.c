@@ -4,6 +4,7 @@
 */
 
 #include <limits.h>
+#include <stdlib.h>
 #include <string.h>
 
 
@@ -14,11 +15,18 @@
 #include "lptypes.h"
 #include "lpvm.h"
 #include "lpprint.h"
+#include "rsimd.h"
 
 
-/* initial size for call/backtrack stack */
+/* initial size for call/backtrack stack (rosie: the callers in
+   lptree.c keep theirs in a match context; see rctx.c) */
 #if !defined(INITBACK)
-#define INITBACK	MAXBACK
+#define INITBACK	64
+#endif
+
+/* rosie: initial size for the stack of a match without Lua */
+#if !defined(INITNOLUABACK)
+#define INITNOLUABACK	64
 #endif
 
 
@@ -34,26 +42,38 @@ static const Instruction giveup = {{IGiveup, 0, 0}};
 */
 
 
-typedef struct Stack {
-  const char *s;  /* saved position (or NULL for calls) */
-  const Instruction *p;  /* next instruction */
-  int caplevel;
-} Stack;
-
-
-#define getstackbase(L, ptop)	((Stack *)lua_touserdata(L, stackidx(ptop)))
-
-
 /*
 ** Double the size of the array of captures
 */
-static Capture *doublecap (lua_State *L, Capture *cap, int captop, int ptop) {
+static Capture *doublecap (MatchState *ms, int captop) {
   Capture *newc;
-  if (captop >= INT_MAX/((int)sizeof(Capture) * 2))
-    luaL_error(L, "too many captures");
-  newc = (Capture *)lua_newuserdata(L, captop * 2 * sizeof(Capture));
-  memcpy(newc, cap, captop * sizeof(Capture));
-  lua_replace(L, caplistidx(ptop));
+  if (captop >= INT_MAX/((int)sizeof(Capture) * 2)) {
+    ms->err = MATCH_ECAPTURE;
+    return NULL;
+  }
+  if (ms->arena) {
+    if ((newc = (Capture *)realloc(ms->capture, captop * 2 * sizeof(Capture))) != NULL) {
+      ms->arena->capture = newc;
+      ms->arena->capsize = 2 * captop;
+    }
+  }
+  else if (ms->L) {
+    newc = (Capture *)lua_newuserdata(ms->L, captop * 2 * sizeof(Capture));
+    memcpy(newc, ms->capture, captop * sizeof(Capture));
+    lua_replace(ms->L, caplistidx(ms->ptop));
+  }
+  else if (ms->owned & MATCH_OWNCAPTURE)
+    newc = (Capture *)realloc(ms->capture, captop * 2 * sizeof(Capture));
+  else if ((newc = (Capture *)malloc(captop * 2 * sizeof(Capture))) != NULL) {
+    memcpy(newc, ms->capture, captop * sizeof(Capture));
+    ms->owned |= MATCH_OWNCAPTURE;
+  }
+  if (newc == NULL) {
+    ms->err = MATCH_ENOMEM;
+    return NULL;
+  }
+  ms->capture = newc;
+  ms->capsize = 2 * captop;
   return newc;
 }
 
@@ -61,26 +81,136 @@ static Capture *doublecap (lua_State *L, Capture *cap, int captop, int ptop) {
 /*
 ** Double the size of the stack
 */
-static Stack *doublestack (lua_State *L, Stack **stacklimit, int ptop) {
-  Stack *stack = getstackbase(L, ptop);
+static Stack *doublestack (MatchState *ms, Stack **stacklimit) {
   Stack *newstack;
-  int n = *stacklimit - stack;  /* current stack size */
-  int max, newn;
-  lua_getfield(L, LUA_REGISTRYINDEX, MAXSTACKIDX);
-  max = lua_tointeger(L, -1);  /* maximum allowed size */
-  lua_pop(L, 1);
-  if (n >= max)  /* already at maximum size? */
-    luaL_error(L, "backtrack stack overflow (current limit is %d)", max);
+  int n = ms->stacksize;  /* current stack size */
+  int newn;
+  if (ms->L) {
+    lua_getfield(ms->L, LUA_REGISTRYINDEX, MAXSTACKIDX);
+    ms->maxstack = lua_tointeger(ms->L, -1);  /* maximum allowed size */
+    lua_pop(ms->L, 1);
+  }
+  if (n >= ms->maxstack) {  /* already at maximum size? */
+    ms->err = MATCH_ESTACK;
+    return NULL;
+  }
   newn = 2 * n;  /* new size */
-  if (newn > max) newn = max;
-  newstack = (Stack *)lua_newuserdata(L, newn * sizeof(Stack));
-  memcpy(newstack, stack, n * sizeof(Stack));
-  lua_replace(L, stackidx(ptop));
+  if (newn > ms->maxstack) newn = ms->maxstack;
+  if (ms->arena) {
+    if ((newstack = (Stack *)realloc(ms->stack, newn * sizeof(Stack))) != NULL) {
+      ms->arena->stack = newstack;
+      ms->arena->stacksize = newn;
+    }
+  }
+  else if (ms->L) {
+    newstack = (Stack *)lua_newuserdata(ms->L, newn * sizeof(Stack));
+    memcpy(newstack, ms->stack, n * sizeof(Stack));
+    lua_replace(ms->L, stackidx(ms->ptop));
+  }
+  else if (ms->owned & MATCH_OWNSTACK)
+    newstack = (Stack *)realloc(ms->stack, newn * sizeof(Stack));
+  else if ((newstack = (Stack *)malloc(newn * sizeof(Stack))) != NULL) {
+    memcpy(newstack, ms->stack, n * sizeof(Stack));
+    ms->owned |= MATCH_OWNSTACK;
+  }
+  if (newstack == NULL) {
+    ms->err = MATCH_ENOMEM;
+    return NULL;
+  }
+  ms->stack = newstack;
+  ms->stacksize = newn;
   *stacklimit = newstack + newn;
   return newstack + n;  /* return next position */
 }
 
 
+/*
+** rosie: direct encoding (see 'MatchState').  Append to 'ms->out' the
+** name with index 'idx' (negating its length for the value of a
+** constant capture), as 'encode_name' in rcap.c does.
+*/
+static void directname (MatchState *ms, int idx, int constcap) {
+  const char *name;
+  size_t len;
+  if (ms->names && !constcap) {
+    r_addlstring(ms->L, ms->out, ms->names[idx].byte, ms->names[idx].bytelen);
+    return;
+  }
+  if (ms->names) {
+    name = ms->names[idx].name;
+    len = ms->names[idx].len;
+  }
+  else {
+    lua_rawgeti(ms->L, ktableidx(ms->ptop), idx);
+    name = lua_tolstring(ms->L, -1, &len);
+    lua_pop(ms->L, 1);  /* the string stays in the ktable */
+  }
+  r_addshort(ms->L, ms->out, (short) (constcap ? -(int) len : (int) len));
+  r_addlstring(ms->L, ms->out, name, len);
+}
+
+
+/*
+** rosie: append to 'ms->out' the byte encoding of capture instruction
+** 'p' at position 'pos' (see rcap.c), and return the length of the
+** encoding of this match since 'base', or -1 if it is too long
+*/
+static int directcap (MatchState *ms, const Instruction *p, uint32_t pos,
+                      size_t base) {
+  lua_State *L = ms->L;
+  switch ((Opcode)p->i.code) {
+    case IOpenCapture:
+      r_addint(L, ms->out, -(int) (pos + 1));
+      directname(ms, p->i.key, 0);
+      break;
+    case ICloseCapture:
+      r_addint(L, ms->out, (int) (pos + 1));
+      break;
+    default:  /* IFullCapture */
+      r_addint(L, ms->out, -(int) (pos - getoff(p) + 1));
+      if (getkind(p) == Crosieconst) directname(ms, p->i.key + 1, 1);
+      directname(ms, p->i.key, 0);
+      r_addint(L, ms->out, (int) (pos + 1));
+      break;
+  }
+  if (ms->out->failed) {  /* (only without Lua) */
+    ms->err = MATCH_ENOMEM;
+    return -1;
+  }
+  if (ms->out->n - base > INT_MAX) {
+    ms->err = MATCH_ECAPTURE;
+    return -1;
+  }
+  return (int) (ms->out->n - base);
+}
+
+
+/*
+** rosie: at a halt, close the captures still open in the encoding
+** since 'base' (as 'caploop' does), at position 'pos'
+*/
+static void directhalt (MatchState *ms, uint32_t pos, size_t base) {
+  const char *b = ms->out->data + base;
+  const char *e = ms->out->data + ms->out->n;
+  int open = 0;
+  while (b < e) {
+    if (r_readint(&b) < 0) {  /* start of a capture: skip its names */
+      int len = r_readshort(&b);
+      if (len <= 0) {  /* value of a constant capture */
+        b += -len;
+        len = r_readshort(&b);
+      }
+      b += len;
+      open++;
+    }
+    else open--;  /* end of a capture */
+  }
+  while (open-- > 0)
+    r_addint(ms->L, ms->out, (int) (pos + 1));
+  if (ms->out->failed) ms->err = MATCH_ENOMEM;  /* (only without Lua) */
+}
+
+
 /*
 ** Interpret the result of a dynamic capture: false -> fail;
 ** true -> keep current position; number -> next position.
@@ -111,7 +241,7 @@ static int resdyncaptures (lua_State *L, int fr, int curr, int limit) {
 ** 'base', nested inside a group capture. 'fd' indexes the first capture
 ** value, 'n' is the number of values (at least 1).
 */
-static void adddyncaptures (const char *s, Capture *base, int n, int fd) {
+static void adddyncaptures (uint32_t s, Capture *base, int n, int fd) {
   int i;
   /* Cgroup capture is already there */
   assert(base[0].kind == Cgroup && base[0].siz == 0);
@@ -142,6 +272,37 @@ static int removedyncap (lua_State *L, Capture *capture,
 
 
 
+/*
+** Match the strings in the trie of an ITrie instruction (see 'codetrie')
+** against the subject at 's'. Return the length of the string that
+** comes first in the original choice among those that are a prefix of
+** the subject, or -1 if none is.
+*/
+static int triematch (const int *trie, const char *s, const char *e) {
+  const int *node = trie;
+  int best = INT_MAX;  /* position in the choice of the best string */
+  int len = -1;
+  int depth = 0;
+  for (;;) {
+    const byte *labels = (const byte *)(node + TRIEHEADER);
+    const byte *l;
+    int n = node[2];  /* number of children */
+    if (node[0] < best) {  /* a better string ends here? */
+      best = node[0];
+      len = depth;
+    }
+    if (n == 0 || s + depth >= e ||
+        (l = (const byte *)memchr(labels, (byte)s[depth], n)) == NULL)
+      break;
+    node = trie + (node + TRIEHEADER + (n + 3) / 4)[l - labels];
+    if (node[1] >= best)  /* no better string below this node? */
+      break;
+    depth++;
+  }
+  return len;
+}
+
+
 /* 
   Mark reports: 98% of bytecodes executed in the Rosie syslog pattern are these (in order): 
     TestSet, Any, PartialCommit
@@ -150,157 +311,305 @@ static int removedyncap (lua_State *L, Capture *capture,
 */
 
 /*
-** Opcode interpreter
+** Instruction dispatch.  With GCC and Clang the interpreter uses
+** "labels as values": each instruction ends by jumping directly to
+** the code of the next one (replicated dispatch), so that the branch
+** predictor sees a separate indirect jump per opcode.  Define
+** LPEG_SWITCH to use instead the portable 'switch' inside a loop.
 */
-const char *match (lua_State *L, const char *o, const char *s, const char *e,
-                   Instruction *op, Capture *capture, int ptop) {
-  Stack stackbase[INITBACK];
-  Stack *stacklimit = stackbase + INITBACK;
-  Stack *stack = stackbase;  /* point to first empty slot in stack */
-  int capsize = INITCAPSIZE;
+#if !defined(LPEG_SWITCH) && defined(__GNUC__)
+#define LPEG_THREADED
+#endif
+
+#if defined(DEBUG)
+#define vmtrace() { \
+      printf("s: |%s| stck:%d, dyncaps:%d, caps:%d  ", \
+             s, (int)(stack - ms->stack), ndyncap, captop); \
+      printinst(op, p); \
+      printcaplist(capture, capture + captop); \
+      fflush(stdout); }
+#else
+#define vmtrace()	((void)0)
+#endif
+
+#define vmcheck() \
+  assert((L == NULL || stackidx(ms->ptop) + ndyncap == lua_gettop(L)) && \
+         ndyncap <= captop)
+
+#if defined(LPEG_THREADED)
+
+#define vmdispatch(o)	goto *disptab[o];
+#define vmcase(l)	L_##l:
+#define vmbreak		{ vmtrace(); vmcheck(); goto *disptab[p->i.code]; }
+#define vmdefault	L_default
+#define vmfallthrough	/* empty */
+
+#else
+
+#define vmdispatch(o)	switch (o)
+#define vmcase(l)	case l:
+#define vmbreak		continue
+#define vmdefault	default
+#define vmfallthrough	__attribute__ ((fallthrough));
+
+#endif
+
+#if defined(LPEG_THREADED)
+/* computed gotos are a GNU extension */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+/*
+** Opcode interpreter.  Return the end of the match, or NULL if there
+** is no match or (with 'ms->err' set) the match was abandoned.
+*/
+const char *r_vmmatch (MatchState *ms, const char *o, const char *s,
+                       const char *e, const Instruction *op) {
+  lua_State *L = ms->L;
+  Stack *stacklimit = ms->stack + ms->stacksize;
+  Stack *stack = ms->stack;  /* point to first empty slot in stack */
+  Capture *capture = ms->capture;
+  int capsize = ms->capsize;
   int captop = 0;  /* point to first empty slot in captures */
   int ndyncap = 0;  /* number of dynamic captures (in Lua stack) */
+  rBuffer *out = ms->out;  /* rosie: for direct encoding */
+  size_t outbase = (out != NULL) ? out->n : 0;  /* (then 'captop' is its length) */
   const Instruction *p = op;  /* current instruction */
+#if defined(LPEG_THREADED)
+  static const void *const disptab[] = {
+    [IAny] = &&L_IAny, [IChar] = &&L_IChar, [ISet] = &&L_ISet,
+    [ITestAny] = &&L_ITestAny, [ITestChar] = &&L_ITestChar,
+    [ITestSet] = &&L_ITestSet, [ISpan] = &&L_ISpan,
+    [IRange] = &&L_IRange, [ITestRange] = &&L_ITestRange,
+    [ISpanRange] = &&L_ISpanRange,
+    [IString] = &&L_IString, [ITestString] = &&L_ITestString,
+    [IDispatch] = &&L_IDispatch, [ITrie] = &&L_ITrie,
+    [IBehind] = &&L_IBehind, [IRet] = &&L_IRet, [IEnd] = &&L_IEnd,
+    [IChoice] = &&L_IChoice, [IJmp] = &&L_IJmp, [ICall] = &&L_ICall,
+    [IOpenCall] = &&L_default, [ICommit] = &&L_ICommit,
+    [IPartialCommit] = &&L_IPartialCommit,
+    [IBackCommit] = &&L_IBackCommit, [IFailTwice] = &&L_IFailTwice,
+    [IFail] = &&L_IFail, [IGiveup] = &&L_IGiveup,
+    [IFullCapture] = &&L_IFullCapture,
+    [IOpenCapture] = &&L_IOpenCapture,
+    [ICloseCapture] = &&L_ICloseCapture,
+    [ICloseRunTime] = &&L_ICloseRunTime, [IHalt] = &&L_IHalt
+  };
+#endif
+  if ((size_t) (e - o) >= CAPMAXSUBJECT) {  /* rosie: see 'Capture' */
+    ms->err = MATCH_ESUBJECT;
+    return NULL;
+  }
   stack->p = &giveup; stack->s = s; stack->caplevel = 0; stack++;
-  lua_pushlightuserdata(L, stackbase);
   for (;;) {
-#if defined(DEBUG)
-      printf("s: |%s| stck:%d, dyncaps:%d, caps:%d  ",
-             s, stack - getstackbase(L, ptop), ndyncap, captop);
-      printinst(op, p);
-      printcaplist(capture, capture + captop);
-      fflush();
-#endif
-    assert(stackidx(ptop) + ndyncap == lua_gettop(L) && ndyncap <= captop);
-    switch ((Opcode)p->i.code) {
-      case IEnd: {
-        assert(stack == getstackbase(L, ptop) + 1);
+    vmtrace();
+    vmcheck();
+    vmdispatch ((Opcode)p->i.code) {
+      vmcase(IEnd) {
+        assert(stack == ms->stack + 1);
+        if (out) return s;  /* rosie: no capture list */
 	/* this Cclose capture is a sentinel to mark the end of the linked caplist */
         capture[captop].kind = Cclose;
-        capture[captop].s = NULL;
+        capture[captop].siz = 0;
+        capture[captop].s = capoffset(o, s);
+        ms->ncap = captop + 1;
         return s;
       }
-      case IGiveup: {
-        assert(stack == getstackbase(L, ptop));
+      vmcase(IGiveup) {
+        assert(stack == ms->stack);
         return NULL;
       }
-      case IRet: {
-        assert(stack > getstackbase(L, ptop) && (stack - 1)->s == NULL);
+      vmcase(IRet) {
+        assert(stack > ms->stack && (stack - 1)->s == NULL);
         p = (--stack)->p;
-        continue;
+        vmbreak;
       }
-      case IAny: {
+      vmcase(IAny) {
         if (s < e) { p++; s++; }
         else goto fail;
-        continue;
+        vmbreak;
       }
-      case ITestAny: {
+      vmcase(ITestAny) {
         if (s < e) p += 2;
         else p += getoffset(p);
-        continue;
+        vmbreak;
       }
-      case IChar: {
+      vmcase(IChar) {
         if ((byte)*s == p->i.aux && s < e) { p++; s++; }
         else goto fail;
-        continue;
+        vmbreak;
       }
-      case ITestChar: {
+      vmcase(ITestChar) {
         if ((byte)*s == p->i.aux && s < e) p += 2;
         else p += getoffset(p);
-        continue;
+        vmbreak;
       }
-      case ISet: {
+      vmcase(ISet) {
         int c = (byte)*s;
         if (testchar((p+1)->buff, c) && s < e)
           { p += CHARSETINSTSIZE; s++; }
         else goto fail;
-        continue;
+        vmbreak;
       }
-      case ITestSet: {
+      vmcase(ITestSet) {
         int c = (byte)*s;
         if (testchar((p + 2)->buff, c) && s < e)
           p += 1 + CHARSETINSTSIZE;
         else p += getoffset(p);
-        continue;
+        vmbreak;
+      }
+      vmcase(IRange) {
+        int c = (byte)*s;
+        if (testrange(p, c) && s < e) { p++; s++; }
+        else goto fail;
+        vmbreak;
+      }
+      vmcase(ITestRange) {
+        int c = (byte)*s;
+        if (testrange(p, c) && s < e) p += 2;
+        else p += getoffset(p);
+        vmbreak;
       }
-      case IBehind: {
+      vmcase(ISpanRange) {
+#if defined(ROSIE_SIMD)
+        const char *l = (e - s > SPANSCALAR) ? s + SPANSCALAR : e;
+#else
+        const char *l = e;
+#endif
+        for (; s < l; s++) {
+          int c = (byte)*s;
+          if (!testrange(p, c)) break;
+        }
+        if (s == l && l < e)  /* span goes on? */
+          s = r_spanrange(getrange1(p), getrange2(p), s, e);
+        p++;
+        vmbreak;
+      }
+      vmcase(IString) {
+        int n = p->i.aux;
+        if (e - s >= n && memcmp(s, (p+1)->buff, n) == 0)
+          { p += instsize(n); s += n; }
+        else goto fail;
+        vmbreak;
+      }
+      vmcase(ITestString) {
+        int n = p->i.aux;
+        if (e - s >= n && memcmp(s, (p+2)->buff, n) == 0)
+          { p += 1 + instsize(n); s += n; }
+        else p += getoffset(p);
+        vmbreak;
+      }
+      vmcase(IDispatch) {
+        /* offsets follow the instruction; then a map from chars to them */
+        int n = p->i.aux;
+        int k = (s < e) ? (p + 1 + n)->buff[(byte)*s] : 0;
+        p += (p + 1 + k)->offset;
+        vmbreak;
+      }
+      vmcase(ITrie) {
+        int n = triematch((const int *)(p + 2), s, e);
+        if (n < 0) goto fail;
+        s += n;
+        p += getoffset(p);
+        vmbreak;
+      }
+      vmcase(IBehind) {
         int n = p->i.aux;
         if (n > s - o) goto fail;
         s -= n; p++;
-        continue;
+        vmbreak;
       }
-      case ISpan: {
-        for (; s < e; s++) {
+      vmcase(ISpan) {
+        /* read short spans here; longer ones in 'r_span' */
+#if defined(ROSIE_SIMD)
+        const char *l = (e - s > SPANSCALAR) ? s + SPANSCALAR : e;
+#else
+        const char *l = e;
+#endif
+        for (; s < l; s++) {
           int c = (byte)*s;
           if (!testchar((p+1)->buff, c)) break;
         }
-        p += CHARSETINSTSIZE;
-        continue;
+        if (s == l && l < e)  /* span goes on? */
+          s = r_span((p+1)->buff, s, e);
+        p += SPANINSTSIZE;
+        vmbreak;
       }
-      case IJmp: {
+      vmcase(IJmp) {
         p += getoffset(p);
-        continue;
+        vmbreak;
       }
-      case IChoice: {
+      vmcase(IChoice) {
         if (stack == stacklimit)
-          stack = doublestack(L, &stacklimit, ptop);
+          if ((stack = doublestack(ms, &stacklimit)) == NULL)
+            return NULL;
         stack->p = p + getoffset(p);
         stack->s = s;
         stack->caplevel = captop;
         stack++;
         p += 2;
-        continue;
+        vmbreak;
       }
-      case ICall: {
+      vmcase(ICall) {
         if (stack == stacklimit)
-          stack = doublestack(L, &stacklimit, ptop);
+          if ((stack = doublestack(ms, &stacklimit)) == NULL)
+            return NULL;
         stack->s = NULL;
         stack->p = p + 2;  /* save return address */
         stack++;
         p += getoffset(p);
-        continue;
+        vmbreak;
       }
-      case ICommit: {
-        assert(stack > getstackbase(L, ptop) && (stack - 1)->s != NULL);
+      vmcase(ICommit) {
+        assert(stack > ms->stack && (stack - 1)->s != NULL);
         stack--;
         p += getoffset(p);
-        continue;
+        vmbreak;
       }
-      case IPartialCommit: {
-        assert(stack > getstackbase(L, ptop) && (stack - 1)->s != NULL);
+      vmcase(IPartialCommit) {
+        assert(stack > ms->stack && (stack - 1)->s != NULL);
         (stack - 1)->s = s;
         (stack - 1)->caplevel = captop;
         p += getoffset(p);
-        continue;
+        vmbreak;
       }
-      case IBackCommit: {
-        assert(stack > getstackbase(L, ptop) && (stack - 1)->s != NULL);
+      vmcase(IBackCommit) {
+        assert(stack > ms->stack && (stack - 1)->s != NULL);
         s = (--stack)->s;
         captop = stack->caplevel;
+        if (out) out->n = outbase + captop;  /* rosie: drop its encoding */
         p += getoffset(p);
-        continue;
+        vmbreak;
       }
-      case IFailTwice:
-        assert(stack > getstackbase(L, ptop));
+      vmcase(IFailTwice)
+        assert(stack > ms->stack);
         stack--;
-	__attribute__ ((fallthrough));
-      case IFail:
+        vmfallthrough
+      vmcase(IFail)
       fail: { /* pattern failed: try to backtrack */
         do {  /* remove pending calls */
-          assert(stack > getstackbase(L, ptop));
+          assert(stack > ms->stack);
           s = (--stack)->s;
         } while (s == NULL);
         if (ndyncap > 0)  /* is there matchtime captures? */
           ndyncap -= removedyncap(L, capture, stack->caplevel, captop);
         captop = stack->caplevel;
+        if (out) out->n = outbase + captop;  /* rosie: drop its encoding */
         p = stack->p;
-        continue;
+        vmbreak;
       }
-      case ICloseRunTime: {
+      vmcase(ICloseRunTime) {
         CapState cs;
         int rem, res, n;
-        int fr = lua_gettop(L) + 1;  /* stack index of first result */
-        cs.s = o; cs.L = L; cs.ocap = capture; cs.ptop = ptop;
+        int fr;
+        if (L == NULL) {  /* run-time captures need Lua */
+          ms->err = MATCH_ERUNTIME;
+          return NULL;
+        }
+        fr = lua_gettop(L) + 1;  /* stack index of first result */
+        cs.s = o; cs.L = L; cs.ocap = capture; cs.ptop = ms->ptop;
+        cs.names = NULL;
         n = runtimecap(&cs, capture + captop, s, &rem);  /* call function */
         captop -= n;  /* remove nested captures */
         fr -= rem;  /* 'rem' items were popped from Lua stack */
@@ -312,60 +621,213 @@ const char *match (lua_State *L, const char *o, const char *s, const char *e,
         ndyncap += n - rem;  /* update number of dynamic captures */
         if (n > 0) {  /* any new capture? */
           if ((captop += n + 2) >= capsize) {
-            capture = doublecap(L, capture, captop, ptop);
-            capsize = 2 * captop;
+            if ((capture = doublecap(ms, captop)) == NULL)
+              return NULL;
+            capsize = ms->capsize;
           }
           /* add new captures to 'capture' list */
-          adddyncaptures(s, capture + captop - n - 2, n, fr); 
+          adddyncaptures(capoffset(o, s), capture + captop - n - 2, n, fr); 
         }
         p++;
-        continue;
+        vmbreak;
       }
-      case ICloseCapture: {
-        const char *s1 = s;
+      vmcase(ICloseCapture) {
+        uint32_t s1 = capoffset(o, s);
+        if (out) {  /* rosie: encode it now */
+          if ((captop = directcap(ms, p, s1, outbase)) < 0)
+            return NULL;
+          p++;
+          vmbreak;
+        }
         assert(captop > 0);
-        /* if possible, turn capture into a full capture */
-        if (capture[captop - 1].siz == 0 &&
-            s1 - capture[captop - 1].s < UCHAR_MAX) {
+        /* if possible, turn capture into a full capture (rosie: always
+           possible when there are no nested captures) */
+        if (capture[captop - 1].siz == 0) {
           capture[captop - 1].siz = s1 - capture[captop - 1].s + 1;
           p++;
-          continue;
+          vmbreak;
         }
         else {
           capture[captop].siz = 1;  /* mark entry as closed */
-          capture[captop].s = s;
+          capture[captop].s = s1;
           goto pushcapture;
         }
       }
-      case IOpenCapture:
+      vmcase(IOpenCapture)
+        if (out) goto directcapture;
         capture[captop].siz = 0;  /* mark entry as open */
-        capture[captop].s = s;
+        capture[captop].s = capoffset(o, s);
         goto pushcapture;
-      case IFullCapture:
+      vmcase(IFullCapture)
+        if (out) goto directcapture;
         capture[captop].siz = getoff(p) + 1;  /* save capture size */
-        capture[captop].s = s - getoff(p);
+        capture[captop].s = capoffset(o, s) - getoff(p);
         /* goto pushcapture; */
       pushcapture: {
         capture[captop].idx = p->i.key;
         capture[captop].kind = getkind(p);
         if (++captop >= capsize) {
-          capture = doublecap(L, capture, captop, ptop);
-          capsize = 2 * captop;
+          if ((capture = doublecap(ms, captop)) == NULL)
+            return NULL;
+          capsize = ms->capsize;
         }
         p++;
-        continue;
+        vmbreak;
       }
-      case IHalt: {				    /* rosie */
+      directcapture: {  /* rosie: encode it now */
+        if ((captop = directcap(ms, p, capoffset(o, s), outbase)) < 0)
+          return NULL;
+        p++;
+        vmbreak;
+      }
+      vmcase(IHalt) {				    /* rosie */
 	/* FUTURE: Maybe unwind the stack, if there is any info there that we could use? */
+        ms->abend = 1;
+        if (out) {
+          directhalt(ms, capoffset(o, s), outbase);
+          return s;
+        }
         capture[captop].kind = Cfinal;
-        capture[captop].s = s;
+        capture[captop].s = capoffset(o, s);
+        ms->ncap = captop + 1;
         return s;
       }
-      default: assert(0); return NULL;
+      vmdefault: assert(0); return NULL;
     }
   }
 }
 
+#if defined(LPEG_THREADED)
+#pragma GCC diagnostic pop
+#endif
+
+
+/*
+** rosie: set up 'ms' for matching, with the given initial stack and
+** capture list (owned by the caller), with Lua (see 'match') or
+** without it (L == NULL; then the stack can grow up to MAXBACK entries)
+*/
+void r_initmatch (MatchState *ms, lua_State *L, int ptop, Stack *stack,
+                  int stacksize, Capture *capture, int capsize) {
+  ms->L = L;
+  ms->ptop = ptop;
+  ms->stack = stack;
+  ms->stacksize = stacksize;
+  ms->maxstack = MAXBACK;
+  ms->capture = capture;
+  ms->capsize = capsize;
+  ms->owned = 0;
+  ms->arena = NULL;
+  ms->ncap = 0;
+  ms->out = NULL;
+  ms->names = NULL;
+  ms->abend = 0;
+  ms->err = MATCH_OK;
+}
+
+
+/*
+** rosie: release the arrays allocated by a match without Lua (after
+** its captures have been used)
+*/
+void r_endmatch (MatchState *ms) {
+  if (ms->owned & MATCH_OWNSTACK) free(ms->stack);
+  if (ms->owned & MATCH_OWNCAPTURE) free(ms->capture);
+  ms->owned = 0;
+}
+
+
+static const char *const matcherrors[] = {
+  "ok",
+  "backtrack stack overflow (current limit is %d)",
+  "too many captures",
+  "not enough memory for match",
+  "run-time capture in a match without Lua",
+  "cannot encode the captures",
+  "subject too long for a match"
+};
+
+/* rosie: message for error 'err' (may have a %d for the stack limit) */
+const char *r_matcherror (int err) {
+  if (err < 0 || err > MATCH_ESUBJECT) return "unknown match error";
+  return matcherrors[err];
+}
+
+
+/*
+** Match with Lua: the stack and the capture list live in the Lua
+** stack above 'ptop' (as set up by the callers), and errors are
+** raised as Lua errors
+*/
+const char *match (lua_State *L, const char *o, const char *s, const char *e,
+                   Instruction *op, Capture *capture, int ptop) {
+  Stack stackbase[INITBACK];
+  MatchState ms;
+  const char *r;
+  r_initmatch(&ms, L, ptop, stackbase, INITBACK, capture, INITCAPSIZE);
+  lua_pushlightuserdata(L, stackbase);
+  r = r_vmmatch(&ms, o, s, e, op);
+  if (ms.err != MATCH_OK)
+    luaL_error(L, r_matcherror(ms.err), ms.maxstack);
+  return r;
+}
+
+
+/*
+** rosie: match 'code' against s[start..len-1] with 'ms' (set up by
+** 'r_initmatch' with L == NULL) and append the encoding of its
+** captures to 'out' (made by 'r_newbuffer_nolua'), directly when
+** 'ms->out' is set too.  'names' holds the
+** capture names (by ktable index) of the pattern.  Returns 1 on a
+** match (setting '*leftover' and '*abend' as 'rmatch' does), 0 when
+** there is no match, and -err (see 'r_matcherror') when the match
+** cannot be done.  The caller still owns 'ms'.
+*/
+int r_vmencode (MatchState *ms, const Instruction *code, const rName *names,
+                const char *s, size_t len, size_t start, int etype,
+                rBuffer *out, int *leftover, int *abend) {
+  CapState cs;
+  const char *r;
+  int err;
+  if (start > len) start = len;
+  ms->names = names;
+  r = r_vmmatch(ms, s, s + start, s + len, code);
+  if (ms->err != MATCH_OK) return -ms->err;
+  if (r == NULL) return 0;
+  if (ms->out) {  /* already encoded */
+    *leftover = (int) (len - (r - s));
+    *abend = ms->abend;
+    return 1;
+  }
+  cs.ocap = cs.cap = ms->capture;
+  cs.L = NULL; cs.names = names;
+  cs.s = s; cs.valuecached = 0; cs.ptop = 0;
+  err = r_encode(&cs, etype, len, out);
+  if (err == ROSIE_MEMORY_ERROR) ms->err = MATCH_ENOMEM;
+  else if (err != ROSIE_OK && err != ROSIE_HALT) ms->err = MATCH_EENCODE;
+  if (ms->err != MATCH_OK) return -ms->err;
+  *leftover = (int) (len - (r - s));
+  *abend = (err == ROSIE_HALT);
+  return 1;
+}
+
+
+/*
+** rosie: 'r_vmencode' with a fresh match state (for a single match)
+*/
+int r_match_nolua (const Instruction *code, const rName *names,
+                   const char *s, size_t len, size_t start, int etype,
+                   rBuffer *out, int *leftover, int *abend) {
+  Stack stackbase[INITNOLUABACK];
+  Capture capture[INITCAPSIZE];
+  MatchState ms;
+  int res;
+  r_initmatch(&ms, NULL, 0, stackbase, INITNOLUABACK, capture, INITCAPSIZE);
+  res = r_vmencode(&ms, code, names, s, len, start, etype, out, leftover, abend);
+  r_endmatch(&ms);
+  return res;
+}
+
 /* }====================================================== */
 
 
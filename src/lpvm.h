@@ -17,6 +17,14 @@ typedef enum Opcode {
   ITestChar,  /* if char != aux, jump to 'offset' */
   ITestSet,  /* if char not in buff, jump to 'offset' */
   ISpan,  /* read a span of chars in buff */
+  IRange,  /* if char not in ranges 'aux' or 'key', fail */
+  ITestRange,  /* if char not in ranges 'aux' or 'key', jump to 'offset' */
+  ISpanRange,  /* read a span of chars in ranges 'aux' or 'key' */
+  IString,  /* if next 'aux' chars != buff, fail */
+  ITestString,  /* if next 'aux' chars != buff, jump to 'offset';
+                   else skip them */
+  IDispatch,  /* jump to one of 'aux' offsets, selected by next char */
+  ITrie,  /* match first string in trie that prefixes the subject */
   IBehind,  /* walk back 'aux' characters (fail if not possible) */
   IRet,  /* return from a rule */
   IEnd,  /* end of pattern */
@@ -43,16 +51,95 @@ typedef union Instruction {
   struct Inst {
     byte code;
     short aux;			/* Rosie (was byte) */
-    short key;
+    capidx_t key;		/* Rosie (was short) */
   } i;
   int offset;
   byte buff[1];
 } Instruction;
 
 
+/* entry in the backtrack stack */
+typedef struct Stack {
+  const char *s;  /* saved position (or NULL for calls) */
+  const Instruction *p;  /* next instruction */
+  int caplevel;
+} Stack;
+
+
+/*
+** rosie: a stack and a capture list that outlive a match (see rctx.c).
+** A match given an arena grows its arrays in it, with 'realloc', so
+** they never make Lua garbage, and the arena always holds the current
+** ones, even if the match ends with an error.
+*/
+typedef struct MatchArena {
+  Stack *stack;
+  int stacksize;
+  Capture *capture;
+  int capsize;
+  int caphigh;  /* high-water mark of the captures used (adaptive) */
+  int uses;  /* matches since the stack was last checked for shrinking */
+  int grew;  /* whether the stack grew since then */
+} MatchArena;
+
+
+/*
+** rosie: state of a match, for 'r_vmmatch'.  With L == NULL the vm
+** does not use Lua at all: its stack and capture list grow with
+** 'realloc' (up to 'maxstack' entries for the stack), and patterns
+** with run-time captures cannot be matched.  With Lua, they grow as
+** Lua userdata in the slots of the Lua stack above 'ptop', as in
+** 'match', and 'maxstack' is read from the registry.  With 'out', the
+** vm writes the byte encoding of the captures there as it matches
+** (only for patterns whose 'direct' is set; see 'setdirect'), instead
+** of making a capture list.
+*/
+typedef struct MatchState {
+  lua_State *L;  /* NULL to match without Lua */
+  int ptop;  /* index of last argument to 'match' (with Lua) */
+  Stack *stack;  /* backtrack stack */
+  int stacksize;
+  int maxstack;  /* maximum size of the stack */
+  Capture *capture;  /* capture list (final one, after a match) */
+  int capsize;
+  int owned;  /* (without Lua) arrays allocated by the vm (MATCH_OWN...) */
+  MatchArena *arena;  /* if not NULL, the arrays grow in the arena */
+  int ncap;  /* captures in the list after a match (with the last Cclose) */
+  rBuffer *out;  /* if not NULL, where the vm encodes the captures */
+  const rName *names;  /* capture names for 'out' (without Lua) */
+  int abend;  /* whether the match ended with a halt */
+  int err;  /* why the match was abandoned (MATCH_OK if it was not) */
+} MatchState;
+
+/* values for 'owned' */
+#define MATCH_OWNSTACK		1
+#define MATCH_OWNCAPTURE	2
+
+/* values for 'err' */
+#define MATCH_OK	0
+#define MATCH_ESTACK	1  /* backtrack stack overflow */
+#define MATCH_ECAPTURE	2  /* too many captures */
+#define MATCH_ENOMEM	3  /* no memory to grow the stack or captures */
+#define MATCH_ERUNTIME	4  /* run-time capture without Lua */
+#define MATCH_EENCODE	5  /* (r_match_nolua) bad encoding or capture list */
+#define MATCH_ESUBJECT	6  /* subject too long for capture positions */
+
+
 void printpatt (Instruction *p, int n);
 const char *match (lua_State *L, const char *o, const char *s, const char *e,
                    Instruction *op, Capture *capture, int ptop);
+void r_initmatch (MatchState *ms, lua_State *L, int ptop, Stack *stack,
+                  int stacksize, Capture *capture, int capsize);
+void r_endmatch (MatchState *ms);
+const char *r_vmmatch (MatchState *ms, const char *o, const char *s,
+                       const char *e, const Instruction *op);
+const char *r_matcherror (int err);
+int r_vmencode (MatchState *ms, const Instruction *code, const rName *names,
+                const char *s, size_t len, size_t start, int etype,
+                rBuffer *out, int *leftover, int *abend);
+int r_match_nolua (const Instruction *code, const rName *names,
+                   const char *s, size_t len, size_t start, int etype,
+                   rBuffer *out, int *leftover, int *abend);
 
 
 #endif
@@ -6,24 +6,35 @@
 /*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
 /*  AUTHOR: Jamie A. Jennings                                                */
 
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 
 #include "lua.h"
 #include "lauxlib.h"
 #include "rbuf.h"
+#include "rmmap.h"
 
 /* --------------------------------------------------------------------------------------------------- */
 
 /* dynamically allocate storage to replace initb when initb becomes too small */
-/* returns pointer to start of new buffer */
+/* returns pointer to start of new buffer, or (only without Lua, when
+ * L == NULL) NULL if there is no memory, leaving the buffer as it was */
 static void *resizebuf (lua_State *L, rBuffer *buf, size_t newsize) {
   void *ud;
-  lua_Alloc allocf = lua_getallocf(L, &ud);
-  void *temp = allocf(ud, buf->data, buf->capacity, newsize);
-  if (temp == NULL && newsize > 0) {  /* allocation error? */
-    allocf(ud, buf->data, buf->capacity, 0);  /* free buffer */
-    luaL_error(L, "not enough memory for buffer allocation");
+  lua_Alloc allocf;
+  void *temp;
+  if (!L) {			/* buffer of a match without Lua */
+    temp = realloc(buf->data, newsize);
+    if (temp == NULL && newsize > 0) return NULL;
+  }
+  else {
+    allocf = lua_getallocf(L, &ud);
+    temp = allocf(ud, buf->data, buf->capacity, newsize);
+    if (temp == NULL && newsize > 0) {  /* allocation error? */
+      allocf(ud, buf->data, buf->capacity, 0);  /* free buffer */
+      luaL_error(L, "not enough memory for buffer allocation");
+    }
   }
 
 #ifdef ROSIE_DEBUG
@@ -40,7 +51,9 @@ static void *resizebuf (lua_State *L, rBuffer *buf, size_t newsize) {
 /* true when buffer's data has overflowed initb and is now allocated elswhere */
 #define buffisdynamic(B)	((B)->data != (B)->initb)
 
-/* returns a pointer to a free area with at least 'sz' bytes */
+/* returns a pointer to a free area with at least 'sz' bytes.  Without
+ * Lua (L == NULL), there is no way to raise an error, so it returns
+ * NULL instead, and sets B->failed. */
 char *r_prepbuffsize (lua_State *L, rBuffer *B, size_t sz) {
   if (B->capacity - B->n < sz) {
     size_t newsize = B->capacity * 2; /* double buffer size */ 
@@ -51,17 +64,28 @@ char *r_prepbuffsize (lua_State *L, rBuffer *B, size_t sz) {
 #endif
 
     if (newsize - B->n < sz) newsize = B->n + sz; /* not big enough? */
-    if (newsize < B->n || newsize - B->n < sz) luaL_error(L, "buffer too large");
+    if (newsize < B->n || newsize - B->n < sz) {
+      if (!L) goto nolua_error;
+      luaL_error(L, "buffer too large");
+    }
     /* else create larger buffer */
-    if (buffisdynamic(B)) resizebuf(L, B, newsize);
+    if (buffisdynamic(B)) {
+      if (!resizebuf(L, B, newsize)) goto nolua_error;
+    }
     else {
       /* all data currently still in initb, i.e. no malloc'd storage */
       B->data = NULL; 		/* force an allocation */
-      resizebuf(L, B, newsize);
+      if (!resizebuf(L, B, newsize)) {
+	B->data = B->initb;
+	goto nolua_error;
+      }
       memcpy(B->data, B->initb, B->n * sizeof(char));  /* copy original content */
     }
   }
   return &B->data[B->n];
+ nolua_error:
+  B->failed = 1;
+  return NULL;
 }
 
 /* --------------------------------------------------------------------------------------------------- */
@@ -90,32 +114,57 @@ int r_lua_buffreset (lua_State *L, int pos) {
   return 0;
 }
 
-static int r_buffsub (lua_State *L) {
-  rBuffer *buf;
-  int j = 1;
-  int k = luaL_checkinteger(L, -1);
+/* Data of a ROSIE_BUFFER or of the window of a ROSIE_MMAP at idx, or
+ * NULL if there is none there.
+ */
+const char *r_bufferdata (lua_State *L, int idx, size_t *len) {
+  rBuffer *buf = (rBuffer *)luaL_testudata(L, idx, ROSIE_BUFFER);
+  rMmap *m;
+  if (buf) {
+    *len = buf->n;
+    return buf->data;
+  }
+  m = (rMmap *)luaL_testudata(L, idx, ROSIE_MMAP);
+  if (m) {
+    *len = m->n;
+    return m->data ? m->data : "";
+  }
+  return NULL;
+}
+
+static const char *checkbufferdata (lua_State *L, int idx, size_t *len) {
+  const char *data = r_bufferdata(L, idx, len);
+  if (!data) luaL_argerror(L, idx, "not rbuffer or mmap");
+  return data;
+}
+
+int r_lua_buffsub (lua_State *L) {
+  const char *data;
+  size_t n;
+  lua_Integer j = 1;
+  lua_Integer k = luaL_checkinteger(L, -1);
   int two_indices = lua_isinteger(L, -2);
   if (two_indices) {
     j = lua_tointeger(L, -2);
-    buf = (rBuffer *)luaL_checkudata(L, -3, ROSIE_BUFFER);
+    data = checkbufferdata(L, -3, &n);
     lua_pop(L, 3);
   }
   else {
     j = k;
-    buf = (rBuffer *)luaL_checkudata(L, -2, ROSIE_BUFFER);
-    k = buf->n;
+    data = checkbufferdata(L, -2, &n);
+    k = n;
     lua_pop(L, 2);
   }
   /* These are the rules of string.sub according to the Lua 5.3 reference */
-  if (j < 0) j = buf->n + j + 1;
+  if (j < 0) j = n + j + 1;
   if (j < 1) j = 1;
-  if (k < 0) k = buf->n + k + 1;
-  if (k > (int) buf->n) k = buf->n;
-  if ((j > k) || (j > (int) buf->n)) {
+  if (k < 0) k = n + k + 1;
+  if (k > (lua_Integer) n) k = n;
+  if ((j > k) || (j > (lua_Integer) n)) {
     lua_pushliteral(L, "");
   }
   else {
-    lua_pushlstring(L, (buf->data + j - 1), (size_t) k - j + 1);
+    lua_pushlstring(L, (data + j - 1), (size_t) (k - j + 1));
   }
   return 1;
 }
@@ -130,7 +179,7 @@ static struct luaL_Reg rbuf_meta_reg[] = {
 };
 
 static struct luaL_Reg rbuf_index_reg[] = {
-    {"sub", r_buffsub},
+    {"sub", r_lua_buffsub},
     {NULL, NULL}
 };
 
@@ -151,11 +200,32 @@ rBuffer *r_newbuffer (lua_State *L) {
   buf->data = buf->initb;        /* intially, data storage is statically allocated in initb  */
   buf->n = 0;			 /* contents length is 0 */
   buf->capacity = R_BUFFERSIZE;	 /* size of initb */
+  buf->failed = 0;
   if (luaL_newmetatable(L, ROSIE_BUFFER)) rbuf_type_init(L);
   lua_setmetatable(L, -2);	 /* pops the metatable, leaving the userdata at the top */
   return buf;
 }
 
+/* A buffer for use without Lua: pass NULL for L to all the functions
+ * that add to it, and free it with r_freebuffer.  Once one of them
+ * fails for lack of memory, 'failed' stays set, so that the user of
+ * the buffer can check it once after adding many things to it. */
+rBuffer *r_newbuffer_nolua (void) {
+  rBuffer *buf = (rBuffer *)malloc(sizeof(rBuffer));
+  if (!buf) return NULL;
+  buf->initb = buf->initialbuff;
+  buf->data = buf->initb;
+  buf->n = 0;
+  buf->capacity = R_BUFFERSIZE;
+  buf->failed = 0;
+  return buf;
+}
+
+void r_freebuffer (rBuffer *buf) {
+  if (buffisdynamic(buf)) free(buf->data);
+  free(buf);
+}
+
 rBuffer *r_newbuffer_wrap (lua_State *L, char *data, size_t len) {
   rBufferLite *buflite = (rBufferLite *)lua_newuserdata(L, sizeof(rBufferLite));
   rBuffer *buf = (rBuffer *)buflite;
@@ -163,27 +233,42 @@ rBuffer *r_newbuffer_wrap (lua_State *L, char *data, size_t len) {
   buf->data = data;
   buf->n = len;
   buf->capacity = len;
+  buf->failed = 0;
   if (luaL_newmetatable(L, ROSIE_BUFFER)) rbuf_type_init(L);
   lua_setmetatable(L, -2);	/* pops the metatable, leaving the userdata at the top */
   return buf;
 }
 
-void r_addlstring (lua_State *L, rBuffer *buf, const char *s, size_t l) {
+/* r_addlstring, r_addint and r_addshort return 0, or (only without
+ * Lua) 1 when the buffer could not grow */
+int r_addlstring (lua_State *L, rBuffer *buf, const char *s, size_t l) {
   if (l > 0) {		     /* noop when 's' is an empty string */
     char *b = r_prepbuffsize(L, buf, l * sizeof(char));
+    if (!b) return 1;
     memcpy(b, s, l * sizeof(char));
     addsize(buf, l);
   }
+  return 0;
 }
 
-void r_addint (lua_State *L, rBuffer *buf, int i) {
+int r_addint (lua_State *L, rBuffer *buf, int i) {
   unsigned char str[4];
   unsigned int iun = (int) i;
   str[3] = (iun >> 24) & 0xFF;
   str[2] = (iun >> 16) & 0xFF;
   str[1] = (iun >> 8) & 0xFF;
   str[0] = iun & 0xFF;
-  r_addlstring(L, buf, (const char *)str, 4);
+  return r_addlstring(L, buf, (const char *)str, 4);
+}
+
+/* overwrite the int at position pos, e.g. a length added before its data */
+void r_setint (rBuffer *buf, size_t pos, int i) {
+  unsigned char *str = (unsigned char *) &buf->data[pos];
+  unsigned int iun = (int) i;
+  str[3] = (iun >> 24) & 0xFF;
+  str[2] = (iun >> 16) & 0xFF;
+  str[1] = (iun >> 8) & 0xFF;
+  str[0] = iun & 0xFF;
 }
 
 int r_readint(const char **s) {
@@ -198,12 +283,12 @@ int r_peekint(const char **s) {
   return *sun | (*(sun+1)<<8) | (*(sun+2)<<16) | *(sun+3)<<24;
 }
 
-void r_addshort (lua_State *L, rBuffer *buf, short i) {
+int r_addshort (lua_State *L, rBuffer *buf, short i) {
   char str[2];
   short iun = (short) i;
   str[1] = (iun >> 8) & 0xFF;
   str[0] = iun & 0xFF;
-  r_addlstring(L, buf, str, 2);
+  return r_addlstring(L, buf, str, 2);
 }
 
 int r_readshort(const char **s) {
@@ -26,6 +26,7 @@ typedef struct rBuffer {
   size_t capacity;
   size_t n;			/* number of bytes in use */
   char *initb;
+  int failed;			/* (without Lua) could not grow */
   char initialbuff[R_BUFFERSIZE];
 } rBuffer;
 
@@ -34,6 +35,7 @@ typedef struct rBufferLite {
   size_t capacity;
   size_t n;			/* number of bytes in use */
   char *initb;	                /* no initial buffer */
+  int failed;
 } rBufferLite;
 
 int r_lua_newbuffer (lua_State *L);
@@ -41,17 +43,22 @@ int r_lua_buffreset (lua_State *L, int pos);
 int r_lua_getdata (lua_State *L);
 int r_lua_add (lua_State *L);
 int r_lua_writedata(lua_State *L);
+int r_lua_buffsub (lua_State *L);
+const char *r_bufferdata (lua_State *L, int idx, size_t *len);
 
 rBuffer *r_newbuffer (lua_State *L);
 rBuffer *r_newbuffer_wrap (lua_State *L, char *data, size_t len);
+rBuffer *r_newbuffer_nolua (void);
+void r_freebuffer (rBuffer *buf);
 
 /* the functions below DO NOT use the stack */
 char *r_prepbuffsize (lua_State *L, rBuffer *buf, size_t sz);
-void r_addlstring (lua_State *L, rBuffer *buf, const char *s, size_t l);
-void r_addint (lua_State *L, rBuffer *buf, int i);
+int r_addlstring (lua_State *L, rBuffer *buf, const char *s, size_t l);
+int r_addint (lua_State *L, rBuffer *buf, int i);
+void r_setint (rBuffer *buf, size_t pos, int i);
 int r_readint(const char **s);
 int r_peekint(const char **s);
-void r_addshort (lua_State *L, rBuffer *buf, short i);
+int r_addshort (lua_State *L, rBuffer *buf, short i);
 int r_readshort(const char **s);
      
 #define r_addstring(L, buf, s) (r_addlstring)((L), (buf), (s), strlen(s))
@@ -9,13 +9,16 @@
 #define acceptable_capture(kind) (((kind) == Crosiecap) || ((kind) == Crosieconst))
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "lpcap.h"
 #include "rbuf.h"
 #include "rcap.h"
+#include "rsimd.h"
 
+/* The escapes of the chars that r_jsonscan stops at (NUL is not one) */
 static const char *char2escape[256] = {
-    "\\u0000", "\\u0001", "\\u0002", "\\u0003",
+    NULL, "\\u0001", "\\u0002", "\\u0003",
     "\\u0004", "\\u0005", "\\u0006", "\\u0007",
     "\\b", "\\t", "\\n", "\\u000b",
     "\\f", "\\r", "\\u000e", "\\u000f",
@@ -54,32 +57,31 @@ static const char *char2escape[256] = {
 };
 
 
-/* Worst case is len * 6 (all unicode escapes). By reserving all of
-   this space in advance, we gain 15-20% performance improvement */
+/* The chars that need no escaping are found in runs (see r_jsonscan),
+   which are copied whole.  Space is reserved for each run and the
+   escape after it, so that a long capture does not grow the buffer by
+   6 * len, as reserving for the worst case would. */
+
+#define escapelen(escstr) (((escstr)[1] == 'u') ? 6 : 2)
 
 static void r_addlstring_json(lua_State *L, rBuffer *buf, const char *str, size_t len)
 {
     static const char dquote = '\"';
+    const char *e = str + len;
+    const char *run;
     const char *escstr;
-    size_t esclen;
-    char c;
-    size_t i;
-    r_prepbuffsize(L, buf, 2 + 6*len);
+    if (!r_prepbuffsize(L, buf, 2 + len)) return;  /* (no memory, without Lua) */
     r_addchar_UNSAFE(L, buf, dquote);
-    for (i = 0; i < len; i++) { 
-      c = str[i];
-      /* this explicit test on c gives about a 5% speedup on typical data */
-      if ((c=='\"') || (c=='/') || (c=='\\') || (c>0 && c<32) || (c==127)) {
-	escstr = char2escape[(unsigned char)c]; 
-	if (escstr) {
-	  esclen = strlen(escstr);
-	  r_addlstring_UNSAFE(L, buf, escstr, esclen); /* escstr is null terminated */ 
-	}
-	/* TODO: what to do in case of error? it is a coding error, a "should not get here" situation */
-	else fprintf(stderr, "*** INTERNAL ERROR in addlstring_json: unmapped esc for char code %d", (int) c);
-      }
-      else r_addchar_UNSAFE(L, buf, c);
-    } 
+    while (str < e) {
+      run = r_jsonscan(str, e);
+      /* run, escape, closing dquote */
+      if (!r_prepbuffsize(L, buf, (run - str) + 6 + 1)) return;
+      r_addlstring_UNSAFE(L, buf, str, run - str);
+      if (run == e) break;
+      escstr = char2escape[(unsigned char)*run];
+      r_addlstring_UNSAFE(L, buf, escstr, escapelen(escstr));
+      str = run + 1;
+    }
     r_addchar(L, buf, dquote);
 }
 
@@ -87,16 +89,106 @@ static void r_addlstring_json(lua_State *L, rBuffer *buf, const char *str, size_
 
 #define UNUSED(x) (void)(x)
 
+/* Copy str (of length len) escaped for a JSON string to dest (when it
+ * is not NULL), as r_addlstring_json would add it, without the quotes.
+ * Returns the length of the escaped string.
+ */
+static size_t jsonescape(char *dest, const char *str, size_t len) {
+  const char *e = str + len;
+  const char *run, *escstr;
+  size_t n = 0;
+  while (str < e) {
+    run = r_jsonscan(str, e);
+    if (dest) memcpy(dest + n, str, run - str);
+    n += run - str;
+    if (run == e) break;
+    escstr = char2escape[(unsigned char)*run];
+    if (dest) memcpy(dest + n, escstr, escapelen(escstr));
+    n += escapelen(escstr);
+    str = run + 1;
+  }
+  return n;
+}
+
+/* The names of the ktable at index ktable (which may be nil), for the
+ * encoders, with the JSON and byte encodings of each one made in
+ * advance.  Returns names[0..*n] (by ktable index) in one block of
+ * memory (to be freed with free), or NULL when out of memory.
+ * Entries of the ktable that are not strings are never capture names;
+ * they get a NULL name, which encodes as an empty one.
+ */
+rName *r_newnames(lua_State *L, int ktable, int *n) {
+  rName *names;
+  size_t total = 0, len;
+  const char *name;
+  char *strings;
+  int i;
+  *n = lua_istable(L, ktable) ? (int) lua_rawlen(L, ktable) : 0;
+  for (i = 1; i <= *n; i++) {
+    lua_rawgeti(L, ktable, i);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      name = lua_tolstring(L, -1, &len);
+      total += (len + 1) + (jsonescape(NULL, name, len) + 1) + (2 + len);
+    }
+    lua_pop(L, 1);
+  }
+  names = (rName *)malloc((*n + 1) * sizeof(rName) + total);
+  if (!names) return NULL;
+  strings = (char *)(names + *n + 1);
+  for (i = 0; i <= *n; i++) {
+    rName *nm = &names[i];
+    nm->name = NULL; nm->len = 0;
+    nm->json = ""; nm->jsonlen = 0;
+    nm->byte = "\0\0"; nm->bytelen = 2;
+    if (i == 0) continue;
+    lua_rawgeti(L, ktable, i);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+      name = lua_tolstring(L, -1, &len);
+      nm->name = strings;
+      nm->len = len;
+      memcpy(strings, name, len);
+      strings[len] = '\0';
+      strings += len + 1;
+      nm->json = strings;
+      nm->jsonlen = jsonescape(strings, name, len);
+      strings += nm->jsonlen;
+      *strings++ = '\0';
+      nm->byte = strings;	/* as r_addshort and r_addlstring would add it */
+      nm->bytelen = 2 + len;
+      strings[0] = (char) (len & 0xFF);
+      strings[1] = (char) ((len >> 8) & 0xFF);
+      memcpy(strings + 2, name, len);
+      strings += 2 + len;
+    }
+    lua_pop(L, 1);
+  }
+  return names;
+}
+
+/* Name (or constant capture value) at index idx of the ktable, from
+ * cs->names when it is set (see r_newnames).
+ */
+const char *r_capname(CapState *cs, int idx, size_t *len) {
+  const char *name;
+  if (cs->names) {
+    *len = cs->names[idx].len;
+    return cs->names[idx].name;
+  }
+  lua_rawgeti(cs->L, ktableidx(cs->ptop), idx);
+  name = lua_tolstring(cs->L, -1, len);
+  lua_pop(cs->L, 1);		/* the string stays in the ktable */
+  return name;
+}
+
 static void print_capture(CapState *cs) {
   Capture *c = cs->cap;
+  size_t len;
   printf("  isfullcap? %s\n", isfullcap(c) ? "true" : "false");
   printf("  kind = %u\n", c->kind);
-  printf("  pos (1-based) = %lu\n", c->s ? (c->s - cs->s + 1) : 0);
+  printf("  pos (1-based) = %lu\n", (unsigned long) c->s + 1);
   printf("  size (actual) = %u\n", c->siz ? c->siz-1 : 0);
   printf("  idx = %u\n", c->idx);
-  lua_rawgeti(cs->L, ktableidx(cs->ptop), c->idx);
-  printf("  ktable[idx] = %s\n", lua_tostring(cs->L, -1));
-  lua_pop(cs->L, 1);
+  printf("  ktable[idx] = %s\n", r_capname(cs, c->idx, &len));
 }
 
 static void print_capture_text(const char *s, const char *e) {
@@ -108,16 +200,14 @@ static void print_capture_text(const char *s, const char *e) {
 static void print_constant_capture(CapState *cs) {
   const char *name;
   size_t len;
-  lua_rawgeti(cs->L, ktableidx(cs->ptop), cs->cap->idx+1);
-  name = lua_tolstring(cs->L, -1, &len);
+  name = r_capname(cs, cs->cap->idx+1, &len);
   printf("  constant match: %s\n", name);
-  lua_pop(cs->L, 1);
 }
 
 int debug_Fullcapture(CapState *cs, rBuffer *buf, int count) {
   Capture *c = cs->cap;
-  const char *start = c->s;
-  const char *last = c->s + c->siz - 1;
+  const char *start = capstart(cs, c);
+  const char *last = start + c->siz - 1;
   UNUSED(buf); UNUSED(count);
   printf("Full capture:\n");
   print_capture(cs);
@@ -155,10 +245,13 @@ static void json_encode_pos(lua_State *L, size_t pos, rBuffer *buf) {
 static void json_encode_name(CapState *cs, rBuffer *buf, int offset) {
   const char *name;
   size_t len;
-  lua_rawgeti(cs->L, ktableidx(cs->ptop), cs->cap->idx + offset);
-  name = lua_tolstring(cs->L, -1, &len);
+  if (cs->names) {
+    const rName *nm = &cs->names[cs->cap->idx + offset];
+    r_addlstring(cs->L, buf, nm->json, nm->jsonlen);
+    return;
+  }
+  name = r_capname(cs, cs->cap->idx + offset, &len);
   r_addlstring(cs->L, buf, name, len);
-  lua_pop(cs->L, 1);
 }
 
 int json_Fullcapture(CapState *cs, rBuffer *buf, int count) {
@@ -166,7 +259,7 @@ int json_Fullcapture(CapState *cs, rBuffer *buf, int count) {
   size_t s, e;
   if ( !(isfullcap(c) && acceptable_capture(c->kind)) ) return ROSIE_FULLCAP_ERROR;
   if (count) r_addstring(cs->L, buf, ",");
-  s = c->s - cs->s + 1;		/* 1-based start position */
+  s = (size_t) c->s + 1;		/* 1-based start position */
   r_addstring(cs->L, buf, TYPE_LABEL);
   json_encode_name(cs, buf, 0);
   r_addstring(cs->L, buf, "\"");
@@ -178,7 +271,7 @@ int json_Fullcapture(CapState *cs, rBuffer *buf, int count) {
   r_addstring(cs->L, buf, DATA_LABEL);
 
   switch (c->kind) {
-  case Crosiecap: { r_addlstring_json(cs->L, buf, c->s, c->siz -1); break; }
+  case Crosiecap: { r_addlstring_json(cs->L, buf, capstart(cs, c), c->siz -1); break; }
   case Crosieconst: {
        r_addstring(cs->L, buf, "\"");
        json_encode_name(cs, buf, 1);
@@ -192,15 +285,14 @@ int json_Fullcapture(CapState *cs, rBuffer *buf, int count) {
 
 int json_Close(CapState *cs, rBuffer *buf, int count, const char *start) {
   size_t e;
-  UNUSED(count);
   if (!isclosecap(cs->cap)) return ROSIE_CLOSE_ERROR;
-  e = cs->cap->s - cs->s + 1;	/* 1-based end position */
-  if (!isopencap(cs->cap-1)) r_addstring(cs->L, buf, "]");
+  e = (size_t) cs->cap->s + 1;	/* 1-based end position */
+  if (count) r_addstring(cs->L, buf, "]");	/* count is the number of subs */
   r_addstring(cs->L, buf,  END_LABEL);
   json_encode_pos(cs->L, e, buf);
   if (start) {
     r_addstring(cs->L, buf, DATA_LABEL);
-    r_addlstring_json(cs->L, buf, start, cs->cap->s - start);
+    r_addlstring_json(cs->L, buf, start, capstart(cs, cs->cap) - start);
   }
   r_addstring(cs->L, buf, "}");
   return ROSIE_OK;
@@ -214,11 +306,11 @@ int json_Open(CapState *cs, rBuffer *buf, int count) {
   r_addstring(cs->L, buf, TYPE_LABEL);
   json_encode_name(cs, buf, 0);
   r_addstring(cs->L, buf, "\"");
-  s = cs->cap->s - cs->s + 1;	/* 1-based start position */
+  s = (size_t) cs->cap->s + 1;	/* 1-based start position */
   r_addstring(cs->L, buf, START_LABEL);
   json_encode_pos(cs->L, s, buf);
-  /* introduce subs array if needed */
-  if (!isclosecap(cs->cap+1)) r_addstring(cs->L, buf, COMPONENT_LABEL);
+  /* introduce subs array if needed (not when a halt, or a filter, left none) */
+  if (!isclosecap(cs->cap+1) && !isfinalcap(cs->cap+1)) r_addstring(cs->L, buf, COMPONENT_LABEL);
   return ROSIE_OK;
 }
 
@@ -250,10 +342,13 @@ static void encode_string(lua_State *L, const char *str, size_t len,
 static void encode_name(CapState *cs, rBuffer *buf, int offset) {
   const char *name;
   size_t len;
-  lua_rawgeti(cs->L, ktableidx(cs->ptop), cs->cap->idx + offset); 
-  name = lua_tolstring(cs->L, -1, &len); 
+  if (cs->names && !offset) {	/* (a constant capture value has a negative length) */
+    const rName *nm = &cs->names[cs->cap->idx];
+    r_addlstring(cs->L, buf, nm->byte, nm->bytelen);
+    return;
+  }
+  name = r_capname(cs, cs->cap->idx + offset, &len);
   encode_string(cs->L, name, len, 1, offset, buf); /* shortflag and constcap are set */
-  lua_pop(cs->L, 1);				   /* pop name */
 }
 
 int byte_Fullcapture(CapState *cs, rBuffer *buf, int count) {
@@ -261,7 +356,7 @@ int byte_Fullcapture(CapState *cs, rBuffer *buf, int count) {
   Capture *c = cs->cap;
   UNUSED(count);
   if (! (isfullcap(c) || acceptable_capture(c->kind)) ) return ROSIE_FULLCAP_ERROR;
-  s = c->s - cs->s + 1;		/* 1-based start position */
+  s = (size_t) c->s + 1;		/* 1-based start position */
   e = s + c->siz - 1;
   encode_pos(cs->L, s, 1, buf);	/* negative flag is set */
   /* special case for constant captures: put the capture text into the buffer
@@ -277,7 +372,7 @@ int byte_Close(CapState *cs, rBuffer *buf, int count, const char *start) {
   size_t e;
   UNUSED(count); UNUSED(start);
   if (!isclosecap(cs->cap)) return ROSIE_CLOSE_ERROR;
-  e = cs->cap->s - cs->s + 1;	/* 1-based end position */
+  e = (size_t) cs->cap->s + 1;	/* 1-based end position */
   encode_pos(cs->L, e, 0, buf);
   return ROSIE_OK;
 }
@@ -289,16 +384,342 @@ int byte_Open(CapState *cs, rBuffer *buf, int count) {
        fprintf(stderr, "*** isfullcap-> %d, !acceptable_capture()->%d\n",
 	       isfullcap(cs->cap),
 	       !acceptable_capture(cs->cap->kind));
-       fprintf(stderr, "*** *s-> %p, idx-> %d, kind-> %d, siz-> %d\n",
-	       (const void *)cs->cap->s,
+       fprintf(stderr, "*** s-> %u, idx-> %d, kind-> %d, siz-> %u\n",
+	       cs->cap->s,
 	       cs->cap->idx,
 	       cs->cap->kind,
 	       cs->cap->siz);
        return ROSIE_OPEN_ERROR;
   }
-  s = cs->cap->s - cs->s + 1;	/* 1-based start position */
+  s = (size_t) cs->cap->s + 1;	/* 1-based start position */
   encode_pos(cs->L, s, 1, buf);
   encode_name(cs, buf, 0);
   return ROSIE_OK;
 }
 
+
+/* ****************************************************************************************
+ * MessagePack and CBOR: each match is a map with the keys of the JSON
+ * encoding, in the same order: type, s, subs (only when there are
+ * subs), e, and data.  The type is a string; data (the matched text,
+ * or the value of a constant capture) is binary (bin in MessagePack,
+ * a byte string in CBOR), because the input need not be UTF-8.
+ *
+ * The length of the subs array is not known at Open, so its header is
+ * written with a 32-bit length, and the length is set at Close.  Until
+ * then, the length field holds the distance back to the header of the
+ * enclosing unfinished subs array (0 for none), and cs->mark is the
+ * offset of the innermost one.
+ * ****************************************************************************************
+ */
+
+#define BIN_MSGPACK 0
+#define BIN_CBOR 1
+
+static void put_be(unsigned char *p, size_t v, int n) {
+  while (n-- > 0) { p[n] = (unsigned char) (v & 0xFF); v >>= 8; }
+}
+
+/* header with a length (or an unsigned int) v, in as few bytes as possible */
+static void bin_head(lua_State *L, rBuffer *buf, int fmt, int major, size_t v) {
+  unsigned char h[5];
+  int n;
+  if (fmt == BIN_CBOR) {
+    if (v < 24) { h[0] = (unsigned char) ((major << 5) | v); n = 1; }
+    else if (v <= 0xFF) { h[0] = (unsigned char) ((major << 5) | 24); n = 2; }
+    else if (v <= 0xFFFF) { h[0] = (unsigned char) ((major << 5) | 25); n = 3; }
+    else { h[0] = (unsigned char) ((major << 5) | 26); n = 5; }
+  }
+  else {			/* major is the MessagePack type, as below */
+    static const unsigned char fix[] = {0x00, 0xa0, 0x80, 0x00};	 /* uint, str, map, bin */
+    static const unsigned char tag[][3] = {{0xcc, 0xcd, 0xce}, {0xd9, 0xda, 0xdb},
+					   {0xde, 0xde, 0xdf}, {0xc4, 0xc5, 0xc6}};
+    int fixmax = (major == 0) ? 128 : (major == 1) ? 32 : (major == 2) ? 16 : 0;
+    if (v < (size_t) fixmax) { h[0] = (unsigned char) (fix[major] | v); n = 1; }
+    else if (v <= 0xFF && major != 2) { h[0] = tag[major][0]; n = 2; }
+    else if (v <= 0xFFFF) { h[0] = tag[major][1]; n = 3; }
+    else { h[0] = tag[major][2]; n = 5; }
+  }
+  put_be(h + 1, v, n - 1);
+  r_addlstring(L, buf, (const char *) h, n);
+}
+
+/* MessagePack types for bin_head, and the CBOR major types for them */
+#define BIN_UINT(fmt) 0
+#define BIN_STR(fmt) ((fmt) == BIN_CBOR ? 3 : 1)
+#define BIN_MAP(fmt) ((fmt) == BIN_CBOR ? 5 : 2)
+#define BIN_BYTES(fmt) ((fmt) == BIN_CBOR ? 2 : 3)
+
+static void bin_string(lua_State *L, rBuffer *buf, int fmt, int major, const char *s, size_t len) {
+  bin_head(L, buf, fmt, major, len);
+  r_addlstring(L, buf, s, len);
+}
+
+#define bin_key(L, buf, fmt, key) \
+  bin_string((L), (buf), (fmt), BIN_STR(fmt), (key), sizeof(key) - 1)
+
+static void bin_name(CapState *cs, rBuffer *buf, int fmt, int major, int offset) {
+  size_t len;
+  const char *name = r_capname(cs, cs->cap->idx + offset, &len);
+  bin_string(cs->L, buf, fmt, major, name, len);
+}
+
+/* Header of a subs array, with its length to be set by bin_endsubs */
+static int bin_startsubs(CapState *cs, rBuffer *buf, int fmt) {
+  unsigned char h[5];
+  size_t pos, back;
+  h[0] = (fmt == BIN_CBOR) ? 0x9a : 0xdd;  /* array with a 32-bit length */
+  r_addlstring(cs->L, buf, (const char *) h, 1);
+  pos = buf->n;
+  back = cs->mark ? pos - cs->mark : 0;
+  if (back > 0xFFFFFFFFu) return ROSIE_OPEN_ERROR;
+  put_be(h, back, 4);
+  r_addlstring(cs->L, buf, (const char *) h, 4);
+  cs->mark = pos;
+  return ROSIE_OK;
+}
+
+static int bin_endsubs(CapState *cs, rBuffer *buf, int nsubs) {
+  unsigned char *p;
+  size_t back;
+  if (!cs->mark) return ROSIE_CLOSE_ERROR;
+  p = (unsigned char *) buf->data + cs->mark;
+  back = ((size_t) p[0] << 24) | ((size_t) p[1] << 16) | ((size_t) p[2] << 8) | p[3];
+  put_be(p, (size_t) nsubs, 4);
+  cs->mark = back ? cs->mark - back : 0;
+  return ROSIE_OK;
+}
+
+static int bin_Open(CapState *cs, rBuffer *buf, int fmt) {
+  Capture *c = cs->cap;
+  int hassubs = !isclosecap(c + 1) && !isfinalcap(c + 1);
+  if (isfullcap(c) || !acceptable_capture(c->kind)) return ROSIE_OPEN_ERROR;
+  bin_head(cs->L, buf, fmt, BIN_MAP(fmt), hassubs ? 5 : 4);
+  bin_key(cs->L, buf, fmt, "type");
+  bin_name(cs, buf, fmt, BIN_STR(fmt), 0);
+  bin_key(cs->L, buf, fmt, "s");
+  bin_head(cs->L, buf, fmt, BIN_UINT(fmt), (size_t) c->s + 1);
+  if (hassubs) {
+    bin_key(cs->L, buf, fmt, "subs");
+    return bin_startsubs(cs, buf, fmt);
+  }
+  return ROSIE_OK;
+}
+
+static int bin_Close(CapState *cs, rBuffer *buf, int nsubs, const char *start, int fmt) {
+  const char *last;
+  if (!isclosecap(cs->cap)) return ROSIE_CLOSE_ERROR;
+  if (nsubs > 0 && bin_endsubs(cs, buf, nsubs)) return ROSIE_CLOSE_ERROR;
+  last = capstart(cs, cs->cap);
+  bin_key(cs->L, buf, fmt, "e");
+  bin_head(cs->L, buf, fmt, BIN_UINT(fmt), (size_t) cs->cap->s + 1);
+  bin_key(cs->L, buf, fmt, "data");
+  bin_string(cs->L, buf, fmt, BIN_BYTES(fmt), start, last - start);
+  return ROSIE_OK;
+}
+
+static int bin_Fullcapture(CapState *cs, rBuffer *buf, int fmt) {
+  Capture *c = cs->cap;
+  if (!(isfullcap(c) && acceptable_capture(c->kind))) return ROSIE_FULLCAP_ERROR;
+  bin_head(cs->L, buf, fmt, BIN_MAP(fmt), 4);
+  bin_key(cs->L, buf, fmt, "type");
+  bin_name(cs, buf, fmt, BIN_STR(fmt), 0);
+  bin_key(cs->L, buf, fmt, "s");
+  bin_head(cs->L, buf, fmt, BIN_UINT(fmt), (size_t) c->s + 1);
+  bin_key(cs->L, buf, fmt, "e");
+  bin_head(cs->L, buf, fmt, BIN_UINT(fmt), (size_t) c->s + c->siz);
+  bin_key(cs->L, buf, fmt, "data");
+  if (c->kind == Crosieconst) bin_name(cs, buf, fmt, BIN_BYTES(fmt), 1);
+  else bin_string(cs->L, buf, fmt, BIN_BYTES(fmt), capstart(cs, c), c->siz - 1);
+  return ROSIE_OK;
+}
+
+int msgpack_Fullcapture(CapState *cs, rBuffer *buf, int count) {
+  UNUSED(count);
+  return bin_Fullcapture(cs, buf, BIN_MSGPACK);
+}
+
+int msgpack_Close(CapState *cs, rBuffer *buf, int count, const char *start) {
+  return bin_Close(cs, buf, count, start, BIN_MSGPACK);
+}
+
+int msgpack_Open(CapState *cs, rBuffer *buf, int count) {
+  UNUSED(count);
+  return bin_Open(cs, buf, BIN_MSGPACK);
+}
+
+int cbor_Fullcapture(CapState *cs, rBuffer *buf, int count) {
+  UNUSED(count);
+  return bin_Fullcapture(cs, buf, BIN_CBOR);
+}
+
+int cbor_Close(CapState *cs, rBuffer *buf, int count, const char *start) {
+  return bin_Close(cs, buf, count, start, BIN_CBOR);
+}
+
+int cbor_Open(CapState *cs, rBuffer *buf, int count) {
+  UNUSED(count);
+  return bin_Open(cs, buf, BIN_CBOR);
+}
+
+
+
+/* ****************************************************************************************
+ * Offsets: each capture is a tuple of four ints, in the order of the
+ * capture list (so a capture comes before its subs): the ktable index
+ * of its name (see capnames), its start and end positions (1-based,
+ * as in the byte encoding), and its depth (0 for the outer capture).
+ * No text of the subject is copied, and neither are the names, nor
+ * the values of constant captures (which are in the ktable, after the
+ * name).
+ *
+ * The end of an open capture is not known until its Close, so the
+ * end field of its tuple holds the enclosing open tuple until then,
+ * as cs->mark holds the innermost one (as an offset plus 1, or 0 for
+ * none).
+ * ****************************************************************************************
+ */
+
+/* depth of a new tuple: one more than that of the innermost open one */
+static int offsets_depth(CapState *cs, rBuffer *buf) {
+  const char *s;
+  if (!cs->mark) return 0;
+  s = buf->data + (cs->mark - 1) + 12;
+  return r_readint(&s) + 1;
+}
+
+static void offsets_tuple(CapState *cs, rBuffer *buf, int e) {
+  int depth = offsets_depth(cs, buf);
+  r_addint(cs->L, buf, cs->cap->idx);
+  r_addint(cs->L, buf, (int) cs->cap->s + 1);
+  r_addint(cs->L, buf, e);
+  r_addint(cs->L, buf, depth);
+}
+
+int offsets_Fullcapture(CapState *cs, rBuffer *buf, int count) {
+  Capture *c = cs->cap;
+  UNUSED(count);
+  if (!(isfullcap(c) && acceptable_capture(c->kind))) return ROSIE_FULLCAP_ERROR;
+  offsets_tuple(cs, buf, (int) (c->s + c->siz));
+  return ROSIE_OK;
+}
+
+int offsets_Close(CapState *cs, rBuffer *buf, int count, const char *start) {
+  size_t pos;
+  const char *s;
+  UNUSED(count); UNUSED(start);
+  if (!isclosecap(cs->cap) || !cs->mark) return ROSIE_CLOSE_ERROR;
+  pos = cs->mark - 1;
+  s = buf->data + pos + 8;
+  cs->mark = (size_t) r_readint(&s);
+  r_setint(buf, pos + 8, (int) cs->cap->s + 1);
+  return ROSIE_OK;
+}
+
+int offsets_Open(CapState *cs, rBuffer *buf, int count) {
+  size_t pos = buf->n;
+  UNUSED(count);
+  if (isfullcap(cs->cap) || !acceptable_capture(cs->cap->kind)) return ROSIE_OPEN_ERROR;
+  if (pos >= INT_MAX) return ROSIE_OPEN_ERROR;
+  offsets_tuple(cs, buf, (int) cs->mark);
+  cs->mark = pos + 1;
+  return ROSIE_OK;
+}
+
+/* ****************************************************************************************
+ * Columnar encoding, of a batch of records: one column for each
+ * distinct capture name of the pattern, holding, for each record, the
+ * start and end positions of the first capture with that name (or 0
+ * and 0 when there is none, or the record did not match).  The rows
+ * are kept as the records are added, and r_endcolumns writes the
+ * block:
+ *
+ *   int ncols, int nrecs
+ *   for each column: its name (as a short length, then the name)
+ *   for each column: nrecs start positions, then nrecs end positions
+ *
+ * with positions 1-based in the record, as in the byte encoding.
+ * ****************************************************************************************
+ */
+
+/* Push new columns for a pattern whose ktable has n entries, with no
+ * columns yet (see r_capcolumns), and then the two buffers for its
+ * rows and open captures (which must be kept on the stack with it).
+ */
+rColumns *r_newcolumns(lua_State *L, int n) {
+  rColumns *c = (rColumns *)lua_newuserdata(L, sizeof(rColumns) + 4 * (n + 1) * sizeof(int));
+  int i;
+  c->ncols = 0;
+  c->colof = (int *)(c + 1);
+  c->nameof = c->colof + (n + 1);
+  c->row = c->nameof + (n + 1);
+  for (i = 0; i <= n; i++) c->colof[i] = -1;
+  c->nrecs = 0;
+  c->rows = r_newbuffer(L);
+  c->open = r_newbuffer(L);
+  return c;
+}
+
+/* Add a row for the record whose capture list is capture (or NULL,
+ * when it did not match).  Returns ROSIE_OK, ROSIE_HALT if the match
+ * ended with a halt, or an error status.
+ */
+int r_addcolumns(lua_State *L, rColumns *c, const Capture *capture) {
+  int *row = c->row;
+  const Capture *cap;
+  const char *top;
+  int i, col, err = ROSIE_OK;
+  for (i = 0; i < 2 * c->ncols; i++) row[i] = 0;
+  c->open->n = 0;
+  for (cap = capture; cap != NULL; cap++) {
+    if (isfinalcap(cap) || isclosecap(cap)) {
+      if (isfinalcap(cap)) err = ROSIE_HALT;
+      else if (c->open->n == 0) break;	/* the sentinel put there by IEnd */
+      while (c->open->n > 0) {	/* close one open capture, or all of them at a halt */
+	c->open->n -= 4;
+	top = c->open->data + c->open->n;
+	col = r_readint(&top);
+	if (col >= 0) row[2 * col + 1] = (int) cap->s + 1;
+	if (err != ROSIE_HALT) break;
+      }
+      if (err == ROSIE_HALT) break;
+    }
+    else if (!acceptable_capture(cap->kind)) {
+      err = isfullcap(cap) ? ROSIE_FULLCAP_ERROR : ROSIE_OPEN_ERROR;
+      break;
+    }
+    else {
+      col = c->colof[cap->idx];
+      if (col >= 0 && row[2 * col] != 0) col = -1; /* not the first with its name */
+      if (col >= 0) row[2 * col] = (int) cap->s + 1;
+      if (isfullcap(cap)) {
+	if (col >= 0) row[2 * col + 1] = (int) (cap->s + cap->siz);
+      }
+      else if (c->open->n / 4 >= R_MAXDEPTH) {
+	err = ROSIE_DEPTH_ERROR;
+	break;
+      }
+      else r_addint(L, c->open, col);
+    }
+  }
+  for (i = 0; i < 2 * c->ncols; i++) r_addint(L, c->rows, row[i]);
+  c->nrecs++;
+  return err;
+}
+
+/* Append the block of the columns to out, with the names in names */
+void r_endcolumns(lua_State *L, rColumns *c, const rName *names, rBuffer *out) {
+  const char *s;
+  int i, k, j;
+  r_addint(L, out, c->ncols);
+  r_addint(L, out, c->nrecs);
+  for (i = 0; i < c->ncols; i++)
+    r_addlstring(L, out, names[c->nameof[i]].byte, names[c->nameof[i]].bytelen);
+  r_prepbuffsize(L, out, (size_t) c->ncols * c->nrecs * 2 * 4);
+  for (i = 0; i < c->ncols; i++)
+    for (j = 0; j < 2; j++)	/* starts, then ends */
+      for (k = 0; k < c->nrecs; k++) {
+	s = c->rows->data + ((size_t) k * c->ncols + i) * 8 + j * 4;
+	r_addint(L, out, r_readint(&s));
+      }
+}
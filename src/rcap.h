@@ -27,6 +27,22 @@ int byte_Fullcapture(CapState *cs, rBuffer *buf, int count);
 int byte_Close(CapState *cs, rBuffer *buf, int count, const char *start);
 int byte_Open(CapState *cs, rBuffer *buf, int count);
 
+int msgpack_Fullcapture(CapState *cs, rBuffer *buf, int count);
+int msgpack_Close(CapState *cs, rBuffer *buf, int count, const char *start);
+int msgpack_Open(CapState *cs, rBuffer *buf, int count);
+
+int cbor_Fullcapture(CapState *cs, rBuffer *buf, int count);
+int cbor_Close(CapState *cs, rBuffer *buf, int count, const char *start);
+int cbor_Open(CapState *cs, rBuffer *buf, int count);
+
+int offsets_Fullcapture(CapState *cs, rBuffer *buf, int count);
+int offsets_Close(CapState *cs, rBuffer *buf, int count, const char *start);
+int offsets_Open(CapState *cs, rBuffer *buf, int count);
+
+rColumns *r_newcolumns(lua_State *L, int n);
+int r_addcolumns(lua_State *L, rColumns *c, const Capture *capture);
+void r_endcolumns(lua_State *L, rColumns *c, const rName *names, rBuffer *out);
+
 /* Some JSON literals */
 #define TYPE_LABEL ("{\"type\":\"")
 #define START_LABEL (",\"s\":")
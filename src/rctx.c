@@ -0,0 +1,220 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  rctx.c   Match contexts, reused from one match to the next               */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#include <stdlib.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lptypes.h"
+#include "rctx.h"
+
+/* A match borrows the arena of a context (see r_borrowcontext) by
+ * putting it in its stack slot, and gives it back when it is done with
+ * its captures (see r_returncontext).  A match that starts while the
+ * arena is lent, which is either a nested match (e.g. from a
+ * match-time capture) or a match after one that ended with an error,
+ * gets a new arena, and the context takes that one instead when it is
+ * given back.  The arena a match is using is always in its stack slot,
+ * so it cannot be collected even if the context lets go of it.
+ *
+ * The arrays of an arena grow by doubling during a match (see
+ * 'doublestack' and 'doublecap'), in place, so that they never make
+ * Lua garbage.  They are resized before a match: the capture list to
+ * twice the high-water mark of recent matches, when it is more than
+ * four times that; the stack to half its size, when it has not grown
+ * in R_CTXSHRINK matches.  Neither goes below its initial size.
+ */
+
+/* --------------------------------------------------------------------------------------------------- */
+
+static int arenagc (lua_State *L) {
+  MatchArena *a = (MatchArena *)lua_touserdata(L, 1);
+  free(a->stack);
+  free(a->capture);
+  a->stack = NULL;
+  a->capture = NULL;
+  return 0;
+}
+
+static struct luaL_Reg arena_meta_reg[] = {
+    {"__gc", arenagc},
+    {NULL, NULL}
+};
+
+/* Push a new arena, with arrays of the initial sizes */
+static MatchArena *newarena (lua_State *L) {
+  MatchArena *a = (MatchArena *)lua_newuserdata(L, sizeof(MatchArena));
+  a->stack = NULL;
+  a->capture = NULL;
+  if (luaL_newmetatable(L, ROSIE_MATCHARENA)) luaL_setfuncs(L, arena_meta_reg, 0);
+  lua_setmetatable(L, -2);
+  a->stack = (Stack *)malloc(R_CTXBACK * sizeof(Stack));
+  a->capture = (Capture *)malloc(INITCAPSIZE * sizeof(Capture));
+  if (!a->stack || !a->capture) luaL_error(L, r_matcherror(MATCH_ENOMEM));
+  a->stacksize = R_CTXBACK;
+  a->capsize = INITCAPSIZE;
+  a->caphigh = 0;
+  a->uses = 0;
+  a->grew = 0;
+  return a;
+}
+
+/* Resize the arrays of an arena that is not in use (see above) */
+static void resizearena (MatchArena *a) {
+  int need = (a->caphigh < INITCAPSIZE) ? INITCAPSIZE : a->caphigh;
+  if (a->capsize / 4 > need) {
+    Capture *newc = (Capture *)realloc(a->capture, 2 * need * sizeof(Capture));
+    if (newc) {
+      a->capture = newc;
+      a->capsize = 2 * need;
+    }
+  }
+  if (++a->uses >= R_CTXSHRINK) {
+    if (!a->grew && a->stacksize > R_CTXBACK) {
+      int n = (a->stacksize / 2 < R_CTXBACK) ? R_CTXBACK : a->stacksize / 2;
+      Stack *newstack = (Stack *)realloc(a->stack, n * sizeof(Stack));
+      if (newstack) {
+	a->stack = newstack;
+	a->stacksize = n;
+      }
+    }
+    a->uses = 0;
+    a->grew = 0;
+  }
+}
+
+/* --------------------------------------------------------------------------------------------------- */
+
+/* sizes of the arrays of the context */
+static int ctxsizes (lua_State *L) {
+  rMatchCtx *ctx = (rMatchCtx *)luaL_checkudata(L, 1, ROSIE_MATCHCTX);
+  lua_pushinteger(L, ctx->arena->stacksize);
+  lua_pushinteger(L, ctx->arena->capsize);
+  return 2;
+}
+
+static struct luaL_Reg ctx_index_reg[] = {
+    {"sizes", ctxsizes},
+    {NULL, NULL}
+};
+
+static void ctx_type_init(lua_State *L) {
+  /* Enter with a new metatable on the stack */
+  int top = lua_gettop(L);
+  luaL_newlib(L, ctx_index_reg);
+  lua_setfield(L, -2, "__index");
+  lua_settop(L, top);
+  /* Must leave the metatable on the stack */
+}
+
+/* newcontext(): a new match context, which can be given to rmatch,
+ * rfind, rmatch_batch and rmatch_stream (instead of the default one)
+ */
+int r_lua_newcontext (lua_State *L) {
+  rMatchCtx *ctx = (rMatchCtx *)lua_newuserdata(L, sizeof(rMatchCtx));
+  ctx->avail = 1;
+  if (luaL_newmetatable(L, ROSIE_MATCHCTX)) ctx_type_init(L);
+  lua_setmetatable(L, -2);
+  ctx->arena = newarena(L);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+/* Index of the optional context argument at idx, or 0 for the default */
+int r_optcontext (lua_State *L, int idx) {
+  if (lua_isnoneornil(L, idx)) return 0;
+  luaL_checkudata(L, idx, ROSIE_MATCHCTX);
+  return idx;
+}
+
+/* Push the context at ctxidx (or the default one, when ctxidx is 0) */
+static rMatchCtx *pushcontext (lua_State *L, int ctxidx) {
+  if (ctxidx) lua_pushvalue(L, ctxidx);
+  else {
+    lua_getfield(L, LUA_REGISTRYINDEX, MATCHCTXIDX);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      r_lua_newcontext(L);
+      lua_pushvalue(L, -1);
+      lua_setfield(L, LUA_REGISTRYINDEX, MATCHCTXIDX);
+    }
+  }
+  return (rMatchCtx *)lua_touserdata(L, -1);
+}
+
+/* --------------------------------------------------------------------------------------------------- */
+
+/* Put the arena of the context in the stack slot of a match whose
+ * arguments end at ptop (and that has set up its slots up to the
+ * ktable).  Leaves the stack slot on top.  Returns the context, to be
+ * given to r_returncontext.
+ */
+rMatchCtx *r_borrowcontext (lua_State *L, int ctxidx, int ptop) {
+  rMatchCtx *ctx;
+  assert(lua_gettop(L) == ktableidx(ptop));
+  ctx = pushcontext(L, ctxidx);	/* replaced by the arena below */
+  if (ctx->avail) {
+    ctx->avail = 0;
+    resizearena(ctx->arena);
+    lua_getuservalue(L, -1);
+  }
+  else newarena(L);		/* lent */
+  lua_replace(L, stackidx(ptop));
+  return ctx;
+}
+
+/* Give the arena in the stack slot of the match back to the context,
+ * once the captures have been used.  Keeps the top of the stack.
+ */
+void r_returncontext (lua_State *L, int ctxidx, rMatchCtx *ctx, int ptop) {
+  MatchArena *a = (MatchArena *)lua_touserdata(L, stackidx(ptop));
+  if (a != ctx->arena) {	/* take the new one */
+    pushcontext(L, ctxidx);
+    lua_pushvalue(L, stackidx(ptop));
+    lua_setuservalue(L, -2);
+    lua_pop(L, 1);
+    ctx->arena = a;
+  }
+  ctx->avail = 1;
+}
+
+/* Like 'match', with the arena in the stack slot (see r_borrowcontext).
+ * Leaves the capture list (as a light userdata) in its slot.  When out
+ * is not NULL, the vm appends the byte encoding of the captures to it
+ * instead (for a pattern whose 'direct' is set), with the capture names
+ * in names, and sets *abend.
+ */
+const char *r_ctxmatch (lua_State *L, const char *o, const char *s, const char *e,
+			const Instruction *op, int ptop, rBuffer *out, const rName *names,
+			int *abend) {
+  MatchArena *a = (MatchArena *)lua_touserdata(L, stackidx(ptop));
+  MatchState ms;
+  const char *r;
+  int stacksize = a->stacksize, capsize = a->capsize, used;
+  r_initmatch(&ms, L, ptop, a->stack, a->stacksize, a->capture, a->capsize);
+  ms.arena = a;
+  ms.out = out;
+  ms.names = names;
+  if (ms.stacksize > R_CTXBACK) {	/* grown when the limit was higher? */
+    lua_getfield(L, LUA_REGISTRYINDEX, MAXSTACKIDX);
+    ms.maxstack = (int) lua_tointeger(L, -1);
+    lua_pop(L, 1);
+    if (ms.stacksize > ms.maxstack) ms.stacksize = ms.maxstack;
+  }
+  r = r_vmmatch(&ms, o, s, e, op);
+  if (out) *abend = ms.abend;
+  lua_pushlightuserdata(L, ms.capture);
+  lua_replace(L, caplistidx(ptop));
+  if (a->stacksize > stacksize) a->grew = 1;
+  used = (a->capsize > capsize) ? a->capsize / 2 : ms.ncap;
+  if (used > a->caphigh) a->caphigh = used;
+  else a->caphigh -= (a->caphigh - used) >> R_CAPDECAY;
+  if (ms.err != MATCH_OK)
+    luaL_error(L, r_matcherror(ms.err), ms.maxstack);
+  return r;
+}
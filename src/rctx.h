@@ -0,0 +1,38 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rctx.h                                                                   */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#if !defined(rctx_h)
+#define rctx_h
+
+#include "lpvm.h"
+
+#define ROSIE_MATCHCTX "ROSIE_MATCHCTX"
+#define ROSIE_MATCHARENA "ROSIE_MATCHARENA"
+#define MATCHCTXIDX "lpeg-matchctx"	  /* default context, in the registry */
+
+#define R_CTXBACK 256			  /* initial size of the backtrack stack */
+#define R_CTXSHRINK 1024		  /* matches between checks for shrinking the stack */
+#define R_CAPDECAY 4			  /* the capture high-water mark decays by 1/2^R_CAPDECAY */
+
+/* A match context keeps a MatchArena (a userdata, its uservalue) from
+ * one match to the next.
+ */
+typedef struct rMatchCtx {
+  int avail;			/* arena not in use by a match */
+  MatchArena *arena;		/* the arena in the uservalue */
+} rMatchCtx;
+
+int r_lua_newcontext (lua_State *L);
+int r_optcontext (lua_State *L, int idx);
+rMatchCtx *r_borrowcontext (lua_State *L, int ctxidx, int ptop);
+void r_returncontext (lua_State *L, int ctxidx, rMatchCtx *ctx, int ptop);
+const char *r_ctxmatch (lua_State *L, const char *o, const char *s, const char *e,
+			const Instruction *op, int ptop, rBuffer *out, const rName *names,
+			int *abend);
+
+#endif
@@ -0,0 +1,207 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  rcur.c   Lazy decoding of byte-encoded matches                           */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lptypes.h"
+#include "lpcap.h"
+#include "rcur.h"
+
+/* Where decode turns a whole match into nested tables, a cursor reads
+ * the encoding only where it is asked to: making one reads the start
+ * position and names of its match; its end position is found (by
+ * skipping the subs) the first time it is needed; and its subs are
+ * cursors made one at a time by an iterator.  A cursor is valid as
+ * long as its buffer holds the same data.  The output buffer of rmatch
+ * is reused by the next call to rmatch (or rfind), so a cursor over it
+ * must be used before then.  Reads are checked against the length of
+ * the buffer, so using a stale cursor raises an error or returns
+ * wrong values, but never reads outside the buffer.
+ */
+
+/* --------------------------------------------------------------------------------------------------- */
+
+static void need (lua_State *L, const rBuffer *buf, size_t pos, size_t len) {
+  if (pos > buf->n || buf->n - pos < len)
+    luaL_error(L, "corrupt match data (buffer overrun)");
+}
+
+static int getint (lua_State *L, const rBuffer *buf, size_t pos) {
+  const char *s = buf->data + pos;
+  need(L, buf, pos, 4);
+  return r_readint(&s);
+}
+
+static int getshort (lua_State *L, const rBuffer *buf, size_t pos) {
+  const char *s = buf->data + pos;
+  need(L, buf, pos, 2);
+  return r_readshort(&s);
+}
+
+/* Read the start of the match at pos (its start position and names)
+ * into c, when c is not NULL.  Returns the offset after it.
+ */
+static size_t header (lua_State *L, const rBuffer *buf, size_t pos, rCursor *c) {
+  int len;
+  if (getint(L, buf, pos) >= 0) luaL_error(L, "corrupt match data (expected start marker)");
+  pos += 4;
+  len = getshort(L, buf, pos);
+  pos += 2;
+  if (len <= 0) {		/* constant capture: its value comes first */
+    need(L, buf, pos, (size_t) -len);
+    if (c) { c->hasdata = 1; c->data = pos; c->datalen = (size_t) -len; }
+    pos += (size_t) -len;
+    len = getshort(L, buf, pos);
+    pos += 2;
+    if (len < 0) luaL_error(L, "corrupt match data (expected length of type name)");
+  }
+  need(L, buf, pos, (size_t) len);
+  if (c) { c->name = pos; c->namelen = (size_t) len; }
+  return pos + (size_t) len;
+}
+
+/* Offset of the end position of the match whose subs start at pos */
+static size_t findend (lua_State *L, const rBuffer *buf, size_t pos) {
+  int depth = 0;
+  while (1) {
+    if (getint(L, buf, pos) < 0) {
+      pos = header(L, buf, pos, NULL);
+      depth++;
+    }
+    else if (depth-- == 0) return pos;
+    else pos += 4;
+  }
+}
+
+static size_t cursorend (lua_State *L, rCursor *c) {
+  if (c->end == 0) c->end = findend(L, c->buf, c->subs);
+  return c->end;
+}
+
+/* Push a cursor over the match at pos of the buffer at index bufidx */
+static rCursor *newcursor (lua_State *L, rBuffer *buf, int bufidx, size_t pos) {
+  rCursor *c = (rCursor *)lua_newuserdata(L, sizeof(rCursor));
+  c->buf = buf;
+  c->off = pos;
+  c->hasdata = 0;
+  c->data = c->datalen = 0;
+  c->end = 0;
+  c->subs = header(L, buf, pos, c);
+  luaL_setmetatable(L, ROSIE_CURSOR);
+  lua_pushvalue(L, bufidx);
+  lua_setuservalue(L, -2);
+  return c;
+}
+
+/* --------------------------------------------------------------------------------------------------- */
+
+static rCursor *checkcursor (lua_State *L) {
+  return (rCursor *)luaL_checkudata(L, 1, ROSIE_CURSOR);
+}
+
+static int cursortype (lua_State *L) {
+  rCursor *c = checkcursor(L);
+  need(L, c->buf, c->name, c->namelen);
+  lua_pushlstring(L, c->buf->data + c->name, c->namelen);
+  return 1;
+}
+
+static int cursorstart (lua_State *L) {
+  rCursor *c = checkcursor(L);
+  lua_pushinteger(L, -getint(L, c->buf, c->off));
+  return 1;
+}
+
+static int cursorfinish (lua_State *L) {
+  rCursor *c = checkcursor(L);
+  lua_pushinteger(L, getint(L, c->buf, cursorend(L, c)));
+  return 1;
+}
+
+/* the value of a constant capture, or nil */
+static int cursordata (lua_State *L) {
+  rCursor *c = checkcursor(L);
+  if (!c->hasdata) lua_pushnil(L);
+  else {
+    need(L, c->buf, c->data, c->datalen);
+    lua_pushlstring(L, c->buf->data + c->data, c->datalen);
+  }
+  return 1;
+}
+
+/* iterator over the subs: (cursor, previous sub or nil) -> next sub or nil */
+static int nextsub (lua_State *L) {
+  rCursor *c = checkcursor(L);
+  size_t pos = c->subs;
+  if (!lua_isnil(L, 2)) {
+    rCursor *prev = (rCursor *)luaL_checkudata(L, 2, ROSIE_CURSOR);
+    pos = cursorend(L, prev) + 4;
+  }
+  if (getint(L, c->buf, pos) >= 0) {	/* end position of c: no more subs */
+    c->end = pos;
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_getuservalue(L, 1);
+  newcursor(L, c->buf, lua_gettop(L), pos);
+  return 1;
+}
+
+/* for sub in c:subs() do ... end */
+static int cursorsubs (lua_State *L) {
+  checkcursor(L);
+  lua_pushcfunction(L, nextsub);
+  lua_pushvalue(L, 1);
+  lua_pushnil(L);
+  return 3;
+}
+
+/* the whole match as nested tables, as decode makes them */
+static int cursordecode (lua_State *L) {
+  rCursor *c = checkcursor(L);
+  const char *s = c->buf->data + c->off;
+  const char *e = c->buf->data + c->buf->n;
+  need(L, c->buf, c->off, 0);
+  r_pushmatch(L, &s, &e, 0);
+  return 1;
+}
+
+static struct luaL_Reg cursor_index_reg[] = {
+    {"type", cursortype},
+    {"s", cursorstart},
+    {"e", cursorfinish},
+    {"data", cursordata},
+    {"subs", cursorsubs},
+    {"decode", cursordecode},
+    {NULL, NULL}
+};
+
+static void cursor_type_init(lua_State *L) {
+  /* Enter with a new metatable on the stack */
+  int top = lua_gettop(L);
+  luaL_newlib(L, cursor_index_reg);
+  lua_setfield(L, -2, "__index");
+  lua_settop(L, top);
+  /* Must leave the metatable on the stack */
+}
+
+/* cursor(rbuffer [, offset]): a cursor over the byte-encoded match at
+ * offset (default 0) of the buffer, e.g. as rmatch returns it, or at
+ * an offset from the index of rmatch_batch.  Returns nil when there is
+ * no data at offset.
+ */
+int r_lua_cursor (lua_State *L) {
+  rBuffer *buf = (rBuffer *)luaL_checkudata(L, 1, ROSIE_BUFFER);
+  lua_Integer off = luaL_optinteger(L, 2, 0);
+  luaL_argcheck(L, 0 <= off && (size_t) off <= buf->n, 2, "out of range");
+  if (luaL_newmetatable(L, ROSIE_CURSOR)) cursor_type_init(L);
+  lua_pop(L, 1);
+  if ((size_t) off == buf->n) lua_pushnil(L);
+  else newcursor(L, buf, 1, (size_t) off);
+  return 1;
+}
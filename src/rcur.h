@@ -0,0 +1,34 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rcur.h                                                                   */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#if !defined(rcur_h)
+#define rcur_h
+
+#include "rbuf.h"
+
+#define ROSIE_CURSOR "ROSIE_CURSOR"
+
+/* A cursor over one match in a byte-encoded rbuffer (see rcap.c).  It
+ * holds offsets into the buffer, not copies of the data, and the
+ * buffer is its uservalue.
+ */
+typedef struct rCursor {
+  rBuffer *buf;
+  size_t off;			/* start of the match */
+  size_t name;			/* its type name */
+  size_t namelen;
+  size_t data;			/* value of a constant capture */
+  size_t datalen;
+  int hasdata;
+  size_t subs;			/* first sub, or the end position when there are none */
+  size_t end;			/* end position, or 0 until it is needed */
+} rCursor;
+
+int r_lua_cursor (lua_State *L);
+
+#endif
@@ -0,0 +1,131 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  rmmap.c   Memory-mapped input files                                      */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "rbuf.h"
+#include "rmmap.h"
+
+/* --------------------------------------------------------------------------------------------------- */
+
+static int mmapgc (lua_State *L) {
+  rMmap *m = (rMmap *)luaL_checkudata(L, 1, ROSIE_MMAP);
+  if (m->map) munmap(m->map, m->maplen);
+  m->map = NULL;
+  m->data = m->base = NULL;
+  m->n = m->size = 0;
+  return 0;
+}
+
+static int mmapsize (lua_State *L) {
+  rMmap *m = (rMmap *)luaL_checkudata(L, 1, ROSIE_MMAP);
+  lua_pushinteger(L, (lua_Integer) m->n);
+  return 1;
+}
+
+/* window(m, offset [, len]): set the window to len bytes (default: all
+ * the rest) from offset (0-based) in the mapped part of the file.
+ * Returns m.
+ */
+static int mmapwindow (lua_State *L) {
+  rMmap *m = (rMmap *)luaL_checkudata(L, 1, ROSIE_MMAP);
+  lua_Integer offset = luaL_checkinteger(L, 2);
+  lua_Integer len = luaL_optinteger(L, 3, -1);
+  luaL_argcheck(L, 0 <= offset && (size_t) offset <= m->size, 2, "out of range");
+  if (len < 0 || (size_t) len > m->size - offset) len = m->size - offset;
+  m->data = m->base + offset;
+  m->n = (size_t) len;
+  lua_settop(L, 1);
+  return 1;
+}
+
+static struct luaL_Reg mmap_meta_reg[] = {
+    {"__gc", mmapgc},
+    {"__len", mmapsize},
+    {NULL, NULL}
+};
+
+static struct luaL_Reg mmap_index_reg[] = {
+    {"window", mmapwindow},
+    {"close", mmapgc},
+    {NULL, NULL}
+};
+
+static void mmap_type_init(lua_State *L) {
+  /* Enter with a new metatable on the stack */
+  int top = lua_gettop(L);
+  luaL_setfuncs(L, mmap_meta_reg, 0);
+  luaL_newlib(L, mmap_index_reg);
+  lua_pushcfunction(L, r_lua_buffsub);	/* same as for rbuffers */
+  lua_setfield(L, -2, "sub");
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -3, "__index");
+  lua_settop(L, top);
+  /* Must leave the metatable on the stack */
+}
+
+/* --------------------------------------------------------------------------------------------------- */
+
+/* mmap(path [, offset [, len]]): map len bytes (default: all the rest)
+ * of the file at path, from offset (0-based), read-only.  Returns the
+ * new ROSIE_MMAP, with its window set to all of them, or nil plus an
+ * error message (like io.open).
+ */
+int r_lua_mmap (lua_State *L) {
+  const char *path = luaL_checkstring(L, 1);
+  lua_Integer offset = luaL_optinteger(L, 2, 0);
+  lua_Integer len = luaL_optinteger(L, 3, -1);
+  long page = sysconf(_SC_PAGESIZE);
+  struct stat st;
+  size_t skip;
+  rMmap *m;
+  int fd;
+  luaL_argcheck(L, offset >= 0, 2, "out of range");
+  m = (rMmap *)lua_newuserdata(L, sizeof(rMmap));
+  m->map = NULL;
+  m->data = m->base = NULL;
+  m->n = m->size = m->maplen = 0;
+  if (luaL_newmetatable(L, ROSIE_MMAP)) mmap_type_init(L);
+  lua_setmetatable(L, -2);
+  fd = open(path, O_RDONLY);
+  if (fd < 0) return luaL_fileresult(L, 0, path);
+  if (fstat(fd, &st) < 0) {
+    int en = errno;
+    close(fd);
+    errno = en;
+    return luaL_fileresult(L, 0, path);
+  }
+  if (offset > (lua_Integer) st.st_size) offset = st.st_size;
+  if (len < 0 || len > (lua_Integer) st.st_size - offset) len = st.st_size - offset;
+  skip = (size_t) (offset % page);	/* mapping must start at a page boundary */
+  if (len > 0) {
+    void *p = mmap(NULL, (size_t) len + skip, PROT_READ, MAP_PRIVATE, fd, (off_t) (offset - skip));
+    if (p == MAP_FAILED) {
+      int en = errno;
+      close(fd);
+      errno = en;
+      return luaL_fileresult(L, 0, path);
+    }
+    posix_madvise(p, (size_t) len + skip, POSIX_MADV_SEQUENTIAL);
+    m->map = p;
+    m->maplen = (size_t) len + skip;
+    m->data = m->base = (const char *) p + skip;
+    m->n = m->size = (size_t) len;
+  }
+  close(fd);
+  return 1;
+}
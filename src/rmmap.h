@@ -0,0 +1,30 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rmmap.h                                                                  */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#if !defined(rmmap_h)
+#define rmmap_h
+
+#define ROSIE_MMAP "ROSIE_MMAP"
+
+/* A file mapped read-only into memory.  The input for matching is the
+ * window [data, data+n), which is always inside [base, base+size), the
+ * part of the file that was requested.  (The mapping itself starts at
+ * a page boundary, so it may start a little before base.)
+ */
+typedef struct rMmap {
+  const char *data;		/* window */
+  size_t n;
+  const char *base;		/* requested part of the file */
+  size_t size;
+  void *map;			/* NULL when nothing is mapped */
+  size_t maplen;
+} rMmap;
+
+int r_lua_mmap (lua_State *L);
+
+#endif
@@ -0,0 +1,305 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  rpar.c   Matching the records of one input on many threads               */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lptypes.h"
+#include "rpeg.h"
+#include "rshare.h"
+#include "rpar.h"
+
+/* The input is split into chunks that end at a newline (or at the end
+ * of the input).  Each worker starts with a contiguous run of chunks,
+ * its deque, and takes them from the front; when its deque is empty it
+ * steals from the back of another worker's deque.  The output for a
+ * chunk is kept (in a block of exactly its size) until all the chunks
+ * are done, and then put back in input order, whichever worker matched
+ * the chunk.  The records in the output are framed as by rmatch_stream.
+ */
+
+typedef struct Chunk {
+  const char *s;
+  size_t len;
+  char *out;			/* output, NULL until the chunk is matched */
+  size_t outlen;
+  int n;			/* number of records */
+  int err;			/* MATCH_OK, or why the chunk was abandoned */
+} Chunk;
+
+/* The chunks of a match, in a userdata whose __gc frees them, so that
+ * they are not lost when merging their outputs raises an error */
+typedef struct ChunkList {
+  Chunk *chunks;
+  int nchunks;
+} ChunkList;
+
+typedef struct Deque {
+  pthread_mutex_t lock;
+  int head, tail;		/* chunks [head, tail) are left */
+} Deque;
+
+typedef struct ParState {
+  const rPattern *p;
+  int encoding;
+  Chunk *chunks;
+  int nchunks;
+  Deque *deques;
+  int nworkers;
+} ParState;
+
+typedef struct Worker {
+  ParState *ps;
+  int id;
+  pthread_t thread;
+} Worker;
+
+/* --------------------------------------------------------------------------------------------------- */
+
+static int takefront (Deque *d) {
+  int i = -1;
+  pthread_mutex_lock(&d->lock);
+  if (d->head < d->tail) i = d->head++;
+  pthread_mutex_unlock(&d->lock);
+  return i;
+}
+
+static int takeback (Deque *d) {
+  int i = -1;
+  pthread_mutex_lock(&d->lock);
+  if (d->head < d->tail) i = --d->tail;
+  pthread_mutex_unlock(&d->lock);
+  return i;
+}
+
+/* Next chunk for worker id: its own, else one stolen from the others */
+static int nextchunk (ParState *ps, int id) {
+  int i, k;
+  if ((i = takefront(&ps->deques[id])) >= 0) return i;
+  for (k = 1; k < ps->nworkers; k++)
+    if ((i = takeback(&ps->deques[(id + k) % ps->nworkers])) >= 0) return i;
+  return -1;
+}
+
+static void matchrecord (ParState *ps, rScratch *sc, Chunk *c, const char *s, size_t l) {
+  rBuffer *out = sc->out;
+  size_t pos = out->n;
+  int leftover, abend, res;
+  if (l > INT_MAX) {
+    c->err = MATCH_EENCODE;
+    return;
+  }
+  if (ps->encoding == ENCODE_BYTE && r_addint(NULL, out, -1)) { /* length, set below */
+    c->err = MATCH_ENOMEM;
+    return;
+  }
+  res = r_shared_matchinto(ps->p, sc, s, l, 0, ps->encoding, out, &leftover, &abend);
+  if (res < 0) {
+    c->err = -res;
+    return;
+  }
+  if (ps->encoding != ENCODE_BYTE) {
+    char nl = '\n';
+    if (r_addchar(NULL, out, nl)) c->err = MATCH_ENOMEM;
+  }
+  else if (res == 1) r_setint(out, pos, (int) (out->n - pos - 4));
+  c->n++;
+}
+
+static void matchchunk (ParState *ps, rScratch *sc, Chunk *c) {
+  const char *rec = c->s;
+  const char *e = c->s + c->len;
+  const char *eol;
+  sc->out->n = 0;
+  sc->out->failed = 0;
+  while (!c->err && (eol = (const char *)memchr(rec, '\n', e - rec)) != NULL) {
+    matchrecord(ps, sc, c, rec, eol - rec);
+    rec = eol + 1;
+  }
+  if (!c->err && rec < e)	/* last record of the input has no newline */
+    matchrecord(ps, sc, c, rec, e - rec);
+  c->out = (char *)malloc(sc->out->n + 1);
+  if (!c->out) {
+    c->err = MATCH_ENOMEM;
+    return;
+  }
+  memcpy(c->out, sc->out->data, sc->out->n);
+  c->outlen = sc->out->n;
+}
+
+static void *work (void *arg) {
+  Worker *w = (Worker *)arg;
+  ParState *ps = w->ps;
+  rScratch *sc = r_newscratch();
+  int i;
+  if (!sc) return NULL;		/* others will take its chunks */
+  while ((i = nextchunk(ps, w->id)) >= 0)
+    matchchunk(ps, sc, &ps->chunks[i]);
+  r_freescratch(sc);
+  return NULL;
+}
+
+/* --------------------------------------------------------------------------------------------------- */
+
+/* Split [s, s+l) into chunks of at least size bytes that end at a
+ * newline (except the last one).  Returns a malloc'ed array of *n
+ * chunks, or NULL when out of memory.
+ */
+static Chunk *splitinput (const char *s, size_t l, size_t size, int *n) {
+  const char *e = s + l;
+  const char *eol;
+  Chunk *chunks = NULL, *temp;
+  int max = 0;
+  *n = 0;
+  while (s < e) {
+    size_t len = (size_t) (e - s);
+    if (len > size && (eol = (const char *)memchr(s + size - 1, '\n', len - size + 1)) != NULL)
+      len = eol + 1 - s;
+    if (*n == max) {
+      if (max >= INT_MAX / 2) break;
+      max = max ? 2 * max : R_PARCHUNKS;
+      temp = (Chunk *)realloc(chunks, max * sizeof(Chunk));
+      if (!temp) break;
+      chunks = temp;
+    }
+    chunks[*n].s = s;
+    chunks[*n].len = len;
+    chunks[*n].out = NULL;
+    chunks[*n].outlen = 0;
+    chunks[*n].n = 0;
+    chunks[*n].err = MATCH_OK;
+    (*n)++;
+    s += len;
+  }
+  if (s < e) {
+    free(chunks);
+    return NULL;
+  }
+  return chunks;
+}
+
+static void freechunks (ChunkList *cl) {
+  int i;
+  for (i = 0; i < cl->nchunks; i++)
+    free(cl->chunks[i].out);
+  free(cl->chunks);
+  cl->chunks = NULL;
+  cl->nchunks = 0;
+}
+
+static int chunklistgc (lua_State *L) {
+  freechunks((ChunkList *)luaL_checkudata(L, 1, ROSIE_PARCHUNKS));
+  return 0;
+}
+
+static ChunkList *newchunklist (lua_State *L) {
+  ChunkList *cl = (ChunkList *)lua_newuserdata(L, sizeof(ChunkList));
+  cl->chunks = NULL;
+  cl->nchunks = 0;
+  if (luaL_newmetatable(L, ROSIE_PARCHUNKS)) {
+    lua_pushcfunction(L, chunklistgc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+  return cl;
+}
+
+/* default number of threads: the number of online cpus */
+static lua_Integer defaultthreads (void) {
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (ncpus < 1) return 1;	/* unknown */
+  return (ncpus > R_MAXTHREADS) ? R_MAXTHREADS : (lua_Integer) ncpus;
+}
+
+static double elapsed (struct timespec *t0) {
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (double) (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+}
+
+/* rmatch_parallel(exported_peg, input [, encoding [, nthreads [, chunksize]]])
+ *
+ * Match each newline-terminated record of input (a string, rbuffer,
+ * or mmap) with an exported pattern (see lpeg.export) on nthreads
+ * threads (default: the number of online cpus, or 1 if that is not
+ * known).  Returns an rbuffer holding the output for all the records,
+ * in input order and framed as by rmatch_stream, the number of
+ * records, and the elapsed (wall clock) time in seconds.
+ */
+int r_match_parallel (lua_State *L) {
+  const rPattern *p = r_toshared(L, 1);
+  size_t l, size, total = 0;
+  const char *s = (lua_type(L, 2) == LUA_TSTRING) ? lua_tolstring(L, 2, &l)
+                                                  : r_bufferdata(L, 2, &l);
+  int encoding = (int) luaL_optinteger(L, 3, ENCODE_BYTE);
+  lua_Integer nthreads = luaL_optinteger(L, 4, defaultthreads());
+  lua_Integer chunksize = luaL_optinteger(L, 5, 0);
+  ParState ps;
+  Worker *workers;
+  ChunkList *cl;
+  rBuffer *out;
+  struct timespec t0;
+  int i, n = 0, err = MATCH_OK;
+  luaL_argcheck(L, s != NULL, 2, "string, rbuffer, or mmap expected");
+  luaL_argcheck(L, encoding == ENCODE_BYTE || encoding == ENCODE_JSON || encoding == ENCODE_LINE,
+		3, "invalid encoding for a parallel match");
+  luaL_argcheck(L, 0 < nthreads && nthreads <= R_MAXTHREADS, 4, "out of range");
+  luaL_argcheck(L, chunksize >= 0, 5, "out of range");
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  size = (chunksize > 0) ? (size_t) chunksize : l / ((size_t) nthreads * R_PARCHUNKS);
+  if (size < R_PARCHUNKMIN && chunksize == 0) size = R_PARCHUNKMIN;
+  /* the state for the workers and the chunks, collected by Lua even after an error */
+  ps.deques = (Deque *)lua_newuserdata(L, nthreads * sizeof(Deque));
+  workers = (Worker *)lua_newuserdata(L, nthreads * sizeof(Worker));
+  cl = newchunklist(L);
+  ps.chunks = cl->chunks = splitinput(s, l, size, &ps.nchunks);
+  cl->nchunks = ps.nchunks;
+  if (!ps.chunks && l > 0) return luaL_error(L, r_matcherror(MATCH_ENOMEM));
+  if (nthreads > ps.nchunks) nthreads = (ps.nchunks > 0) ? ps.nchunks : 1;
+  ps.nworkers = (int) nthreads;
+  ps.p = p;
+  ps.encoding = encoding;
+  for (i = 0; i < ps.nworkers; i++) {
+    pthread_mutex_init(&ps.deques[i].lock, NULL);
+    ps.deques[i].head = (int) ((long long) ps.nchunks * i / ps.nworkers);
+    ps.deques[i].tail = (int) ((long long) ps.nchunks * (i + 1) / ps.nworkers);
+    workers[i].ps = &ps;
+    workers[i].id = i;
+  }
+  /* worker 0 is this thread; the chunks of workers that cannot start are stolen */
+  for (i = 1; i < ps.nworkers; i++)
+    if (pthread_create(&workers[i].thread, NULL, work, &workers[i]) != 0) workers[i].ps = NULL;
+  work(&workers[0]);
+  for (i = 1; i < ps.nworkers; i++)
+    if (workers[i].ps) pthread_join(workers[i].thread, NULL);
+  for (i = 0; i < ps.nworkers; i++) pthread_mutex_destroy(&ps.deques[i].lock);
+  for (i = 0; i < ps.nchunks; i++) {
+    Chunk *c = &ps.chunks[i];
+    if (!err) err = c->out ? c->err : MATCH_ENOMEM;
+    total += c->outlen;
+    n += c->n;
+  }
+  if (!err) {			/* merge the outputs, in input order */
+    out = r_newbuffer(L);
+    r_prepbuffsize(L, out, total);
+    for (i = 0; i < ps.nchunks; i++)
+      r_addlstring_UNSAFE(L, out, ps.chunks[i].out, ps.chunks[i].outlen);
+  }
+  freechunks(cl);
+  if (err) return luaL_error(L, r_matcherror(err), MAXBACK);
+  lua_pushinteger(L, n);
+  lua_pushnumber(L, elapsed(&t0));
+  return 3;
+}
@@ -0,0 +1,20 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rpar.h                                                                   */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#if !defined(rpar_h)
+#define rpar_h
+
+#define ROSIE_PARCHUNKS "ROSIE_PARCHUNKS"
+
+#define R_MAXTHREADS 256
+#define R_PARCHUNKMIN (64 * 1024)	  /* smallest chunk of input given to a worker */
+#define R_PARCHUNKS 16			  /* chunks per worker, when the input is big enough */
+
+int r_match_parallel (lua_State *L);
+
+#endif
@@ -29,16 +29,33 @@ typedef struct r_encoder_type {
 #define ENCODE_JSON 1
 #define ENCODE_LINE 2
 #define ENCODE_BYTE 3
+#define ENCODE_MSGPACK 4
+#define ENCODE_CBOR 5
+#define ENCODE_COLUMNS 6
+#define ENCODE_OFFSETS 7
 
 __attribute__((unused))
 static r_encoder_t r_encoders[] = { 
      {"json",   ENCODE_JSON},
      {"line",   ENCODE_LINE},
      {"byte",   ENCODE_BYTE},
+     {"msgpack", ENCODE_MSGPACK},
+     {"cbor",   ENCODE_CBOR},
+     {"columns", ENCODE_COLUMNS},
+     {"offsets", ENCODE_OFFSETS},
      {"debug",  ENCODE_DEBUG},
      {NULL, 0}
 };
 
+/* Streaming matcher (see r_match_stream) */
+#define ROSIE_STREAM "ROSIE_STREAM"
+#define R_STREAMCHUNK (64 * 1024)	  /* bytes read from a file at a time */
+
+typedef struct rStream {
+  int encoding;
+} rStream;
+
 int r_match_C (lua_State *L);
+int r_find_C (lua_State *L);
 
 #endif
@@ -0,0 +1,229 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  rshare.c   Compiled patterns that can be shared by threads               */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lptypes.h"
+#include "lpcode.h"
+#include "rpeg.h"
+#include "rshare.h"
+
+/* initial sizes for the stack and capture list of an rScratch */
+#define SCRATCHBACK 64
+#define SCRATCHCAPS INITCAPSIZE
+
+/* Lua side of an rPattern (a ROSIE_SHARED userdata) */
+typedef struct rSharedBox {
+  rPattern *p;
+  rScratch *sc;			/* for 'match', made on first use */
+} rSharedBox;
+
+/* --------------------------------------------------------------------------------------------------- */
+
+/* Only patterns whose captures are all Rosie captures can be
+ * exported, because the others produce Lua values.
+ */
+static const char *unshareable (const Instruction *code, int codesize) {
+  const Instruction *op;
+  for (op = code; op < code + codesize; op += sizei(op)) {
+    switch ((Opcode)op->i.code) {
+    case ICloseRunTime: return "run-time capture";
+    case IOpenCapture: case IFullCapture: {
+      if (getkind(op) != Crosiecap && getkind(op) != Crosieconst)
+	return "capture that produces a Lua value";
+      break;
+    }
+    default: break;
+    }
+  }
+  return NULL;
+}
+
+/* Make an rPattern from compiled code and the ktable at index ktable,
+ * copying the code and the names of the ktable (see r_newnames).
+ * Direct is the 'direct' flag of the pattern.  Raises a Lua error when
+ * the pattern cannot be exported.
+ */
+rPattern *r_newshared (lua_State *L, const Instruction *code, int codesize, int ktable,
+		       int direct) {
+  const char *why = unshareable(code, codesize);
+  rPattern *p;
+  if (why) luaL_error(L, "cannot export a pattern with a %s", why);
+  p = (rPattern *)malloc(sizeof(rPattern));
+  if (p) {
+    p->code = (Instruction *)malloc(codesize * sizeof(Instruction));
+    p->names = r_newnames(L, ktable, &p->nnames);
+    if (!p->code || !p->names) {
+      free(p->code); free(p->names); free(p);
+      p = NULL;
+    }
+  }
+  if (!p) {
+    luaL_error(L, "not enough memory to export pattern");
+    return NULL;
+  }
+  memcpy(p->code, code, codesize * sizeof(Instruction));
+  p->codesize = codesize;
+  p->refcount = 1;
+  p->direct = direct;
+  return p;
+}
+
+void r_shared_retain (rPattern *p) {
+  __atomic_add_fetch(&p->refcount, 1, __ATOMIC_RELAXED);
+}
+
+void r_shared_release (rPattern *p) {
+  if (__atomic_sub_fetch(&p->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(p->code);
+    free(p->names);
+    free(p);
+  }
+}
+
+/* --------------------------------------------------------------------------------------------------- */
+
+rScratch *r_newscratch (void) {
+  rScratch *sc = (rScratch *)malloc(sizeof(rScratch));
+  if (!sc) return NULL;
+  sc->stack = (Stack *)malloc(SCRATCHBACK * sizeof(Stack));
+  sc->capture = (Capture *)malloc(SCRATCHCAPS * sizeof(Capture));
+  sc->out = r_newbuffer_nolua();
+  if (!sc->stack || !sc->capture || !sc->out) {
+    r_freescratch(sc);
+    return NULL;
+  }
+  sc->stacksize = SCRATCHBACK;
+  sc->capsize = SCRATCHCAPS;
+  return sc;
+}
+
+void r_freescratch (rScratch *sc) {
+  free(sc->stack);
+  free(sc->capture);
+  if (sc->out) r_freebuffer(sc->out);
+  free(sc);
+}
+
+/* Match p against s[start..len-1], appending the encoded captures to
+ * out.  Safe to call from many threads at once with the same p, as
+ * long as each has its own sc and out.  Returns as 'r_vmencode' does.
+ */
+int r_shared_matchinto (const rPattern *p, rScratch *sc, const char *s, size_t len,
+			size_t start, int etype, rBuffer *out, int *leftover, int *abend) {
+  MatchState ms;
+  int res;
+  r_initmatch(&ms, NULL, 0, sc->stack, sc->stacksize, sc->capture, sc->capsize);
+  ms.owned = MATCH_OWNSTACK | MATCH_OWNCAPTURE;	/* so they grow in place */
+  if (p->direct && etype == ENCODE_BYTE) ms.out = out;	/* the vm encodes */
+  res = r_vmencode(&ms, p->code, p->names, s, len, start, etype, out, leftover, abend);
+  sc->stack = ms.stack; sc->stacksize = ms.stacksize;	/* keep what they grew to */
+  sc->capture = ms.capture; sc->capsize = ms.capsize;
+  return res;
+}
+
+/* Same, leaving the encoded captures (only) in sc->out */
+int r_shared_match (const rPattern *p, rScratch *sc, const char *s, size_t len,
+		    size_t start, int etype, int *leftover, int *abend) {
+  sc->out->n = 0;
+  sc->out->failed = 0;
+  return r_shared_matchinto(p, sc, s, len, start, etype, sc->out, leftover, abend);
+}
+
+/* --------------------------------------------------------------------------------------------------- */
+
+static int sharedgc (lua_State *L) {
+  rSharedBox *box = (rSharedBox *)luaL_checkudata(L, 1, ROSIE_SHARED);
+  if (box->sc) r_freescratch(box->sc);
+  if (box->p) r_shared_release(box->p);
+  box->sc = NULL;
+  box->p = NULL;
+  return 0;
+}
+
+/* match(sp, input [, start [, encoding]]): like rmatch, with an
+ * exported pattern.  Returns the encoded captures as a string (or
+ * false when there is no match), the number of leftover chars, and
+ * whether the match ended with a halt.
+ */
+static int sharedmatch (lua_State *L) {
+  rSharedBox *box = (rSharedBox *)luaL_checkudata(L, 1, ROSIE_SHARED);
+  size_t len;
+  const char *s = (lua_type(L, 2) == LUA_TSTRING) ? lua_tolstring(L, 2, &len)
+                                                  : r_bufferdata(L, 2, &len);
+  lua_Integer start = luaL_optinteger(L, 3, 1);
+  int etype = (int) luaL_optinteger(L, 4, ENCODE_BYTE);
+  int leftover = 0, abend = 0, res;
+  luaL_argcheck(L, s != NULL, 2, "string, rbuffer, or mmap expected");
+  luaL_argcheck(L, box->p != NULL, 1, "pattern has been released");
+  if (start < 1) start = 1;
+  if (!box->sc && !(box->sc = r_newscratch())) return luaL_error(L, "not enough memory for match");
+  res = r_shared_match(box->p, box->sc, s, len, (size_t) start - 1, etype, &leftover, &abend);
+  if (res < 0) return luaL_error(L, r_matcherror(-res), MAXBACK);
+  if (res == 0) {
+    lua_pushboolean(L, 0);
+    lua_pushinteger(L, (lua_Integer) len);
+    lua_pushboolean(L, 0);
+  }
+  else {
+    lua_pushlstring(L, box->sc->out->data, box->sc->out->n);
+    lua_pushinteger(L, leftover);
+    lua_pushboolean(L, abend);
+  }
+  return 3;
+}
+
+static int sharedrefs (lua_State *L) {
+  rSharedBox *box = (rSharedBox *)luaL_checkudata(L, 1, ROSIE_SHARED);
+  lua_pushinteger(L, box->p ? __atomic_load_n(&box->p->refcount, __ATOMIC_RELAXED) : 0);
+  return 1;
+}
+
+static struct luaL_Reg shared_meta_reg[] = {
+    {"__gc", sharedgc},
+    {NULL, NULL}
+};
+
+static struct luaL_Reg shared_index_reg[] = {
+    {"match", sharedmatch},
+    {"refs", sharedrefs},
+    {"release", sharedgc},
+    {NULL, NULL}
+};
+
+static void shared_type_init(lua_State *L) {
+  /* Enter with a new metatable on the stack */
+  int top = lua_gettop(L);
+  luaL_setfuncs(L, shared_meta_reg, 0);
+  luaL_newlib(L, shared_index_reg);
+  lua_setfield(L, -2, "__index");
+  lua_settop(L, top);
+  /* Must leave the metatable on the stack */
+}
+
+/* Push a new ROSIE_SHARED for p, which takes over one reference to p */
+void r_pushshared (lua_State *L, rPattern *p) {
+  rSharedBox *box = (rSharedBox *)lua_newuserdata(L, sizeof(rSharedBox));
+  box->p = p;
+  box->sc = NULL;
+  if (luaL_newmetatable(L, ROSIE_SHARED)) shared_type_init(L);
+  lua_setmetatable(L, -2);
+}
+
+/* The rPattern of the ROSIE_SHARED at idx.  C code that keeps it
+ * beyond the life of the userdata (e.g. in another thread) must
+ * retain it.
+ */
+rPattern *r_toshared (lua_State *L, int idx) {
+  rSharedBox *box = (rSharedBox *)luaL_checkudata(L, idx, ROSIE_SHARED);
+  luaL_argcheck(L, box->p != NULL, idx, "pattern has been released");
+  return box->p;
+}
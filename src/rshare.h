@@ -0,0 +1,55 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rshare.h                                                                 */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#if !defined(rshare_h)
+#define rshare_h
+
+#include "lpvm.h"
+
+#define ROSIE_SHARED "ROSIE_SHARED"
+
+/* A compiled pattern exported from a lua_State.  It holds no Lua
+ * references, and it never changes after it is made, so any number of
+ * threads can match with it at once, each with its own rScratch.  It
+ * is freed when its last reference is released.
+ */
+typedef struct rPattern {
+  int refcount;			/* updated atomically */
+  int codesize;			/* number of instructions */
+  Instruction *code;
+  int nnames;
+  rName *names;			/* names[1..nnames], by ktable index */
+  int direct;			/* the vm can encode the captures (see 'setdirect') */
+} rPattern;
+
+/* Per-thread state for matching with an rPattern.  The stack and the
+ * capture list keep the size they grew to, for the next match.
+ */
+typedef struct rScratch {
+  Stack *stack;
+  int stacksize;
+  Capture *capture;
+  int capsize;
+  rBuffer *out;			/* output of the last match */
+} rScratch;
+
+rPattern *r_newshared (lua_State *L, const Instruction *code, int codesize, int ktable,
+		       int direct);
+void r_shared_retain (rPattern *p);
+void r_shared_release (rPattern *p);
+rPattern *r_toshared (lua_State *L, int idx);
+void r_pushshared (lua_State *L, rPattern *p);
+
+rScratch *r_newscratch (void);
+void r_freescratch (rScratch *sc);
+int r_shared_match (const rPattern *p, rScratch *sc, const char *s, size_t len,
+		    size_t start, int etype, int *leftover, int *abend);
+int r_shared_matchinto (const rPattern *p, rScratch *sc, const char *s, size_t len,
+			size_t start, int etype, rBuffer *out, int *leftover, int *abend);
+
+#endif
@@ -0,0 +1,292 @@
+/*  -*- Mode: C; -*-                                                         */
+/*                                                                           */
+/*  rsimd.c   Vectorized scanning of the input (SSE/AVX2 on x86)             */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#include <string.h>
+
+#include "lptypes.h"
+#include "rsimd.h"
+
+#if defined(ROSIE_SIMD)
+#include <immintrin.h>
+#endif
+
+/* --------------------------------------------------------------------------------------------------- */
+/* Portable versions                                                                                   */
+/* --------------------------------------------------------------------------------------------------- */
+
+/* return the first position in [s, e) holding a char that is not in 'cs' (or e) */
+static const char *span_scalar (const byte *cs, const char *s, const char *e) {
+  for (; s < e; s++) {
+    int c = (byte)*s;
+    if (!testchar(cs, c)) break;
+  }
+  return s;
+}
+
+/* return the first position in [s, e) holding a char that is in neither range (or e) */
+static const char *spanrange_scalar (int r1, int r2, const char *s, const char *e) {
+  for (; s < e; s++) {
+    int c = (byte)*s;
+    if (!(inrange(r1, c) || inrange(r2, c))) break;
+  }
+  return s;
+}
+
+/* chars that r_addlstring_json escapes: '"', '/', '\\', 1 to 31, and 127 */
+#define jsonescaped(c) \
+  ((c) == '"' || (c) == '/' || (c) == '\\' || ((c) > 0 && (c) < 32) || (c) == 127)
+
+/* return the first position in [s, e) holding a char to escape in JSON (or e) */
+static const char *jsonscan_scalar (const char *s, const char *e) {
+  for (; s < e; s++) {
+    int c = (byte)*s;
+    if (jsonescaped(c)) break;
+  }
+  return s;
+}
+
+#if !defined(ROSIE_SIMD)
+
+const char *r_span (const byte *cs, const char *s, const char *e) {
+  return span_scalar(cs, s, e);
+}
+
+const char *r_spanrange (int r1, int r2, const char *s, const char *e) {
+  return spanrange_scalar(r1, r2, s, e);
+}
+
+const char *r_jsonscan (const char *s, const char *e) {
+  return jsonscan_scalar(s, e);
+}
+
+#else
+
+/* --------------------------------------------------------------------------------------------------- */
+/* Vectorized versions                                                                                 */
+/* --------------------------------------------------------------------------------------------------- */
+
+/*
+ * Nibble tables for a charset: a char c = 16*h + l is in the set
+ * when bit (h & 7) of tables[l] (for h < 8) or of tables[16 + l] (for
+ * h >= 8) is set.  A PSHUFB instruction indexed by the low nibbles of
+ * 16 chars then fetches the table entries for all of them at once, so
+ * any set of 256 chars can be tested 16 (SSSE3) or 32 (AVX2) bytes at
+ * a time.  The compiler stores these tables right after the charset
+ * of an ISpan instruction.
+ */
+void r_spantables (const byte *cs, byte *tables) {
+  int c;
+  memset(tables, 0, SPANTABLESIZE);
+  for (c = 0; c <= UCHAR_MAX; c++)
+    if (testchar(cs, c))
+      tables[((c >> 7) << 4) | (c & 0xF)] |= (byte)(1 << ((c >> 4) & 7));
+}
+
+__attribute__ ((target("ssse3")))
+static const char *span_ssse3 (const byte *cs, const char *s, const char *e) {
+  const __m128i t0 = _mm_loadu_si128((const __m128i *)(cs + CHARSETSIZE));
+  const __m128i t1 = _mm_loadu_si128((const __m128i *)(cs + CHARSETSIZE + 16));
+  const __m128i bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+				     1, 2, 4, 8, 16, 32, 64, -128);
+  const __m128i nibble = _mm_set1_epi8(0x0F);
+  const __m128i seven = _mm_set1_epi8(7);
+  while (e - s >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)s);
+    __m128i lo = _mm_and_si128(v, nibble);
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+    __m128i upper = _mm_cmpgt_epi8(hi, seven);  /* h >= 8 */
+    __m128i row = _mm_or_si128(_mm_andnot_si128(upper, _mm_shuffle_epi8(t0, lo)),
+			       _mm_and_si128(upper, _mm_shuffle_epi8(t1, lo)));
+    __m128i bit = _mm_shuffle_epi8(bits, hi);
+    __m128i in = _mm_cmpeq_epi8(_mm_and_si128(row, bit), bit);
+    unsigned int out = (unsigned int)_mm_movemask_epi8(in) ^ 0xFFFFu;
+    if (out != 0) return s + __builtin_ctz(out);
+    s += 16;
+  }
+  return span_scalar(cs, s, e);
+}
+
+__attribute__ ((target("avx2")))
+static const char *span_avx2 (const byte *cs, const char *s, const char *e) {
+  const __m256i t0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(cs + CHARSETSIZE)));
+  const __m256i t1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(cs + CHARSETSIZE + 16)));
+  const __m256i bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+					1, 2, 4, 8, 16, 32, 64, -128,
+					1, 2, 4, 8, 16, 32, 64, -128,
+					1, 2, 4, 8, 16, 32, 64, -128);
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  const __m256i seven = _mm256_set1_epi8(7);
+  while (e - s >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)s);
+    __m256i lo = _mm256_and_si256(v, nibble);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble);
+    __m256i upper = _mm256_cmpgt_epi8(hi, seven);  /* h >= 8 */
+    __m256i row = _mm256_blendv_epi8(_mm256_shuffle_epi8(t0, lo),
+				     _mm256_shuffle_epi8(t1, lo), upper);
+    __m256i bit = _mm256_shuffle_epi8(bits, hi);
+    __m256i in = _mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit);
+    unsigned int out = ~(unsigned int)_mm256_movemask_epi8(in);
+    if (out != 0) return s + __builtin_ctz(out);
+    s += 32;
+  }
+  return span_scalar(cs, s, e);
+}
+
+/*
+ * A char c is in range r when (c - first) <= (last - first), as
+ * unsigned bytes, i.e., when min(c - first, last - first) == c - first.
+ */
+__attribute__ ((target("sse2")))
+static const char *spanrange_sse2 (int r1, int r2, const char *s, const char *e) {
+  const __m128i f1 = _mm_set1_epi8((char)rangefirst(r1));
+  const __m128i w1 = _mm_set1_epi8((char)(rangelast(r1) - rangefirst(r1)));
+  const __m128i f2 = _mm_set1_epi8((char)rangefirst(r2));
+  const __m128i w2 = _mm_set1_epi8((char)(rangelast(r2) - rangefirst(r2)));
+  while (e - s >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)s);
+    __m128i d1 = _mm_sub_epi8(v, f1);
+    __m128i d2 = _mm_sub_epi8(v, f2);
+    __m128i in = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(d1, w1), d1),
+			      _mm_cmpeq_epi8(_mm_min_epu8(d2, w2), d2));
+    unsigned int out = (unsigned int)_mm_movemask_epi8(in) ^ 0xFFFFu;
+    if (out != 0) return s + __builtin_ctz(out);
+    s += 16;
+  }
+  return spanrange_scalar(r1, r2, s, e);
+}
+
+__attribute__ ((target("avx2")))
+static const char *spanrange_avx2 (int r1, int r2, const char *s, const char *e) {
+  const __m256i f1 = _mm256_set1_epi8((char)rangefirst(r1));
+  const __m256i w1 = _mm256_set1_epi8((char)(rangelast(r1) - rangefirst(r1)));
+  const __m256i f2 = _mm256_set1_epi8((char)rangefirst(r2));
+  const __m256i w2 = _mm256_set1_epi8((char)(rangelast(r2) - rangefirst(r2)));
+  while (e - s >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)s);
+    __m256i d1 = _mm256_sub_epi8(v, f1);
+    __m256i d2 = _mm256_sub_epi8(v, f2);
+    __m256i in = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(d1, w1), d1),
+				 _mm256_cmpeq_epi8(_mm256_min_epu8(d2, w2), d2));
+    unsigned int out = ~(unsigned int)_mm256_movemask_epi8(in);
+    if (out != 0) return s + __builtin_ctz(out);
+    s += 32;
+  }
+  return spanrange_scalar(r1, r2, s, e);
+}
+
+/*
+ * A char needs escaping when it equals one of the four chars, or when
+ * (c - 1) <= 30 as unsigned bytes (a control char other than NUL).
+ */
+__attribute__ ((target("sse2")))
+static const char *jsonscan_sse2 (const char *s, const char *e) {
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i slash = _mm_set1_epi8('/');
+  const __m128i bslash = _mm_set1_epi8('\\');
+  const __m128i del = _mm_set1_epi8(127);
+  const __m128i one = _mm_set1_epi8(1);
+  const __m128i thirty = _mm_set1_epi8(30);
+  while (e - s >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)s);
+    __m128i d = _mm_sub_epi8(v, one);
+    __m128i esc = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, slash)),
+			       _mm_or_si128(_mm_cmpeq_epi8(v, bslash), _mm_cmpeq_epi8(v, del)));
+    unsigned int out;
+    esc = _mm_or_si128(esc, _mm_cmpeq_epi8(_mm_min_epu8(d, thirty), d));
+    out = (unsigned int)_mm_movemask_epi8(esc);
+    if (out != 0) return s + __builtin_ctz(out);
+    s += 16;
+  }
+  return jsonscan_scalar(s, e);
+}
+
+__attribute__ ((target("avx2")))
+static const char *jsonscan_avx2 (const char *s, const char *e) {
+  const __m256i quote = _mm256_set1_epi8('"');
+  const __m256i slash = _mm256_set1_epi8('/');
+  const __m256i bslash = _mm256_set1_epi8('\\');
+  const __m256i del = _mm256_set1_epi8(127);
+  const __m256i one = _mm256_set1_epi8(1);
+  const __m256i thirty = _mm256_set1_epi8(30);
+  while (e - s >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)s);
+    __m256i d = _mm256_sub_epi8(v, one);
+    __m256i esc = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, quote),
+						  _mm256_cmpeq_epi8(v, slash)),
+				  _mm256_or_si256(_mm256_cmpeq_epi8(v, bslash),
+						  _mm256_cmpeq_epi8(v, del)));
+    unsigned int out;
+    esc = _mm256_or_si256(esc, _mm256_cmpeq_epi8(_mm256_min_epu8(d, thirty), d));
+    out = (unsigned int)_mm256_movemask_epi8(esc);
+    if (out != 0) return s + __builtin_ctz(out);
+    s += 32;
+  }
+  return jsonscan_scalar(s, e);
+}
+
+/* --------------------------------------------------------------------------------------------------- */
+/* Runtime selection of the kernels                                                                    */
+/* --------------------------------------------------------------------------------------------------- */
+
+typedef const char *(*Spanf) (const byte *cs, const char *s, const char *e);
+typedef const char *(*SpanRangef) (int r1, int r2, const char *s, const char *e);
+typedef const char *(*JsonScanf) (const char *s, const char *e);
+
+static const char *span_init (const byte *cs, const char *s, const char *e);
+static const char *spanrange_init (int r1, int r2, const char *s, const char *e);
+static const char *jsonscan_init (const char *s, const char *e);
+
+/* The first call through each pointer detects the CPU features and
+ * replaces all the pointers.  Threads racing on that store the same values. */
+static Spanf spanf = span_init;
+static SpanRangef spanrangef = spanrange_init;
+static JsonScanf jsonscanf = jsonscan_init;
+
+static void selectkernels (void) {
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    spanf = span_avx2;
+    spanrangef = spanrange_avx2;
+    jsonscanf = jsonscan_avx2;
+  }
+  else {
+    spanf = __builtin_cpu_supports("ssse3") ? span_ssse3 : span_scalar;
+    spanrangef = __builtin_cpu_supports("sse2") ? spanrange_sse2 : spanrange_scalar;
+    jsonscanf = __builtin_cpu_supports("sse2") ? jsonscan_sse2 : jsonscan_scalar;
+  }
+}
+
+static const char *span_init (const byte *cs, const char *s, const char *e) {
+  selectkernels();
+  return spanf(cs, s, e);
+}
+
+static const char *spanrange_init (int r1, int r2, const char *s, const char *e) {
+  selectkernels();
+  return spanrangef(r1, r2, s, e);
+}
+
+static const char *jsonscan_init (const char *s, const char *e) {
+  selectkernels();
+  return jsonscanf(s, e);
+}
+
+/* 'cs' is the charset of an ISpan instruction, followed by its nibble tables */
+const char *r_span (const byte *cs, const char *s, const char *e) {
+  return spanf(cs, s, e);
+}
+
+const char *r_spanrange (int r1, int r2, const char *s, const char *e) {
+  return spanrangef(r1, r2, s, e);
+}
+
+const char *r_jsonscan (const char *s, const char *e) {
+  return jsonscanf(s, e);
+}
+
+#endif
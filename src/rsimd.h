@@ -0,0 +1,22 @@
+/*  -*- Mode: C/l; -*-                                                       */
+/*                                                                           */
+/*  rsimd.h                                                                  */
+/*                                                                           */
+/*  © Copyright IBM Corporation 2017.                                        */
+/*  LICENSE: MIT License (https://opensource.org/licenses/mit-license.html)  */
+/*  AUTHOR: Jamie A. Jennings                                                */
+
+#if !defined(rsimd_h)
+#define rsimd_h
+
+#include "lptypes.h"
+
+/* spans shorter than this are read by the VM itself, a byte at a time */
+#define SPANSCALAR 8
+
+void r_spantables (const byte *cs, byte *tables);
+const char *r_span (const byte *cs, const char *s, const char *e);
+const char *r_spanrange (int r1, int r2, const char *s, const char *e);
+const char *r_jsonscan (const char *s, const char *e);
+
+#endif